@@ -0,0 +1,957 @@
+/*
+** $Id: laiolib.c $
+** Asynchronous file I/O
+** See Copyright Notice in lua.h
+*/
+
+#define laiolib_c
+#define LUA_LIB
+
+/* 'syscall' is not part of POSIX */
+#if defined(LUA_USE_LINUX) && !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+
+#include "lprefix.h"
+
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "lauxlib.h"
+#include "lualib.h"
+
+
+/*
+** Tasks are coroutines driven by 'aio.run'. An I/O operation called
+** from a task queues a request and yields the task; 'aio.run' submits
+** all queued requests in batches, waits for their completions, and
+** resumes the corresponding tasks, which then finish the operation in
+** a continuation. Called from outside a task, the operations are
+** simply synchronous.
+**
+** Requests are executed by one of two backends: a Linux io_uring or,
+** where that is not available, a pool of threads doing plain 'pread',
+** 'pwrite', and 'fsync'.
+*/
+
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+/* number of entries in the submission queue of the io_uring */
+#if !defined(L_AIORING)
+#define L_AIORING	256
+#endif
+
+/* number of threads in the fallback backend */
+#if !defined(L_AIOTHREADS)
+#define L_AIOTHREADS	4
+#endif
+
+
+#define AIO_FILE	"AIOFILE*"
+
+
+/* kinds of requests */
+#define AIO_READ	0
+#define AIO_WRITE	1
+#define AIO_FSYNC	2
+
+
+typedef struct AioReq {
+  struct iovec iov;  /* data buffer */
+  off_t offset;
+  long res;  /* result: bytes transferred or -errno */
+  int op;  /* kind of request */
+  int fd;
+  struct AioReq *next;  /* link in request lists */
+  lua_State *co;  /* task waiting for this request */
+  struct AioFile *file;  /* file counting this request as pending */
+} AioReq;
+
+
+typedef struct AioFile {
+  int fd;  /* -1 when closed */
+  int pending;  /* number of requests in flight */
+  int append;  /* true if writes always go to the end of the file */
+  lua_Integer pos;  /* current position */
+} AioFile;
+
+
+/* execute request 'r' synchronously */
+static void doreq (AioReq *r) {
+  ssize_t res;
+  switch (r->op) {
+    case AIO_READ:
+      res = pread(r->fd, r->iov.iov_base, r->iov.iov_len, r->offset);
+      break;
+    case AIO_WRITE:
+      res = pwrite(r->fd, r->iov.iov_base, r->iov.iov_len, r->offset);
+      break;
+    default:
+      res = fsync(r->fd);
+      break;
+  }
+  r->res = (res < 0) ? -errno : (long)res;
+}
+
+
+/*
+** {======================================================
+** Thread-pool backend
+** =======================================================
+*/
+
+typedef struct Pool {
+  pthread_mutex_t mtx;
+  pthread_cond_t work;  /* signals new jobs (or 'stop') */
+  pthread_cond_t done;  /* signals finished jobs */
+  AioReq *jobs;  /* list of requests to be executed */
+  AioReq **lastjob;  /* where to link the next job */
+  AioReq *finished;  /* list of executed requests */
+  int nthreads;
+  int stop;  /* true when the threads must stop */
+  pthread_t thread[L_AIOTHREADS];
+} Pool;
+
+
+static void *worker (void *ud) {
+  Pool *p = (Pool *)ud;
+  pthread_mutex_lock(&p->mtx);
+  for (;;) {
+    AioReq *r;
+    while (p->jobs == NULL && !p->stop)
+      pthread_cond_wait(&p->work, &p->mtx);
+    if (p->jobs == NULL)  /* stopping with nothing to do? */
+      break;
+    r = p->jobs;
+    if ((p->jobs = r->next) == NULL)
+      p->lastjob = &p->jobs;
+    pthread_mutex_unlock(&p->mtx);
+    doreq(r);
+    pthread_mutex_lock(&p->mtx);
+    r->next = p->finished;
+    p->finished = r;
+    pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->mtx);
+  return NULL;
+}
+
+
+/* start the pool; return 0 if it cannot start any thread */
+static int pool_init (Pool *p) {
+  pthread_mutex_init(&p->mtx, NULL);
+  pthread_cond_init(&p->work, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->jobs = p->finished = NULL;
+  p->lastjob = &p->jobs;
+  p->stop = 0;
+  for (p->nthreads = 0; p->nthreads < L_AIOTHREADS; p->nthreads++) {
+    if (pthread_create(&p->thread[p->nthreads], NULL, worker, p) != 0)
+      break;
+  }
+  return (p->nthreads > 0);
+}
+
+
+/* stop the pool, after all its jobs were executed */
+static void pool_close (Pool *p) {
+  int i;
+  pthread_mutex_lock(&p->mtx);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->mtx);
+  for (i = 0; i < p->nthreads; i++)
+    pthread_join(p->thread[i], NULL);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->work);
+  pthread_mutex_destroy(&p->mtx);
+}
+
+
+/* give list of requests 'l' to the pool; return how many were given */
+static int pool_submit (Pool *p, AioReq *l) {
+  int n = 0;
+  pthread_mutex_lock(&p->mtx);
+  *p->lastjob = l;
+  for (; l != NULL; l = l->next) {
+    p->lastjob = &l->next;
+    n++;
+  }
+  pthread_cond_broadcast(&p->work);
+  pthread_mutex_unlock(&p->mtx);
+  return n;
+}
+
+
+/*
+** Return the list of requests already executed. If 'wait', wait for
+** at least one.
+*/
+static AioReq *pool_reap (Pool *p, int wait) {
+  AioReq *l;
+  pthread_mutex_lock(&p->mtx);
+  while (wait && p->finished == NULL)
+    pthread_cond_wait(&p->done, &p->mtx);
+  l = p->finished;
+  p->finished = NULL;
+  pthread_mutex_unlock(&p->mtx);
+  return l;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** io_uring backend
+** =======================================================
+*/
+
+#if defined(LUA_USE_LINUX) && defined(__GNUC__) && \
+    defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define L_USEURING
+#endif
+#endif
+
+
+#if defined(L_USEURING)		/* { */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define ld_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define st_release(p,v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+
+typedef struct Ring {
+  int fd;
+  unsigned sqentries, cqentries;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqptr, *cqptr;  /* mapped rings */
+  size_t sqsize, cqsize;
+} Ring;
+
+
+/* create a ring; return 0 if the system does not support it */
+static int ring_init (Ring *r) {
+  struct io_uring_params p;
+  char *sq, *cq;
+  memset(&p, 0, sizeof(p));
+  r->fd = (int)syscall(__NR_io_uring_setup, L_AIORING, &p);
+  if (r->fd < 0)
+    return 0;
+  r->sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {  /* one mapping for both? */
+    if (r->cqsize > r->sqsize) r->sqsize = r->cqsize;
+    r->cqsize = 0;
+  }
+  r->sqptr = mmap(NULL, r->sqsize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sqptr == MAP_FAILED) goto fail1;
+  if (r->cqsize == 0)
+    r->cqptr = r->sqptr;
+  else {
+    r->cqptr = mmap(NULL, r->cqsize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cqptr == MAP_FAILED) goto fail2;
+  }
+  r->sqes = (struct io_uring_sqe *)mmap(NULL,
+                  p.sq_entries * sizeof(struct io_uring_sqe),
+                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) goto fail3;
+  sq = (char *)r->sqptr; cq = (char *)r->cqptr;
+  r->sqentries = p.sq_entries;
+  r->cqentries = p.cq_entries;
+  r->sqhead = (unsigned *)(sq + p.sq_off.head);
+  r->sqtail = (unsigned *)(sq + p.sq_off.tail);
+  r->sqmask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sqarray = (unsigned *)(sq + p.sq_off.array);
+  r->cqhead = (unsigned *)(cq + p.cq_off.head);
+  r->cqtail = (unsigned *)(cq + p.cq_off.tail);
+  r->cqmask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+ fail3:
+  if (r->cqsize != 0) munmap(r->cqptr, r->cqsize);
+ fail2:
+  munmap(r->sqptr, r->sqsize);
+ fail1:
+  close(r->fd);
+  return 0;
+}
+
+
+static void ring_close (Ring *r) {
+  munmap(r->sqes, r->sqentries * sizeof(struct io_uring_sqe));
+  if (r->cqsize != 0) munmap(r->cqptr, r->cqsize);
+  munmap(r->sqptr, r->sqsize);
+  close(r->fd);
+}
+
+
+/*
+** Put up to 'max' requests from list '*l' in the submission queue,
+** while there is space, removing them from the list. Return how many
+** were put.
+*/
+static unsigned ring_fill (Ring *r, AioReq **l, unsigned max) {
+  static const unsigned char opcode[] =
+      {IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_FSYNC};
+  unsigned tail = *r->sqtail;  /* only this thread changes it */
+  unsigned n = 0;
+  while (*l != NULL && n < max &&
+         tail - ld_acquire(r->sqhead) < r->sqentries) {
+    AioReq *q = *l;
+    unsigned i = tail & *r->sqmask;
+    struct io_uring_sqe *e = &r->sqes[i];
+    memset(e, 0, sizeof(*e));
+    e->opcode = opcode[q->op];
+    e->fd = q->fd;
+    if (q->op != AIO_FSYNC) {
+      e->addr = (unsigned long)&q->iov;
+      e->len = 1;
+      e->off = (unsigned long long)q->offset;
+    }
+    e->user_data = (unsigned long long)(size_t)q;
+    r->sqarray[i] = i;
+    tail++; n++;
+    *l = q->next;
+  }
+  st_release(r->sqtail, tail);
+  return n;
+}
+
+
+/*
+** Submit 'n' queued entries and, if 'wait', wait for at least one
+** completion. Return false on errors.
+*/
+static int ring_enter (Ring *r, unsigned n, int wait) {
+  while (n > 0 || wait) {
+    long res = syscall(__NR_io_uring_enter, r->fd, n, wait ? 1 : 0,
+                       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res < 0) {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;  /* try again */
+      return 0;
+    }
+    n -= (unsigned)res;
+    wait = 0;
+  }
+  return 1;
+}
+
+
+/* return the list of completed requests */
+static AioReq *ring_reap (Ring *r) {
+  AioReq *l = NULL;
+  unsigned head = *r->cqhead;
+  unsigned tail = ld_acquire(r->cqtail);
+  for (; head != tail; head++) {
+    struct io_uring_cqe *e = &r->cqes[head & *r->cqmask];
+    AioReq *q = (AioReq *)(size_t)e->user_data;
+    q->res = e->res;
+    q->next = l;
+    l = q;
+  }
+  st_release(r->cqhead, head);
+  return l;
+}
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Scheduler
+** =======================================================
+*/
+
+/* backends */
+#define B_NONE		0	/* not started yet */
+#define B_URING		1
+#define B_THREADS	2
+
+static const char *const backnames[] = {"none", "io_uring", "threads", NULL};
+
+
+/*
+** State of the library. Its user values are a queue of ready tasks
+** (1), with the arguments to resume each of them, and a table with
+** the tasks waiting for requests (2).
+*/
+typedef struct Aio {
+  int backend;
+  int wanted;  /* backend asked by 'aio.backend' */
+  int running;  /* true while 'aio.run' runs */
+  int inflight;  /* number of submitted requests not reaped */
+  lua_Integer rfirst, rlast;  /* ready queue is [rfirst, rlast) */
+  AioReq *queue;  /* requests not submitted yet */
+  AioReq *done;  /* reaped requests whose tasks were not resumed yet */
+  AioReq **lastq;  /* where to link the next request */
+  lua_State *current;  /* task being run */
+  int yielded;  /* true if 'current' yielded for a request */
+  Pool pool;
+#if defined(L_USEURING)
+  Ring ring;
+#endif
+} Aio;
+
+
+#define toaio(L)	((Aio *)lua_touserdata(L, lua_upvalueindex(1)))
+
+
+static void startbackend (lua_State *L, Aio *a) {
+#if defined(L_USEURING)
+  if (a->wanted != B_THREADS && ring_init(&a->ring)) {
+    a->backend = B_URING;
+    return;
+  }
+#endif
+  if (pool_init(&a->pool))
+    a->backend = B_THREADS;
+  else
+    luaL_error(L, "cannot start asynchronous I/O");
+}
+
+
+/*
+** Submit queued requests and, if 'wait', wait for some completion. The
+** io_uring gets at most as many requests as its completion queue can
+** hold; the rest stay queued for later.
+*/
+static void submitall (lua_State *L, Aio *a, int wait) {
+  AioReq *l = a->queue;
+#if defined(L_USEURING)
+  if (a->backend == B_URING) {
+    Ring *r = &a->ring;
+    unsigned n;
+    do {
+      n = ring_fill(r, &l, r->cqentries - (unsigned)a->inflight);
+      a->inflight += n;
+      /* wait only after submitting all that is possible */
+      if (!ring_enter(r, n, wait && (n == 0 || l == NULL)))
+        luaL_error(L, "io_uring error: %s", strerror(errno));
+    } while (n > 0 && l != NULL);
+    a->queue = l;
+    if (l == NULL) a->lastq = &a->queue;
+    return;
+  }
+#endif
+  a->queue = NULL;
+  a->lastq = &a->queue;
+  a->inflight += pool_submit(&a->pool, l);
+  (void)L; (void)wait;  /* threads backend waits in 'reap' */
+}
+
+
+static AioReq *reap (Aio *a, int wait) {
+  AioReq *l, *r;
+#if defined(L_USEURING)
+  if (a->backend == B_URING)
+    l = ring_reap(&a->ring);
+  else
+#endif
+  l = pool_reap(&a->pool, wait);
+  for (r = l; r != NULL; r = r->next) {
+    a->inflight--;
+    r->file->pending--;  /* even if its task is gone */
+  }
+  return l;
+}
+
+
+static int aio_gc (lua_State *L) {
+  Aio *a = (Aio *)lua_touserdata(L, 1);
+  while (a->inflight > 0) {  /* kernel/threads may still use buffers */
+    reap(a, 1);
+#if defined(L_USEURING)
+    if (a->inflight > 0 && a->backend == B_URING)
+      ring_enter(&a->ring, 0, 1);
+#endif
+  }
+#if defined(L_USEURING)
+  if (a->backend == B_URING) ring_close(&a->ring);
+#endif
+  if (a->backend == B_THREADS) pool_close(&a->pool);
+  a->backend = B_NONE;
+  return 0;
+}
+
+
+/* put task at the top of the stack in the ready queue */
+static void addready (lua_State *L, Aio *a) {
+  lua_getiuservalue(L, lua_upvalueindex(1), 1);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, a->rlast++);
+  lua_pop(L, 1);
+}
+
+
+/*
+** Resume task 'co' with 'narg' arguments on its stack. Return true if
+** it is still alive.
+*/
+static int resumetask (lua_State *L, Aio *a, lua_State *co, int narg) {
+  int nres;
+  int status;
+  a->current = co;
+  a->yielded = 0;
+  status = lua_resume(co, L, narg, &nres);
+  a->current = NULL;
+  if (status == LUA_YIELD) {
+    lua_pop(co, nres);  /* ignore values from other yields */
+    if (!a->yielded) {  /* a plain 'coroutine.yield'? */
+      lua_pushthread(co);
+      lua_xmove(co, L, 1);
+      addready(L, a);  /* run it again later */
+    }
+    return 1;
+  }
+  else if (status == LUA_OK)
+    return 0;
+  else {  /* error */
+    lua_xmove(co, L, 1);  /* move error message */
+    lua_resetthread(co);  /* close its variables */
+    a->running = 0;  /* other tasks may continue in a new 'aio.run' */
+    return lua_error(L);  /* propagate error */
+  }
+}
+
+
+/*
+** Resume the tasks waiting for the requests in list 'a->done'. Each
+** request leaves the list before its task runs, so that, if the task
+** raises an error, the rest of the list is resumed by the next run.
+** Tasks closed while waiting are not resumed.
+*/
+static void finishreqs (lua_State *L, Aio *a) {
+  while (a->done != NULL) {
+    lua_State *co = a->done->co;
+    a->done = a->done->next;  /* request may be reused by the task */
+    lua_getiuservalue(L, lua_upvalueindex(1), 2);
+    lua_pushthread(co);
+    lua_xmove(co, L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, -3);  /* remove it from waiting tasks */
+    lua_pushthread(co);  /* keep it alive while it runs */
+    lua_xmove(co, L, 1);
+    if (lua_status(co) == LUA_YIELD)  /* task still waiting? */
+      resumetask(L, a, co, 0);
+    lua_pop(L, 2);
+  }
+}
+
+
+/*
+** Queue request 'r' (whose userdata is at index 'ctx') for file 'f'
+** (at index 1) and yield the task, to continue in 'k'. Outside tasks,
+** just execute the request and call 'k'. The file counts the request
+** as pending from the moment it is queued until it is reaped. (The
+** request, and through its first user value the file, are kept alive
+** even if the task is closed while waiting.)
+*/
+static int aio_wait (lua_State *L, AioFile *f, AioReq *r,
+                     lua_KContext ctx, lua_KFunction k) {
+  Aio *a = toaio(L);
+  if (a->current != L) {  /* not called from a running task? */
+    doreq(r);
+    return k(L, LUA_OK, ctx);
+  }
+  if (a->backend == B_NONE)
+    startbackend(L, a);
+  lua_getiuservalue(L, lua_upvalueindex(1), 2);
+  lua_pushthread(L);
+  lua_pushvalue(L, (int)ctx);
+  lua_rawset(L, -3);  /* keep task and request alive */
+  lua_pop(L, 1);
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, (int)ctx, 1);  /* keep file alive with request */
+  r->co = L;
+  r->file = f;
+  r->next = NULL;
+  *a->lastq = r;
+  a->lastq = &r->next;
+  f->pending++;
+  a->yielded = 1;
+  return lua_yieldk(L, 0, ctx, k);
+}
+
+
+static int aio_spawn (lua_State *L) {
+  Aio *a = toaio(L);
+  int n = lua_gettop(L);
+  lua_State *co;
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  co = lua_newthread(L);
+  lua_insert(L, 1);  /* put thread below function and arguments */
+  lua_xmove(L, co, n);  /* move function and arguments to 'co' */
+  addready(L, a);
+  return 0;
+}
+
+
+/*
+** Run ready tasks until all of them have finished. Between rounds,
+** all requests queued by the tasks go to the backend in a single
+** batch.
+*/
+static int aio_run (lua_State *L) {
+  Aio *a = toaio(L);
+  luaL_argcheck(L, !a->running, 1, "'aio.run' is already running");
+  if (!lua_isnoneornil(L, 1))
+    aio_spawn(L);  /* new task with the given arguments */
+  lua_settop(L, 0);
+  a->running = 1;
+  lua_getiuservalue(L, lua_upvalueindex(1), 1);  /* ready queue */
+  for (;;) {
+    while (a->rfirst < a->rlast) {  /* run all ready tasks */
+      lua_State *co;
+      lua_Integer i = a->rfirst++;
+      lua_rawgeti(L, 1, i);
+      lua_pushnil(L);
+      lua_rawseti(L, 1, i);
+      co = lua_tothread(L, -1);
+      if (lua_status(co) == LUA_OK)  /* starting? */
+        resumetask(L, a, co, lua_gettop(co) - 1);
+      else
+        resumetask(L, a, co, 0);
+      lua_pop(L, 1);
+    }
+    if (a->done == NULL) {  /* no tasks left from an interrupted run? */
+      if (a->queue == NULL && a->inflight == 0)
+        break;  /* nothing else to do */
+      submitall(L, a, 1);
+      a->done = reap(a, 1);
+    }
+    finishreqs(L, a);
+  }
+  a->rfirst = a->rlast = 1;
+  a->running = 0;
+  return 0;
+}
+
+
+/*
+** aio.backend([name]): return the backend in use ("none" before the
+** first request); before that, 'name' may ask for a backend.
+*/
+static int aio_backend (lua_State *L) {
+  Aio *a = toaio(L);
+  if (!lua_isnoneornil(L, 1)) {
+    int b = luaL_checkoption(L, 1, NULL, backnames);
+    luaL_argcheck(L, a->backend == B_NONE, 1, "backend already started");
+    a->wanted = b;
+    if (b != B_NONE) startbackend(L, a);
+  }
+  lua_pushstring(L, backnames[a->backend]);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Files
+** =======================================================
+*/
+
+static AioFile *tofile (lua_State *L) {
+  AioFile *f = (AioFile *)luaL_checkudata(L, 1, AIO_FILE);
+  if (f->fd < 0)
+    luaL_error(L, "attempt to use a closed file");
+  return f;
+}
+
+
+static int aio_open (lua_State *L) {
+  static const char *const modes[] =
+      {"r", "w", "a", "r+", "w+", "a+", NULL};
+  static const int flags[] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+      O_WRONLY | O_CREAT | O_APPEND, O_RDWR, O_RDWR | O_CREAT | O_TRUNC,
+      O_RDWR | O_CREAT | O_APPEND};
+  const char *fname = luaL_checkstring(L, 1);
+  int m = luaL_checkoption(L, 2, "r", modes);
+  AioFile *f = (AioFile *)lua_newuserdatauv(L, sizeof(AioFile), 0);
+  f->fd = -1;
+  f->pending = 0;
+  f->append = (flags[m] & O_APPEND) != 0;
+  f->pos = 0;
+  luaL_setmetatable(L, AIO_FILE);
+  f->fd = open(fname, flags[m], 0666);
+  return (f->fd < 0) ? luaL_fileresult(L, 0, fname) : 1;
+}
+
+
+/* push results for a failed request */
+static int reqerror (lua_State *L, AioReq *r) {
+  errno = (int)-r->res;
+  return luaL_fileresult(L, 0, NULL);
+}
+
+
+/* get request at index 'idx' of a continuation */
+#define getreq(L,idx)	((AioReq *)lua_touserdata(L, (int)(idx)))
+
+
+static int finishread (lua_State *L, int status, lua_KContext ctx) {
+  AioFile *f = (AioFile *)lua_touserdata(L, 1);
+  AioReq *r = getreq(L, ctx);
+  (void)status;
+  if (r->res < 0)
+    return reqerror(L, r);
+  else if (r->res == 0 && r->iov.iov_len > 0) {  /* end of file? */
+    luaL_pushfail(L);
+    return 1;
+  }
+  f->pos = (lua_Integer)r->offset + r->res;
+  lua_pushlstring(L, (char *)r->iov.iov_base, (size_t)r->res);
+  return 1;
+}
+
+
+/*
+** file:read(n [, offset]): read up to 'n' bytes, from the current
+** position or from 'offset'.
+*/
+static int f_read (lua_State *L) {
+  AioFile *f = tofile(L);
+  lua_Integer n = luaL_checkinteger(L, 2);
+  lua_Integer off = luaL_optinteger(L, 3, f->pos);
+  AioReq *r;
+  luaL_argcheck(L, 0 <= n && (lua_Unsigned)n <= (~(size_t)0 >> 1), 2,
+                   "invalid size");
+  luaL_argcheck(L, off >= 0 && (lua_Integer)(off_t)off == off, 3,
+                   "invalid offset");
+  lua_settop(L, 3);
+  r = (AioReq *)lua_newuserdatauv(L, sizeof(AioReq) + (size_t)n, 1);
+  r->op = AIO_READ;
+  r->fd = f->fd;
+  r->iov.iov_base = (void *)(r + 1);
+  r->iov.iov_len = (size_t)n;
+  r->offset = (off_t)off;
+  return aio_wait(L, f, r, 4, finishread);
+}
+
+
+static int finishwrite (lua_State *L, int status, lua_KContext ctx) {
+  AioFile *f = (AioFile *)lua_touserdata(L, 1);
+  AioReq *r = getreq(L, ctx);
+  (void)status;
+  if (r->res < 0)
+    return reqerror(L, r);
+  r->offset += r->res;
+  if ((size_t)r->res < r->iov.iov_len) {  /* partial write? */
+    r->iov.iov_base = (char *)r->iov.iov_base + r->res;
+    r->iov.iov_len -= (size_t)r->res;
+    r->fd = tofile(L)->fd;  /* file may have been closed meanwhile */
+    return aio_wait(L, f, r, ctx, finishwrite);  /* write the rest */
+  }
+  if (f->append && f->fd >= 0) {  /* data went to the end of the file? */
+    off_t end = lseek(f->fd, 0, SEEK_END);
+    f->pos = (lua_Integer)((end >= 0) ? end : r->offset);
+  }
+  else
+    f->pos = (lua_Integer)r->offset;
+  lua_settop(L, 1);
+  return 1;  /* return file */
+}
+
+
+/*
+** file:write(s [, offset]): write string 's', at the current position
+** or at 'offset'. (The request keeps the string as its second user
+** value, so it uses the string directly.)
+*/
+static int f_write (lua_State *L) {
+  AioFile *f = tofile(L);
+  size_t l;
+  const char *s = luaL_checklstring(L, 2, &l);
+  lua_Integer off = luaL_optinteger(L, 3, f->pos);
+  AioReq *r;
+  luaL_argcheck(L, off >= 0 && (lua_Integer)(off_t)off == off, 3,
+                   "invalid offset");
+  if (l == 0) {  /* nothing to write? */
+    f->pos = off;
+    lua_settop(L, 1);
+    return 1;  /* return file */
+  }
+  lua_settop(L, 3);
+  r = (AioReq *)lua_newuserdatauv(L, sizeof(AioReq), 2);
+  lua_pushvalue(L, 2);
+  lua_setiuservalue(L, -2, 2);  /* keep string alive with the request */
+  r->op = AIO_WRITE;
+  r->fd = f->fd;
+  r->iov.iov_base = (void *)s;
+  r->iov.iov_len = l;
+  r->offset = (off_t)off;
+  return aio_wait(L, f, r, 4, finishwrite);
+}
+
+
+static int finishsync (lua_State *L, int status, lua_KContext ctx) {
+  AioReq *r = getreq(L, ctx);
+  (void)status;
+  if (r->res < 0)
+    return reqerror(L, r);
+  lua_settop(L, 1);
+  return 1;  /* return file */
+}
+
+
+static int f_sync (lua_State *L) {
+  AioFile *f = tofile(L);
+  AioReq *r;
+  lua_settop(L, 1);
+  r = (AioReq *)lua_newuserdatauv(L, sizeof(AioReq), 1);
+  r->op = AIO_FSYNC;
+  r->fd = f->fd;
+  return aio_wait(L, f, r, 2, finishsync);
+}
+
+
+static int f_seek (lua_State *L) {
+  AioFile *f = tofile(L);
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Integer pos = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, pos >= 0, 2, "invalid position");
+    f->pos = pos;
+  }
+  lua_pushinteger(L, f->pos);
+  return 1;
+}
+
+
+static int aux_close (lua_State *L, AioFile *f) {
+  int res;
+  if (f->pending > 0)
+    return luaL_error(L, "attempt to close a file with pending operations");
+  res = close(f->fd);
+  f->fd = -1;
+  return luaL_fileresult(L, (res == 0), NULL);
+}
+
+
+static int f_close (lua_State *L) {
+  return aux_close(L, tofile(L));
+}
+
+
+/* __close: close file (if not closed yet), raising errors */
+static int f_tbc (lua_State *L) {
+  AioFile *f = (AioFile *)luaL_checkudata(L, 1, AIO_FILE);
+  if (f->fd >= 0)
+    aux_close(L, f);
+  return 0;
+}
+
+
+static int f_gc (lua_State *L) {
+  AioFile *f = (AioFile *)luaL_checkudata(L, 1, AIO_FILE);
+  if (f->fd >= 0 && f->pending == 0) {
+    close(f->fd);
+    f->fd = -1;
+  }
+  return 0;
+}
+
+
+static int f_tostring (lua_State *L) {
+  AioFile *f = (AioFile *)luaL_checkudata(L, 1, AIO_FILE);
+  if (f->fd < 0)
+    lua_pushliteral(L, "aio file (closed)");
+  else
+    lua_pushfstring(L, "aio file (%d)", f->fd);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+static const luaL_Reg aio_funcs[] = {
+  {"backend", aio_backend},
+  {"open", aio_open},
+  {"run", aio_run},
+  {"spawn", aio_spawn},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg meth[] = {
+  {"read", f_read},
+  {"write", f_write},
+  {"sync", f_sync},
+  {"seek", f_seek},
+  {"close", f_close},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg metameth[] = {
+  {"__index", NULL},  /* place holder */
+  {"__gc", f_gc},
+  {"__close", f_tbc},
+  {"__tostring", f_tostring},
+  {NULL, NULL}
+};
+
+
+LUAMOD_API int luaopen_aio (lua_State *L) {
+  Aio *a = (Aio *)lua_newuserdatauv(L, sizeof(Aio), 2);
+  memset(a, 0, sizeof(Aio));
+  a->rfirst = a->rlast = 1;
+  a->lastq = &a->queue;
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 1);  /* ready queue */
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 2);  /* waiting tasks */
+  lua_newtable(L);  /* metatable for state */
+  lua_pushcfunction(L, aio_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  /* all functions (and methods) share the state as upvalue */
+  luaL_newmetatable(L, AIO_FILE);  /* metatable for files */
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, metameth, 1);
+  luaL_newlibtable(L, meth);
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, meth, 1);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+  lua_pop(L, 1);  /* pop metatable */
+  luaL_newlibtable(L, aio_funcs);
+  lua_rotate(L, -2, 1);  /* put library table below state */
+  luaL_setfuncs(L, aio_funcs, 1);
+  return 1;
+}
+
+
+#else				/* }{ */
+
+LUAMOD_API int luaopen_aio (lua_State *L) {
+  return luaL_error(L, "'aio' not supported");
+}
+
+#endif				/* } */
+
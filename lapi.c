@@ -352,6 +352,18 @@ LUA_API size_t lua_stringtonumber (lua_State *L, const char *s) {
 }
 
 
+LUA_API unsigned lua_numbertostrbuff (lua_State *L, int idx, char *buff) {
+  const TValue *o = index2value(L, idx);
+  if (ttisnumber(o)) {
+    unsigned len = cast_uint(luaO_tostringbuff(o, buff));
+    buff[len++] = '\0';  /* add final zero */
+    return len;
+  }
+  else
+    return 0;
+}
+
+
 LUA_API lua_Number lua_tonumberx (lua_State *L, int idx, int *pisnum) {
   lua_Number n = 0;
   const TValue *o = index2value(L, idx);
@@ -1051,6 +1063,22 @@ LUA_API int lua_pcallk (lua_State *L, int nargs, int nresults, int errfunc,
 }
 
 
+/*
+** Set the environment of a function just loaded.
+*/
+static void setloadedenv (lua_State *L) {
+  LClosure *f = clLvalue(s2v(L->top - 1));  /* get newly created function */
+  if (f->nupvalues >= 1) {  /* does it have an upvalue? */
+    /* get global table from registry */
+    Table *reg = hvalue(&G(L)->l_registry);
+    const TValue *gt = luaH_getint(reg, LUA_RIDX_GLOBALS);
+    /* set global table as 1st upvalue of 'f' (may be LUA_ENV) */
+    setobj(L, f->upvals[0]->v, gt);
+    luaC_barrier(L, f->upvals[0], gt);
+  }
+}
+
+
 LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
                       const char *chunkname, const char *mode) {
   ZIO z;
@@ -1058,18 +1086,48 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
   lua_lock(L);
   if (!chunkname) chunkname = "?";
   luaZ_init(L, &z, reader, data);
-  status = luaD_protectedparser(L, &z, chunkname, mode);
-  if (status == LUA_OK) {  /* no errors? */
-    LClosure *f = clLvalue(s2v(L->top - 1));  /* get newly created function */
-    if (f->nupvalues >= 1) {  /* does it have an upvalue? */
-      /* get global table from registry */
-      Table *reg = hvalue(&G(L)->l_registry);
-      const TValue *gt = luaH_getint(reg, LUA_RIDX_GLOBALS);
-      /* set global table as 1st upvalue of 'f' (may be LUA_ENV) */
-      setobj(L, f->upvals[0]->v, gt);
-      luaC_barrier(L, f->upvals[0], gt);
-    }
-  }
+  status = luaD_protectedparser(L, &z, chunkname, mode, NULL);
+  if (status == LUA_OK)  /* no errors? */
+    setloadedenv(L);
+  lua_unlock(L);
+  return status;
+}
+
+
+static const char *noreader (lua_State *L, void *data, size_t *size) {
+  UNUSED(L); UNUSED(data);
+  *size = 0;
+  return NULL;
+}
+
+
+/*
+** Load a chunk from buffer 'buff', which stays valid and unchanged
+** until Lua calls 'release(ud, buff, size, 0)'. A precompiled chunk
+** may use parts of the buffer in place (when they are properly
+** aligned), instead of copying them; in that case, the buffer is
+** released when the last function using it is collected. Otherwise,
+** it is released before 'lua_loadmapped' returns.
+*/
+LUA_API int lua_loadmapped (lua_State *L, const char *buff, size_t size,
+                            lua_Alloc release, void *ud,
+                            const char *chunkname, const char *mode) {
+  ZIO z;
+  Mapped m;
+  int status;
+  lua_lock(L);
+  if (!chunkname) chunkname = "?";
+  m.buff = buff; m.size = size;
+  m.release = release; m.ud = ud;
+  m.nrefs = 0;  /* 'luaU_undump' sets it when prototypes use the buffer */
+  m.lazy = (mode != NULL && strchr(mode, 'l') != NULL);
+  luaZ_init(L, &z, noreader, NULL);
+  z.p = buff; z.n = size;  /* whole chunk is already in the buffer */
+  status = luaD_protectedparser(L, &z, chunkname, mode, &m);
+  if (m.nrefs == 0)  /* buffer not in use? */
+    (*release)(ud, cast_voidp(buff), size, 0);
+  if (status == LUA_OK)  /* no errors? */
+    setloadedenv(L);
   lua_unlock(L);
   return status;
 }
@@ -1422,3 +1480,31 @@ LUA_API void lua_upvaluejoin (lua_State *L, int fidx1, int n1,
 }
 
 
+LUA_API void *lua_codeid (lua_State *L, int fidx) {
+  TValue *fi = index2value(L, fidx);
+  api_check(L, ttisLclosure(fi), "Lua function expected");
+  return clLvalue(fi)->p;
+}
+
+
+/*
+** Push a new closure with the prototype of the Lua function at 'fidx'
+** and new (closed) upvalues, all with nil.
+*/
+LUA_API void lua_clonefunction (lua_State *L, int fidx) {
+  LClosure *f, *cl;
+  TValue *fi;
+  lua_lock(L);
+  fi = index2value(L, fidx);
+  api_check(L, ttisLclosure(fi), "Lua function expected");
+  f = clLvalue(fi);
+  cl = luaF_newLclosure(L, f->nupvalues);
+  cl->p = f->p;
+  setclLvalue2s(L, L->top, cl);
+  api_incr_top(L);
+  luaF_initupvals(L, cl);
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+
@@ -298,6 +298,59 @@ LUALIB_API int luaL_execresult (lua_State *L, int stat) {
   }
 }
 
+
+/*
+** l_procid() identifies the running process. It goes into the names of
+** temporary files, which otherwise would be built only from the address
+** of a state, and forked processes share addresses.
+*/
+#if !defined(l_procid)	/* { */
+
+#if defined(LUA_USE_POSIX)
+
+#include <unistd.h>
+
+#define l_procid()	((int)getpid())
+
+#else
+
+#define l_procid()	0
+
+#endif
+
+#endif				/* } */
+
+
+/*
+** Push a name for a temporary version of file 'fname', unique among
+** the states of all processes.
+*/
+LUALIB_API const char *luaL_pushtmpname (lua_State *L, const char *fname) {
+  return lua_pushfstring(L, "%s.%d.%p", fname, l_procid(), (void *)L);
+}
+
+
+/*
+** If 'ok', replace file 'fname' with file 'tname' (written under a
+** name from 'luaL_pushtmpname'), so that nobody sees 'fname' incomplete
+** and processes that have the old file open or mapped keep it.
+** Otherwise, or if that fails, remove 'tname', keeping 'errno'.
+** Return whether 'fname' was replaced.
+*/
+LUALIB_API int luaL_replacefile (const char *tname, const char *fname,
+                                 int ok) {
+  if (ok && rename(tname, fname) != 0) {
+    remove(fname);  /* some systems do not rename over existing files */
+    ok = (rename(tname, fname) == 0);
+  }
+  if (!ok) {
+    int en = errno;
+    remove(tname);
+    errno = en;
+  }
+  return ok;
+}
+
 /* }====================================================== */
 
 
@@ -751,11 +804,233 @@ static int skipcomment (LoadF *lf, int *cp) {
 }
 
 
+/*
+** {======================================================
+** Loading of mapped binary files (mode 'm')
+** =======================================================
+*/
+
+#if !defined(l_loadmapped)	/* { */
+
+#if defined(LUA_USE_POSIX)
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* release function for 'lua_loadmapped'; 'ud' is the whole mapping */
+static void *unmapf (void *ud, void *ptr, size_t osize, size_t nsize) {
+  char *base = (char *)ud;
+  (void)nsize;  /* always 0 */
+  munmap(base, (size_t)((char *)ptr - base) + osize);
+  return NULL;
+}
+
+
+/*
+** Load the contents of binary file 'f', after its first 'offset'
+** bytes, from a private memory map of the file, so that the code of
+** its functions can be used in place. Return -1 if 'f' cannot be
+** mapped.
+*/
+static int l_loadmapped (lua_State *L, FILE *f, long offset,
+                         const char *chunkname, const char *mode) {
+  struct stat st;
+  size_t size;
+  void *p;
+  if (offset < 0 || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size <= offset || (off_t)(size_t)st.st_size != st.st_size)
+    return -1;
+  size = (size_t)st.st_size;
+  p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (p == MAP_FAILED)
+    return -1;
+  return lua_loadmapped(L, (char *)p + offset, size - (size_t)offset,
+                           unmapf, p, chunkname, mode);
+}
+
+#else
+
+#define l_loadmapped(L,f,offset,chunkname,mode)	(-1)
+
+#endif
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Cache of compiled chunks
+** =======================================================
+*/
+
+/*
+** A cache file keeps the precompiled chunk for a source file, after a
+** key with the name, the modification time, and the size of that file,
+** followed by its whole contents. So, a cached chunk is used only for
+** the exact source it was compiled from. Cache files are named after
+** their source files, with directory separators replaced by '_' and
+** ".luac" added (e.g., "lib/m.lua" is cached as "lib_m.lua.luac").
+*/
+
+#if !defined(l_getmtime)	/* { */
+
+#if defined(LUA_USE_POSIX)
+
+#include <sys/stat.h>
+
+static lua_Integer l_getmtime (const char *fname) {
+  struct stat st;
+  return (stat(fname, &st) == 0) ? (lua_Integer)st.st_mtime : 0;
+}
+
+#else
+
+#define l_getmtime(fname)	((void)(fname), 0)
+
+#endif
+
+#endif				/* } */
+
+
+/*
+** If the cache is enabled and 'mode' accepts both text and binary
+** chunks, push the cache table, the key for file 'filename', and the
+** name of its cache file, and return 1. Otherwise, push nothing and
+** return 0. (A cached chunk is binary, so it cannot stand for a file
+** when only text chunks are allowed.)
+*/
+static int findcache (lua_State *L, const char *filename,
+                                    const char *mode) {
+  luaL_Buffer b;
+  FILE *f;
+  size_t n;
+  int err;
+  if (mode != NULL && (strchr(mode, 't') == NULL || strchr(mode, 'b') == NULL))
+    return 0;  /* cannot use a binary chunk for a text file */
+  if (lua_getfield(L, LUA_REGISTRYINDEX, LUA_CACHE_TABLE) != LUA_TTABLE) {
+    lua_pop(L, 1);  /* no cache (e.g., no package library) */
+    return 0;
+  }
+  if (lua_getfield(L, -1, "dir") != LUA_TSTRING ||
+      (f = fopen(filename, "rb")) == NULL) {
+    lua_pop(L, 2);  /* no cache (or no file) */
+    return 0;
+  }
+  luaL_buffinit(L, &b);
+  do {  /* read the whole file */
+    char *p = luaL_prepbuffer(&b);
+    n = fread(p, 1, LUAL_BUFFERSIZE, f);
+    luaL_addsize(&b, n);
+  } while (n == LUAL_BUFFERSIZE);
+  err = ferror(f);
+  fclose(f);
+  luaL_pushresult(&b);
+  if (err) {  /* read error? */
+    lua_pop(L, 3);
+    return 0;  /* let the regular load report it */
+  }
+  lua_pushfstring(L, "%s\n%I %I\n", filename,
+                     (LUAI_UACINT)l_getmtime(filename),
+                     (LUAI_UACINT)luaL_len(L, -1));
+  lua_insert(L, -2);
+  lua_concat(L, 2);  /* key is the header followed by the contents */
+  luaL_gsub(L, filename, LUA_DIRSEP, "_");
+  lua_pushfstring(L, "%s" LUA_DIRSEP "%s.luac", lua_tostring(L, -3),
+                                                lua_tostring(L, -1));
+  lua_remove(L, -2);  /* remove mangled name */
+  lua_remove(L, -3);  /* remove 'dir' */
+  return 1;
+}
+
+
+/* increment counter 'field' of the cache table, at index 'cache' */
+static void countcache (lua_State *L, int cache, const char *field) {
+  lua_Integer n = (lua_getfield(L, cache, field), lua_tointeger(L, -1));
+  lua_pushinteger(L, n + 1);
+  lua_setfield(L, cache, field);
+  lua_pop(L, 1);  /* remove old count */
+}
+
+
+/*
+** Load the chunk in the cache file for the key at index 'key' (with
+** the name of the cache file just above it), using the modes in 'mode'
+** for binary chunks. Return -1 (pushing nothing) if the cache does not
+** have a valid chunk for that key.
+*/
+static int loadcached (lua_State *L, int key, const char *chunkname,
+                       const char *mode) {
+  LoadF lf;
+  size_t l;
+  const char *k = lua_tolstring(L, key, &l);
+  char bmode[4] = "b";
+  int status = -1;
+  if (mode != NULL && strchr(mode, 'm')) strcat(bmode, "m");
+  if (mode != NULL && strchr(mode, 'l')) strcat(bmode, "l");
+  lf.f = fopen(lua_tostring(L, key + 1), "rb");
+  if (lf.f == NULL) return -1;
+  lf.n = 0;
+  while (l > 0) {  /* check key */
+    size_t n = (l < sizeof(lf.buff)) ? l : sizeof(lf.buff);
+    if (fread(lf.buff, 1, n, lf.f) != n || memcmp(lf.buff, k, n) != 0)
+      break;
+    k += n; l -= n;
+  }
+  if (l == 0) {  /* key matches? */
+    if (strchr(bmode, 'm'))
+      status = l_loadmapped(L, lf.f, ftell(lf.f), chunkname, bmode);
+    if (status == -1)  /* not mapped? */
+      status = lua_load(L, getF, &lf, chunkname, bmode);
+    if (status != LUA_OK) {  /* invalid cache file? */
+      lua_pop(L, 1);  /* remove error message */
+      status = -1;
+    }
+  }
+  fclose(lf.f);
+  return status;
+}
+
+
+static int cachewriter (lua_State *L, const void *b, size_t size, void *f) {
+  (void)L;  /* not used */
+  return (fwrite(b, size, 1, (FILE *)f) != 1) && (size != 0);
+}
+
+
+/*
+** Store the function at the top in the cache file for the key at index
+** 'key' (with the name of the cache file just above it). The file is
+** written under a temporary name and then renamed, so that other
+** processes never see it incomplete. Errors are ignored.
+*/
+static void storecache (lua_State *L, int key) {
+  size_t l;
+  const char *k = lua_tolstring(L, key, &l);
+  const char *cname = lua_tostring(L, key + 1);
+  const char *tname = luaL_pushtmpname(L, cname);
+  FILE *f = fopen(tname, "wb");
+  if (f != NULL) {
+    int err;
+    lua_pushvalue(L, -2);  /* function to be dumped */
+    err = (fwrite(k, 1, l, f) != l || lua_dump(L, cachewriter, f, 0));
+    lua_pop(L, 1);
+    err = (fclose(f) != 0 || err);
+    luaL_replacefile(tname, cname, !err);
+  }
+  lua_pop(L, 1);  /* remove temporary name */
+}
+
+/* }====================================================== */
+
+
 LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
                                              const char *mode) {
   LoadF lf;
   int status, readstatus;
   int c;
+  int cache = 0;  /* using the cache of compiled chunks? */
   int fnameindex = lua_gettop(L) + 1;  /* index of filename on the stack */
   if (filename == NULL) {
     lua_pushliteral(L, "=stdin");
@@ -775,14 +1050,30 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   }
   if (c != EOF)
     lf.buff[lf.n++] = c;  /* 'c' is the first character of the stream */
-  status = lua_load(L, getF, &lf, lua_tostring(L, -1), mode);
+  status = -1;  /* not loaded yet */
+  if (c == LUA_SIGNATURE[0]) {
+    if (filename && mode && strchr(mode, 'm'))
+      status = l_loadmapped(L, lf.f, ftell(lf.f) - 1,
+                               lua_tostring(L, fnameindex), mode);
+  }
+  else if (filename && (cache = findcache(L, filename, mode))) {
+    status = loadcached(L, fnameindex + 2, lua_tostring(L, fnameindex),
+                           mode);
+    countcache(L, fnameindex + 1, (status == -1) ? "misses" : "hits");
+  }
+  if (status == -1) {  /* not loaded yet? */
+    status = lua_load(L, getF, &lf, lua_tostring(L, fnameindex), mode);
+    if (cache && status == LUA_OK)
+      storecache(L, fnameindex + 2);
+  }
   readstatus = ferror(lf.f);
   if (filename) fclose(lf.f);  /* close file (even in case of errors) */
   if (readstatus) {
     lua_settop(L, fnameindex);  /* ignore results from 'lua_load' */
     return errfile(L, "read", fnameindex);
   }
-  lua_remove(L, fnameindex);
+  lua_replace(L, fnameindex);  /* result replaces file name */
+  lua_settop(L, fnameindex);  /* remove cache key (if present) */
   return status;
 }
 
@@ -819,6 +1110,962 @@ LUALIB_API int luaL_loadstring (lua_State *L, const char *s) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Parallel compilation
+** =======================================================
+*/
+
+/*
+** Each worker thread compiles its files in its own state, so threads
+** share nothing but the set of files; the calling thread works too.
+** Output files do not depend on which thread compiled them, as a dump
+** depends only on its source.
+*/
+
+/* maximum number of threads used by 'luaL_compilefiles' */
+#if !defined(L_COMPILETHREADS)
+#define L_COMPILETHREADS	64
+#endif
+
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define l_mutex			pthread_mutex_t
+#define l_lockmutex(m)		pthread_mutex_lock(m)
+#define l_unlockmutex(m)	pthread_mutex_unlock(m)
+
+#define l_ncpus()		((int)sysconf(_SC_NPROCESSORS_ONLN))
+
+#else				/* }{ */
+
+#define l_mutex			int
+#define l_lockmutex(m)		((void)(m))
+#define l_unlockmutex(m)	((void)(m))
+
+#define l_ncpus()		1
+
+#endif				/* } */
+
+
+typedef struct CompFile {
+  const char *src;  /* source file */
+  const char *dst;  /* output file */
+  int status;
+  char *msg;  /* error message (allocated with 'malloc'), if any */
+} CompFile;
+
+
+typedef struct CompSet {
+  l_mutex mtx;  /* controls 'next' */
+  int n;  /* number of files */
+  int next;  /* next file to be compiled */
+  int strip;
+  CompFile *files;
+} CompSet;
+
+
+/*
+** Compile file (light userdata at index 1) and write its chunk (with
+** debug information stripped if value at index 2 is true). The output
+** is written under a temporary name and then renamed, so that nobody
+** sees it incomplete.
+*/
+static int compilefile (lua_State *L) {
+  CompFile *f = (CompFile *)lua_touserdata(L, 1);
+  int strip = lua_toboolean(L, 2);
+  const char *tname;
+  FILE *out;
+  int err;
+  if ((f->status = luaL_loadfilex(L, f->src, NULL)) != LUA_OK)
+    return lua_error(L);
+  tname = luaL_pushtmpname(L, f->dst);
+  out = fopen(tname, "wb");
+  if (out == NULL) {
+    f->status = LUA_ERRFILE;
+    return luaL_error(L, "cannot open %s: %s", f->dst, strerror(errno));
+  }
+  lua_pushvalue(L, -2);  /* function to be dumped */
+  err = lua_dump(L, cachewriter, out, strip);
+  err = (fclose(out) != 0 || err);
+  if (!luaL_replacefile(tname, f->dst, !err)) {
+    f->status = LUA_ERRFILE;
+    return luaL_error(L, "cannot write %s", f->dst);
+  }
+  return 0;
+}
+
+
+/* return index of next file in 'cs' to be compiled ('cs->n' if none) */
+static int nextfile (CompSet *cs) {
+  int i;
+  l_lockmutex(&cs->mtx);
+  i = cs->next;
+  if (i < cs->n) cs->next++;
+  l_unlockmutex(&cs->mtx);
+  return i;
+}
+
+
+/*
+** Compile files from 'cs' until there are no more files to be
+** compiled, all in one new state. Errors are kept with each file.
+*/
+static void compilefiles (CompSet *cs) {
+  lua_State *L = luaL_newstate();
+  int i;
+  while ((i = nextfile(cs)) < cs->n) {
+    CompFile *f = &cs->files[i];
+    if (L == NULL)
+      f->status = LUA_ERRMEM;  /* (without a message) */
+    else {
+      int status;
+      lua_pushcfunction(L, compilefile);
+      lua_pushlightuserdata(L, f);
+      lua_pushboolean(L, cs->strip);
+      status = lua_pcall(L, 2, 0, 0);
+      if (status != LUA_OK) {
+        size_t l;
+        const char *msg = lua_tolstring(L, -1, &l);
+        if (f->status == LUA_OK)  /* error not set by 'compilefile'? */
+          f->status = status;
+        if (msg != NULL && (f->msg = (char *)malloc(l + 1)) != NULL)
+          memcpy(f->msg, msg, l + 1);
+      }
+      lua_settop(L, 0);
+    }
+  }
+  if (L != NULL)
+    lua_close(L);
+}
+
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+static void *compilethread (void *ud) {
+  compilefiles((CompSet *)ud);
+  return NULL;
+}
+
+
+static void runcompile (CompSet *cs, int nthreads) {
+  pthread_t thread[L_COMPILETHREADS];
+  int nt, i;
+  pthread_mutex_init(&cs->mtx, NULL);
+  for (nt = 0; nt < nthreads - 1; nt++) {  /* the caller is a worker too */
+    if (pthread_create(&thread[nt], NULL, compilethread, cs) != 0)
+      break;  /* go on with the threads already running */
+  }
+  compilefiles(cs);
+  for (i = 0; i < nt; i++)
+    pthread_join(thread[i], NULL);
+  pthread_mutex_destroy(&cs->mtx);
+}
+
+#else				/* }{ */
+
+#define runcompile(cs,nthreads)	((void)(nthreads), compilefiles(cs))
+
+#endif				/* } */
+
+
+/* free the error messages left in a set of files */
+static int gccompset (lua_State *L) {
+  CompSet *cs = (CompSet *)lua_touserdata(L, 1);
+  int i;
+  for (i = 0; i < cs->n; i++) {
+    free(cs->files[i].msg);
+    cs->files[i].msg = NULL;
+  }
+  return 0;
+}
+
+
+/*
+** Compile the 'n' source files 'src' into the binary chunks 'dst',
+** using up to 'nthreads' threads (as many as processors if it is not
+** positive). Returns the status of the first file that failed, with
+** the error messages of all failed files, in order, on the stack.
+*/
+LUALIB_API int luaL_compilefiles (lua_State *L, int n, const char *const *src,
+                                  const char *const *dst, int strip,
+                                  int nthreads) {
+  CompSet *cs;
+  luaL_Buffer b;
+  int status = LUA_OK;
+  int i;
+  if (n <= 0)
+    return LUA_OK;  /* nothing to compile */
+  cs = (CompSet *)lua_newuserdatauv(L, sizeof(CompSet) +
+                                       n * sizeof(CompFile), 0);
+  cs->n = 0;  /* no messages to be freed yet */
+  cs->files = (CompFile *)(cs + 1);
+  lua_createtable(L, 0, 1);  /* metatable for the set */
+  lua_pushcfunction(L, gccompset);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  for (i = 0; i < n; i++) {
+    cs->files[i].src = src[i];
+    cs->files[i].dst = dst[i];
+    cs->files[i].status = LUA_OK;
+    cs->files[i].msg = NULL;
+  }
+  cs->n = n;
+  cs->next = 0;
+  cs->strip = strip;
+  if (nthreads <= 0)
+    nthreads = l_ncpus();
+  if (nthreads > n)
+    nthreads = n;
+  if (nthreads > L_COMPILETHREADS)
+    nthreads = L_COMPILETHREADS;
+  runcompile(cs, nthreads);
+  luaL_buffinit(L, &b);
+  for (i = 0; i < n; i++) {  /* collect errors in the order of the files */
+    CompFile *f = &cs->files[i];
+    if (f->status != LUA_OK) {
+      if (status == LUA_OK)
+        status = f->status;
+      else
+        luaL_addchar(&b, '\n');
+      if (f->msg == NULL) {
+        lua_pushfstring(L, "cannot compile %s: not enough memory", f->src);
+        luaL_addvalue(&b);
+      }
+      else {
+        luaL_addstring(&b, f->msg);
+        free(f->msg);
+        f->msg = NULL;
+      }
+    }
+  }
+  luaL_pushresult(&b);
+  if (status == LUA_OK)
+    lua_pop(L, 2);  /* remove empty message and set */
+  else
+    lua_remove(L, -2);  /* remove set */
+  return status;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** State images
+** =======================================================
+*/
+
+/*
+** An image keeps the loaded modules of a state (the contents of its
+** table "loaded", which includes the global table), to restore them
+** into another state. Strings, tables and Lua functions are copied,
+** keeping their sharing (including shared upvalues). C functions and
+** userdata are kept as the names that reach them from the loaded
+** modules (e.g., "io.stdout") and restored as the values with these
+** names in the new state. A table that is a loaded module is restored
+** into the module with its name, if the new state has one; so, an
+** image extends the libraries of the new state instead of duplicating
+** them. Functions created by the same expression share their code in
+** the image and, after restored, share their prototype as well. Light
+** userdata cannot be saved, as their addresses mean nothing in another
+** state. Images are not portable across platforms.
+*/
+
+#define IMAGESIG	"\x1bLim"
+
+/* maximum nesting of tables and functions in an image */
+#if !defined(LUAL_MAXIMAGEDEPTH)
+#define LUAL_MAXIMAGEDEPTH	1000
+#endif
+
+/* levels of subtables of a module whose values can have names */
+#define NAMELEVELS	1
+
+/* tags of values in an image */
+#define IMNIL		0
+#define IMFALSE		1
+#define IMTRUE		2
+#define IMINT		3
+#define IMFLT		4
+#define IMSTR		5
+#define IMREF		6	/* object already in the image */
+#define IMNAMED		7	/* C function or userdata, by its name */
+#define IMTABLE		8
+#define IMMODULE	9	/* table of a loaded module */
+#define IMLFUNC		10
+#define IMJOIN		11	/* upvalue shared with a previous function */
+
+
+/*
+** Set the name (at the top) of the value at the top - 1 in table
+** 'names', which maps values to their first names or, if 'byname',
+** names to values.
+*/
+static void setname (lua_State *L, int names, int byname) {
+  if (byname) {
+    lua_pushvalue(L, -1);  /* name */
+    lua_pushvalue(L, -3);  /* value */
+    lua_rawset(L, names);
+  }
+  else {
+    lua_pushvalue(L, -2);  /* value */
+    if (lua_rawget(L, names) == LUA_TNIL) {  /* no name yet? */
+      lua_pushvalue(L, -3);  /* value */
+      lua_pushvalue(L, -3);  /* name */
+      lua_rawset(L, names);
+    }
+    lua_pop(L, 1);  /* remove previous name (or nil) */
+  }
+}
+
+
+/*
+** Name the C functions and userdata in the table at the top (if 'level'
+** is 0) or in its subtables 'level' levels down, as 'prefix' followed
+** by their keys.
+*/
+static void addnames (lua_State *L, int names, int byname,
+                      const char *prefix, int level) {
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    int tv = lua_type(L, -1);
+    if ((lua_type(L, -2) == LUA_TSTRING || lua_isinteger(L, -2)) &&
+        ((level == 0) ? lua_iscfunction(L, -1) || tv == LUA_TUSERDATA
+                      : tv == LUA_TTABLE)) {
+      const char *name;
+      luaL_tolstring(L, -2, NULL);  /* key as a string */
+      name = lua_pushfstring(L, "%s.%s", prefix, lua_tostring(L, -1));
+      lua_remove(L, -2);  /* remove key string */
+      if (level == 0)
+        setname(L, names, byname);
+      else {
+        lua_pushvalue(L, -2);  /* subtable */
+        addnames(L, names, byname, name, level - 1);
+        lua_pop(L, 1);  /* remove subtable */
+      }
+      lua_pop(L, 1);  /* remove name */
+    }
+    lua_pop(L, 1);  /* remove value */
+  }
+}
+
+
+/*
+** Name the values 'level' levels down the loaded module at the top,
+** whose name is 'mname'. At level 0, unless 'byname', the module
+** table itself is also named.
+*/
+static void modnames (lua_State *L, int names, int byname,
+                      const char *mname, int level) {
+  int tv = lua_type(L, -1);
+  lua_pushstring(L, mname);
+  if (tv == LUA_TTABLE) {
+    if (level == 0 && !byname)
+      setname(L, names, 0);
+    lua_pushvalue(L, -2);  /* module */
+    addnames(L, names, byname, mname, level);
+    lua_pop(L, 1);  /* remove module */
+  }
+  else if (level == 0 && (lua_iscfunction(L, -2) || tv == LUA_TUSERDATA))
+    setname(L, names, byname);
+  lua_pop(L, 1);  /* remove module name */
+}
+
+
+/*
+** Fill table 'names' with the names of the values in all loaded
+** modules. A value reachable from several places gets its shortest
+** name, and names through the global table come last; so, values keep
+** their names from their own modules (e.g., "io.stdout" instead of
+** "_G.io.stdout" or "_G.out").
+*/
+static void collectnames (lua_State *L, int names, int byname) {
+  int level;
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  for (level = 0; level <= NAMELEVELS; level++) {
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (lua_type(L, -2) == LUA_TSTRING &&
+          strcmp(lua_tostring(L, -2), LUA_GNAME) != 0)
+        modnames(L, names, byname, lua_tostring(L, -2), level);
+      lua_pop(L, 1);  /* remove module */
+    }
+    lua_getfield(L, -1, LUA_GNAME);
+    modnames(L, names, byname, LUA_GNAME, level);
+    lua_pop(L, 1);  /* remove global table */
+  }
+  lua_pop(L, 1);  /* remove table "loaded" */
+}
+
+
+typedef struct SaveState {
+  lua_State *L;
+  lua_Writer writer;
+  void *data;
+  int status;
+  int objs;  /* table mapping saved objects to their indices */
+  int names;  /* table mapping values to their names */
+  int codes;  /* table mapping prototypes to the indices of their code */
+  int upvals;  /* table mapping saved upvalues to their places */
+  lua_Integer nobjs;  /* number of saved objects */
+  lua_Integer ncodes;  /* number of saved codes */
+  int depth;  /* current nesting */
+  size_t n;  /* number of bytes in 'buff' */
+  char buff[LUAL_BUFFERSIZE];
+} SaveState;
+
+
+static void flushimage (SaveState *S) {
+  if (S->status == 0 && S->n > 0)
+    S->status = (*S->writer)(S->L, S->buff, S->n, S->data);
+  S->n = 0;
+}
+
+
+static void savebytes (SaveState *S, const void *b, size_t size) {
+  if (size > sizeof(S->buff) - S->n) {  /* not enough space? */
+    flushimage(S);
+    if (size > sizeof(S->buff)) {  /* too large for the buffer? */
+      if (S->status == 0)
+        S->status = (*S->writer)(S->L, b, size, S->data);
+      return;
+    }
+  }
+  memcpy(S->buff + S->n, b, size);
+  S->n += size;
+}
+
+
+#define savevar(S,x)	savebytes(S, &(x), sizeof(x))
+
+
+static void savebyte (SaveState *S, int b) {
+  unsigned char c = (unsigned char)b;
+  savevar(S, c);
+}
+
+
+static void saveinteger (SaveState *S, lua_Integer i) {
+  savevar(S, i);
+}
+
+
+static void savestring (SaveState *S, int idx) {
+  size_t len;
+  const char *s = lua_tolstring(S->L, idx, &len);
+  savevar(S, len);
+  savebytes(S, s, len);
+}
+
+
+/*
+** Register the object at the top with the next index, or save it as
+** a reference if it is already in the image. (In that case, pop it and
+** return true.)
+*/
+static int saveref (SaveState *S) {
+  lua_State *L = S->L;
+  lua_pushvalue(L, -1);
+  if (lua_rawget(L, S->objs) != LUA_TNIL) {  /* already in the image? */
+    savebyte(S, IMREF);
+    saveinteger(S, lua_tointeger(L, -1));
+    lua_pop(L, 2);  /* remove index and object */
+    return 1;
+  }
+  lua_pop(L, 1);  /* remove nil */
+  lua_pushvalue(L, -1);
+  lua_pushinteger(L, ++S->nobjs);
+  lua_rawset(L, S->objs);
+  return 0;
+}
+
+
+typedef struct DumpBuffer {
+  int init;  /* true iff buffer has been initialized */
+  luaL_Buffer B;
+} DumpBuffer;
+
+
+/* (see 'str_dump') */
+static int dumpwriter (lua_State *L, const void *b, size_t size, void *ud) {
+  DumpBuffer *d = (DumpBuffer *)ud;
+  if (!d->init) {
+    d->init = 1;
+    luaL_buffinit(L, &d->B);
+  }
+  luaL_addlstring(&d->B, (const char *)b, size);
+  return 0;
+}
+
+
+/*
+** Push the binary chunk of the Lua function at the top.
+*/
+static void pushdump (lua_State *L) {
+  DumpBuffer d;
+  d.init = 0;
+  lua_dump(L, dumpwriter, &d, 0);
+  luaL_pushresult(&d.B);
+}
+
+
+static void savevalue (SaveState *S);
+
+
+static void savetable (SaveState *S) {
+  lua_State *L = S->L;
+  if (!lua_getmetatable(L, -1))
+    lua_pushnil(L);
+  savevalue(S);  /* metatable */
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    lua_pushvalue(L, -2);
+    savevalue(S);  /* key */
+    savevalue(S);  /* value */
+  }
+  savebyte(S, IMNIL);  /* end of table */
+}
+
+
+/*
+** A Lua function is saved as the index of its code (followed by the
+** code, when its prototype is new) plus its upvalues. An upvalue shared
+** with a function already in the image is saved as the place where it
+** first appeared.
+*/
+static void savefunction (SaveState *S) {
+  lua_State *L = S->L;
+  lua_Integer fidx = S->nobjs;  /* index of this function */
+  int i, nups;
+  lua_pushlightuserdata(L, lua_codeid(L, -1));
+  if (lua_rawget(L, S->codes) == LUA_TNIL) {  /* new prototype? */
+    lua_pop(L, 1);
+    lua_pushlightuserdata(L, lua_codeid(L, -1));
+    lua_pushinteger(L, ++S->ncodes);
+    lua_rawset(L, S->codes);
+    saveinteger(S, S->ncodes);
+    pushdump(L);
+    savestring(S, -1);
+  }
+  else
+    saveinteger(S, lua_tointeger(L, -1));
+  lua_pop(L, 1);  /* remove code or its index */
+  for (nups = 0; lua_getupvalue(L, -1, nups + 1) != NULL; nups++)
+    lua_pop(L, 1);
+  savebyte(S, nups);
+  for (i = 1; i <= nups; i++) {
+    lua_pushlightuserdata(L, lua_upvalueid(L, -1, i));
+    if (lua_rawget(L, S->upvals) == LUA_TNIL) {  /* new upvalue? */
+      lua_pop(L, 1);
+      lua_pushlightuserdata(L, lua_upvalueid(L, -1, i));
+      lua_pushinteger(L, fidx * 256 + i);  /* its place */
+      lua_rawset(L, S->upvals);
+      lua_getupvalue(L, -1, i);
+      savevalue(S);
+    }
+    else {
+      lua_Integer place = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+      savebyte(S, IMJOIN);
+      saveinteger(S, place / 256);
+      savebyte(S, (int)(place % 256));
+    }
+  }
+}
+
+
+/*
+** Save the value at the top and pop it.
+*/
+static void savevalue (SaveState *S) {
+  lua_State *L = S->L;
+  int t = lua_type(L, -1);
+  switch (t) {
+    case LUA_TNIL:
+      savebyte(S, IMNIL);
+      break;
+    case LUA_TBOOLEAN:
+      savebyte(S, lua_toboolean(L, -1) ? IMTRUE : IMFALSE);
+      break;
+    case LUA_TNUMBER:
+      if (lua_isinteger(L, -1)) {
+        savebyte(S, IMINT);
+        saveinteger(S, lua_tointeger(L, -1));
+      }
+      else {
+        lua_Number n = lua_tonumber(L, -1);
+        savebyte(S, IMFLT);
+        savevar(S, n);
+      }
+      break;
+    case LUA_TSTRING:
+      if (saveref(S))
+        return;
+      savebyte(S, IMSTR);
+      savestring(S, -1);
+      break;
+    default: {
+      if (saveref(S))
+        return;
+      luaL_checkstack(L, 8, NULL);
+      if (++S->depth > LUAL_MAXIMAGEDEPTH)
+        luaL_error(L, "image too deep");
+      lua_pushvalue(L, -1);
+      if (lua_rawget(L, S->names) == LUA_TSTRING) {  /* has a name? */
+        savebyte(S, (t == LUA_TTABLE) ? IMMODULE : IMNAMED);
+        savestring(S, -1);
+        lua_pop(L, 1);  /* remove name */
+        if (t == LUA_TTABLE)
+          savetable(S);
+      }
+      else {
+        lua_pop(L, 1);  /* remove nil */
+        if (t == LUA_TTABLE) {
+          savebyte(S, IMTABLE);
+          savetable(S);
+        }
+        else if (t == LUA_TFUNCTION && !lua_iscfunction(L, -1)) {
+          savebyte(S, IMLFUNC);
+          savefunction(S);
+        }
+        else
+          luaL_error(L, "cannot save %s", luaL_tolstring(L, -1, NULL));
+      }
+      S->depth--;
+      break;
+    }
+  }
+  lua_pop(L, 1);
+}
+
+
+static void saveheader (SaveState *S) {
+  savebytes(S, IMAGESIG, sizeof(IMAGESIG) - sizeof(char));
+  savebyte(S, sizeof(lua_Integer));
+  savebyte(S, sizeof(lua_Number));
+  savebyte(S, sizeof(size_t));
+  saveinteger(S, LUA_VERSION_NUM);
+}
+
+
+/*
+** Tables "loaded" and "preload" are always the first two objects of
+** an image; references to them go to the ones of the new state.
+*/
+static void newloaded (lua_State *L, int objs, lua_Integer *nobjs,
+                       int byindex) {
+  const char *const tables[] = {LUA_LOADED_TABLE, LUA_PRELOAD_TABLE};
+  int i;
+  for (i = 0; i < 2; i++) {
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, tables[i]);
+    if (byindex)
+      lua_rawseti(L, objs, ++*nobjs);
+    else {
+      lua_pushinteger(L, ++*nobjs);
+      lua_rawset(L, objs);
+    }
+  }
+}
+
+
+LUALIB_API int luaL_saveimage (lua_State *L, lua_Writer writer, void *data) {
+  SaveState S;
+  int top = lua_gettop(L);
+  luaL_checkstack(L, 10, NULL);
+  S.L = L; S.writer = writer; S.data = data;
+  S.status = 0; S.n = 0; S.depth = 0;
+  S.nobjs = S.ncodes = 0;
+  lua_newtable(L); S.objs = top + 1;
+  lua_newtable(L); S.names = top + 2;
+  lua_newtable(L); S.codes = top + 3;
+  lua_newtable(L); S.upvals = top + 4;
+  collectnames(L, S.names, 0);
+  newloaded(L, S.objs, &S.nobjs, 0);
+  saveheader(&S);
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {  /* for each loaded module */
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      lua_pushvalue(L, -2);
+      savevalue(&S);  /* module name */
+      savevalue(&S);  /* module */
+    }
+    else
+      lua_pop(L, 1);
+  }
+  savebyte(&S, IMNIL);  /* end of image */
+  flushimage(&S);
+  lua_settop(L, top);
+  return S.status;
+}
+
+
+typedef struct RestoreState {
+  lua_State *L;
+  const char *p;  /* next byte of the image */
+  size_t n;  /* number of bytes left */
+  int objs;  /* table with restored objects, by index */
+  int names;  /* table mapping names to values */
+  int codes;  /* table with the first function of each code, by index */
+  int loaded;  /* table "loaded" */
+  lua_Integer nobjs;  /* number of restored objects */
+  lua_Integer ncodes;  /* number of restored codes */
+  int depth;  /* current nesting */
+} RestoreState;
+
+
+static int badimage (RestoreState *R) {
+  return luaL_error(R->L, "bad image");
+}
+
+
+static const char *readbytes (RestoreState *R, size_t size) {
+  const char *b = R->p;
+  if (size > R->n)
+    luaL_error(R->L, "truncated image");
+  R->p += size;
+  R->n -= size;
+  return b;
+}
+
+
+#define readvar(R,x)	memcpy(&(x), readbytes(R, sizeof(x)), sizeof(x))
+
+
+static int readbyte (RestoreState *R) {
+  return (unsigned char)*readbytes(R, 1);
+}
+
+
+static lua_Integer readinteger (RestoreState *R) {
+  lua_Integer i;
+  readvar(R, i);
+  return i;
+}
+
+
+static const char *readstring (RestoreState *R, size_t *len) {
+  readvar(R, *len);
+  return readbytes(R, *len);
+}
+
+
+static void pushstring (RestoreState *R) {
+  size_t len;
+  const char *s = readstring(R, &len);
+  lua_pushlstring(R->L, s, len);
+}
+
+
+/* register the object at the top with the next index */
+static void newobject (RestoreState *R) {
+  lua_pushvalue(R->L, -1);
+  lua_rawseti(R->L, R->objs, ++R->nobjs);
+}
+
+
+static void restoretagged (RestoreState *R, int tag);
+
+#define restorevalue(R)		restoretagged(R, readbyte(R))
+
+
+static void restoretable (RestoreState *R) {
+  lua_State *L = R->L;
+  restorevalue(R);  /* metatable */
+  if (lua_istable(L, -1))
+    lua_setmetatable(L, -2);
+  else if (lua_isnil(L, -1))
+    lua_pop(L, 1);
+  else
+    badimage(R);
+  for (;;) {
+    restorevalue(R);  /* key */
+    if (lua_isnil(L, -1))
+      break;
+    restorevalue(R);  /* value */
+    lua_rawset(L, -3);
+  }
+  lua_pop(L, 1);  /* remove nil */
+}
+
+
+static int getupvalue (lua_State *L, int f, int n) {
+  if (lua_getupvalue(L, f, n) == NULL)
+    return 0;
+  lua_pop(L, 1);
+  return 1;
+}
+
+
+/*
+** Only the first function with a given code loads it; the others are
+** clones of that function, sharing its prototype.
+*/
+static void restorefunction (RestoreState *R) {
+  lua_State *L = R->L;
+  int i, nups;
+  lua_Integer c = readinteger(R);
+  if (c == R->ncodes + 1) {  /* new code? */
+    size_t len;
+    const char *code = readstring(R, &len);
+    if (luaL_loadbufferx(L, code, len, "=(image)", "b") != LUA_OK)
+      lua_error(L);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, R->codes, ++R->ncodes);
+  }
+  else if (c < 1 || c > R->ncodes)
+    badimage(R);
+  else {
+    lua_rawgeti(L, R->codes, c);
+    lua_clonefunction(L, -1);
+    lua_remove(L, -2);  /* remove first function */
+  }
+  newobject(R);
+  nups = readbyte(R);
+  for (i = 1; i <= nups; i++) {
+    int tag = readbyte(R);
+    if (!getupvalue(L, -1, i))
+      badimage(R);
+    if (tag == IMJOIN) {  /* shared upvalue? */
+      lua_Integer f = readinteger(R);
+      int n = readbyte(R);
+      if (f < 1 || f > R->nobjs ||
+          lua_rawgeti(L, R->objs, f) != LUA_TFUNCTION ||
+          lua_iscfunction(L, -1) || !getupvalue(L, -1, n))
+        badimage(R);
+      lua_upvaluejoin(L, -2, i, -1, n);
+      lua_pop(L, 1);  /* remove other function */
+    }
+    else {
+      restoretagged(R, tag);
+      lua_setupvalue(L, -2, i);
+    }
+  }
+}
+
+
+/*
+** Restore a value with the given tag and push it.
+*/
+static void restoretagged (RestoreState *R, int tag) {
+  lua_State *L = R->L;
+  switch (tag) {
+    case IMNIL: lua_pushnil(L); break;
+    case IMFALSE: lua_pushboolean(L, 0); break;
+    case IMTRUE: lua_pushboolean(L, 1); break;
+    case IMINT: lua_pushinteger(L, readinteger(R)); break;
+    case IMFLT: {
+      lua_Number n;
+      readvar(R, n);
+      lua_pushnumber(L, n);
+      break;
+    }
+    case IMSTR: {
+      pushstring(R);
+      newobject(R);
+      break;
+    }
+    case IMREF: {
+      lua_Integer i = readinteger(R);
+      if (i < 1 || i > R->nobjs)
+        badimage(R);
+      lua_rawgeti(L, R->objs, i);
+      break;
+    }
+    case IMNAMED: {
+      pushstring(R);
+      lua_pushvalue(L, -1);
+      if (lua_rawget(L, R->names) == LUA_TNIL)
+        luaL_error(L, "image needs '%s'", lua_tostring(L, -2));
+      lua_remove(L, -2);  /* remove name */
+      newobject(R);
+      break;
+    }
+    default: {
+      luaL_checkstack(L, 8, NULL);
+      if (++R->depth > LUAL_MAXIMAGEDEPTH)
+        badimage(R);
+      switch (tag) {
+        case IMTABLE: {
+          lua_newtable(L);
+          newobject(R);
+          restoretable(R);
+          break;
+        }
+        case IMMODULE: {  /* restore into module with that name */
+          pushstring(R);
+          lua_pushvalue(L, -1);
+          if (lua_rawget(L, R->loaded) != LUA_TTABLE) {  /* no module? */
+            lua_pop(L, 1);
+            lua_newtable(L);
+          }
+          lua_remove(L, -2);  /* remove name */
+          newobject(R);
+          restoretable(R);
+          break;
+        }
+        case IMLFUNC: {
+          restorefunction(R);
+          break;
+        }
+        default: badimage(R);
+      }
+      R->depth--;
+      break;
+    }
+  }
+}
+
+
+static void checkheader (RestoreState *R) {
+  const size_t lsig = sizeof(IMAGESIG) - sizeof(char);
+  if (R->n < lsig || memcmp(R->p, IMAGESIG, lsig) != 0)
+    luaL_error(R->L, "not an image");
+  readbytes(R, lsig);
+  if (readbyte(R) != sizeof(lua_Integer) ||
+      readbyte(R) != sizeof(lua_Number) ||
+      readbyte(R) != sizeof(size_t) ||
+      readinteger(R) != LUA_VERSION_NUM)
+    luaL_error(R->L, "image from another platform or version");
+}
+
+
+LUALIB_API void luaL_restoreimage (lua_State *L, const char *buff,
+                                               size_t size) {
+  RestoreState R;
+  int top = lua_gettop(L);
+  luaL_checkstack(L, 10, NULL);
+  R.L = L; R.p = buff; R.n = size;
+  R.nobjs = R.ncodes = 0; R.depth = 0;
+  checkheader(&R);
+  lua_newtable(L); R.objs = top + 1;
+  lua_newtable(L); R.names = top + 2;
+  lua_newtable(L); R.codes = top + 3;
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+  R.loaded = top + 4;
+  collectnames(L, R.names, 1);  /* before any change to the modules */
+  newloaded(L, R.objs, &R.nobjs, 1);
+  for (;;) {  /* for each module in the image */
+    restorevalue(&R);  /* module name */
+    if (lua_isnil(L, -1))
+      break;
+    if (lua_type(L, -1) != LUA_TSTRING)
+      badimage(&R);
+    restorevalue(&R);  /* module */
+    lua_rawset(L, R.loaded);
+  }
+  if (R.n != 0)
+    badimage(&R);
+  lua_settop(L, top);
+}
+
+/* }====================================================== */
+
+
 
 LUALIB_API int luaL_getmetafield (lua_State *L, int obj, const char *event) {
   if (!lua_getmetatable(L, obj))  /* no metatable? */
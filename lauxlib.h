@@ -34,6 +34,10 @@ typedef struct luaL_Buffer luaL_Buffer;
 #define LUA_PRELOAD_TABLE	"_PRELOAD"
 
 
+/* key, in the registry, for table of the cache of compiled chunks */
+#define LUA_CACHE_TABLE	"_CACHE"
+
+
 typedef struct luaL_Reg {
   const char *name;
   lua_CFunction func;
@@ -80,6 +84,10 @@ LUALIB_API int (luaL_checkoption) (lua_State *L, int arg, const char *def,
 LUALIB_API int (luaL_fileresult) (lua_State *L, int stat, const char *fname);
 LUALIB_API int (luaL_execresult) (lua_State *L, int stat);
 
+LUALIB_API const char *(luaL_pushtmpname) (lua_State *L, const char *fname);
+LUALIB_API int (luaL_replacefile) (const char *tname, const char *fname,
+                                   int ok);
+
 
 /* predefined references */
 #define LUA_NOREF       (-2)
@@ -96,6 +104,14 @@ LUALIB_API int (luaL_loadfilex) (lua_State *L, const char *filename,
 LUALIB_API int (luaL_loadbufferx) (lua_State *L, const char *buff, size_t sz,
                                    const char *name, const char *mode);
 LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
+LUALIB_API int (luaL_compilefiles) (lua_State *L, int n,
+                                   const char *const *src,
+                                   const char *const *dst, int strip,
+                                   int nthreads);
+
+LUALIB_API int (luaL_saveimage) (lua_State *L, lua_Writer writer, void *data);
+LUALIB_API void (luaL_restoreimage) (lua_State *L, const char *buff,
+                                                   size_t sz);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
 
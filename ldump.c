@@ -14,8 +14,12 @@
 
 #include "lua.h"
 
+#include "lapi.h"
 #include "lobject.h"
+#include "ldo.h"
+#include "lgc.h"
 #include "lstate.h"
+#include "ltable.h"
 #include "lundump.h"
 
 
@@ -25,6 +29,9 @@ typedef struct {
   void *data;
   int strip;
   int status;
+  size_t offset;  /* number of bytes written so far */
+  Table *strings;  /* string table: maps strings to indices and back */
+  int nstrings;  /* number of strings in the table */
 } DumpState;
 
 
@@ -42,6 +49,7 @@ static void dumpBlock (DumpState *D, const void *b, size_t size) {
     lua_unlock(D->L);
     D->status = (*D->writer)(D->L, b, size, D->data);
     lua_lock(D->L);
+    D->offset += size;
   }
 }
 
@@ -56,9 +64,9 @@ static void dumpByte (DumpState *D, int y) {
 
 
 /* dumpInt Buff Size */
-#define DIBS    ((sizeof(size_t) * 8 / 7) + 1)
+#define DIBS    ((sizeof(lua_Unsigned) * 8 / 7) + 1)
 
-static void dumpSize (DumpState *D, size_t x) {
+static void dumpUnsigned (DumpState *D, lua_Unsigned x) {
   lu_byte buff[DIBS];
   int n = 0;
   do {
@@ -70,6 +78,11 @@ static void dumpSize (DumpState *D, size_t x) {
 }
 
 
+static void dumpSize (DumpState *D, size_t x) {
+  dumpUnsigned(D, x);
+}
+
+
 static void dumpInt (DumpState *D, int x) {
   dumpSize(D, x);
 }
@@ -85,7 +98,18 @@ static void dumpInteger (DumpState *D, lua_Integer x) {
 }
 
 
-static void dumpString (DumpState *D, const TString *s) {
+/*
+** Integer constants use the "zigzag" encoding (0, -1, 1, -2, 2, ...
+** go to 0, 1, 2, 3, 4, ...), so that small values of either sign fit
+** in few bytes.
+*/
+static void dumpIntConstant (DumpState *D, lua_Integer x) {
+  lua_Unsigned u = l_castS2U(x) << 1;
+  dumpUnsigned(D, (x < 0) ? ~u : u);
+}
+
+
+static void dumpInlineString (DumpState *D, const TString *s) {
   if (s == NULL)
     dumpSize(D, 0);
   else {
@@ -97,8 +121,37 @@ static void dumpString (DumpState *D, const TString *s) {
 }
 
 
+/*
+** Strings inside functions are dumped as their indices in the string
+** table of the chunk (0 for no string).
+*/
+static void dumpString (DumpState *D, const TString *s) {
+  if (s == NULL)
+    dumpInt(D, 0);
+  else {
+    const TValue *idx = luaH_getstr(D->strings, cast(TString *, s));
+    lua_assert(ttisinteger(idx));
+    dumpInt(D, cast_int(ivalue(idx)));
+  }
+}
+
+
+/*
+** Dump a padding (preceded by its size) so that the next block starts
+** at a multiple of 'align' from the start of the chunk. When the chunk
+** is loaded from an aligned buffer, that block can be used in place.
+*/
+static void dumpAlign (DumpState *D, int align) {
+  int padding = cast_int((align - (D->offset + 1) % align) % align);
+  lua_assert(align <= 8);
+  dumpByte(D, padding);
+  dumpBlock(D, "\0\0\0\0\0\0\0", padding);
+}
+
+
 static void dumpCode (DumpState *D, const Proto *f) {
   dumpInt(D, f->sizecode);
+  dumpAlign(D, sizeof(Instruction));
   dumpVector(D, f->code, f->sizecode);
 }
 
@@ -118,7 +171,7 @@ static void dumpConstants (DumpState *D, const Proto *f) {
         dumpNumber(D, fltvalue(o));
         break;
       case LUA_VNUMINT:
-        dumpInteger(D, ivalue(o));
+        dumpIntConstant(D, ivalue(o));
         break;
       case LUA_VSHRSTR:
       case LUA_VLNGSTR:
@@ -131,12 +184,38 @@ static void dumpConstants (DumpState *D, const Proto *f) {
 }
 
 
+static int nowriter (lua_State *L, const void *b, size_t size, void *ud) {
+  UNUSED(L); UNUSED(b); UNUSED(size); UNUSED(ud);
+  return 0;
+}
+
+
+/*
+** Each nested function goes after its size, which is computed by a dry
+** run of its dump. (A dry run does not need the sizes of deeper
+** functions, as they have a fixed length.) A size too large for an
+** Instruction is written as 0, meaning "unknown".
+*/
 static void dumpProtos (DumpState *D, const Proto *f) {
   int i;
   int n = f->sizep;
   dumpInt(D, n);
-  for (i = 0; i < n; i++)
-    dumpFunction(D, f->p[i], f->source);
+  for (i = 0; i < n; i++) {
+    const Proto *p = f->p[i];
+    Instruction size = 0;
+    if (D->writer != nowriter) {  /* not a dry run? (which needs no size) */
+      DumpState dry = *D;
+      size_t dsize;
+      dry.writer = nowriter;
+      dry.offset += sizeof(Instruction);  /* skip the size itself */
+      dumpFunction(&dry, p, f->source);
+      dsize = dry.offset - D->offset - sizeof(Instruction);
+      if (dsize <= cast_sizet(~(Instruction)0))
+        size = cast(Instruction, dsize);
+    }
+    dumpVar(D, size);
+    dumpFunction(D, p, f->source);
+  }
 }
 
 
@@ -194,6 +273,60 @@ static void dumpFunction (DumpState *D, const Proto *f, TString *psource) {
 }
 
 
+/*
+** Add string 's' (if any) to the string table.
+*/
+static void addString (DumpState *D, TString *s) {
+  lua_State *L = D->L;
+  if (s != NULL && isabstkey(luaH_getstr(D->strings, s))) {  /* new? */
+    TValue k, v;
+    setsvalue(L, &k, s);
+    setivalue(&v, ++D->nstrings);
+    setobj2t(L, luaH_set(L, D->strings, &k), &v);
+    luaH_setint(L, D->strings, D->nstrings, &k);
+    luaC_barrierback(L, obj2gco(D->strings), &k);
+  }
+}
+
+
+/*
+** Build the string table with all strings that the dump of 'f' will
+** use, following the same rules of 'dumpFunction'. Functions not
+** loaded yet by a lazy load are loaded here; that changes only the
+** list of nested functions of their parents.
+*/
+static void collectStrings (DumpState *D, const Proto *f,
+                            TString *psource) {
+  int i;
+  if (!(D->strip || f->source == psource))
+    addString(D, f->source);
+  for (i = 0; i < f->sizek; i++) {
+    if (ttisstring(&f->k[i]))
+      addString(D, tsvalue(&f->k[i]));
+  }
+  for (i = 0; i < f->sizep; i++) {
+    const Proto *p = f->p[i];
+    if (p->lazy != NULL)  /* not loaded yet? */
+      p = luaU_loadlazy(D->L, cast(Proto *, f), i);
+    collectStrings(D, p, f->source);
+  }
+  if (!D->strip) {
+    for (i = 0; i < f->sizelocvars; i++)
+      addString(D, f->locvars[i].varname);
+    for (i = 0; i < f->sizeupvalues; i++)
+      addString(D, f->upvalues[i].name);
+  }
+}
+
+
+static void dumpStringTable (DumpState *D) {
+  int i;
+  dumpInt(D, D->nstrings);
+  for (i = 1; i <= D->nstrings; i++)
+    dumpInlineString(D, tsvalue(luaH_getint(D->strings, i)));
+}
+
+
 static void dumpHeader (DumpState *D) {
   dumpLiteral(D, LUA_SIGNATURE);
   dumpByte(D, LUAC_VERSION);
@@ -213,14 +346,31 @@ static void dumpHeader (DumpState *D) {
 int luaU_dump(lua_State *L, const Proto *f, lua_Writer w, void *data,
               int strip) {
   DumpState D;
+  ptrdiff_t slot;
   D.L = L;
   D.writer = w;
   D.data = data;
   D.strip = strip;
   D.status = 0;
+  D.offset = 0;
+  D.strings = luaH_new(L);
+  D.nstrings = 0;
+  sethvalue2s(L, L->top, D.strings);  /* anchor it */
+  api_incr_top(L);
+  /* The writer may use the stack (e.g., for a buffer), so the string
+     table cannot stay above the top; instead, it takes the place of the
+     value below it (usually the function being dumped), which it keeps
+     as its entry 0 during the dump. */
+  luaH_setint(L, D.strings, 0, s2v(L->top - 2));
+  setobjs2s(L, L->top - 2, L->top - 1);
+  L->top--;
+  slot = savestack(L, L->top - 1);
+  collectStrings(&D, f, NULL);
   dumpHeader(&D);
   dumpByte(&D, f->sizeupvalues);
+  dumpStringTable(&D);
   dumpFunction(&D, f, NULL);
+  setobj2s(L, restorestack(L, slot), luaH_getint(D.strings, 0));
   return D.status;
 }
 
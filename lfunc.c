@@ -266,15 +266,32 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->mapped = NULL;
+  f->lazy = NULL;
   return f;
 }
 
 
+/*
+** Remove a reference to a mapped buffer; the last one releases it.
+*/
+static void unrefmapped (lua_State *L, Mapped *m) {
+  if (--m->nrefs == 0) {
+    (*m->release)(m->ud, cast_voidp(m->buff), m->size, 0);
+    luaM_free(L, m);
+  }
+}
+
+
 void luaF_freeproto (lua_State *L, Proto *f) {
-  luaM_freearray(L, f->code, f->sizecode);
+  if (f->mapped == NULL) {
+    luaM_freearray(L, f->code, f->sizecode);
+    luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+  }
+  else  /* arrays live in a mapped buffer (or were not loaded yet) */
+    unrefmapped(L, f->mapped);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
-  luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
@@ -54,6 +54,15 @@ static const luaL_Reg loadedlibs[] = {
 };
 
 
+/*
+** these libs are preloaded and must be required before used
+*/
+static const luaL_Reg preloadedlibs[] = {
+  {LUA_AIOLIBNAME, luaopen_aio},
+  {NULL, NULL}
+};
+
+
 LUALIB_API void luaL_openlibs (lua_State *L) {
   const luaL_Reg *lib;
   /* "require" functions from 'loadedlibs' and set results to global table */
@@ -61,5 +70,139 @@ LUALIB_API void luaL_openlibs (lua_State *L) {
     luaL_requiref(L, lib->name, lib->func, 1);
     lua_pop(L, 1);  /* remove lib */
   }
+  /* add open functions from 'preloadedlibs' into 'package.preload' table */
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+  for (lib = preloadedlibs; lib->func; lib++) {
+    lua_pushcfunction(L, lib->func);
+    lua_setfield(L, -2, lib->name);
+  }
+  lua_pop(L, 1);  /* remove _PRELOAD table */
+}
+
+
+/*
+** {======================================================
+** Lazy opening of libraries
+** =======================================================
+*/
+
+/*
+** __index metamethod for the global table: opens the library with
+** the given name, if it is one of the libraries not opened yet (kept
+** in the table in the upvalue).
+*/
+static int lazyglobal (lua_State *L) {
+  lua_settop(L, 2);
+  lua_pushvalue(L, 2);
+  if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TFUNCTION)
+    return 1;  /* not a library: return nil */
+  else {
+    lua_CFunction openf = lua_tocfunction(L, -1);
+    lua_pushvalue(L, 2);
+    lua_pushnil(L);
+    lua_rawset(L, lua_upvalueindex(1));  /* library is no longer lazy */
+    /* open library (if not required yet) and set it as a global */
+    luaL_requiref(L, lua_tostring(L, 2), openf, 1);
+    return 1;
+  }
+}
+
+
+/*
+** __newindex metamethod for the global table: a library that is
+** assigned before being opened is no longer lazy.
+*/
+static int lazynewglobal (lua_State *L) {
+  lua_settop(L, 3);
+  lua_pushvalue(L, 2);
+  lua_pushnil(L);
+  lua_rawset(L, lua_upvalueindex(1));  /* lazy[k] = nil */
+  lua_rawset(L, 1);  /* t[k] = v */
+  return 0;
+}
+
+
+/*
+** Metamethods for strings before the string library is opened: they
+** open the library, which sets the real metatable for strings, and
+** then redo the operation. The upvalue is the operation: an arithmetic
+** operator or -1 for indexing.
+*/
+static int lazystring (lua_State *L) {
+  int op = (int)lua_tointeger(L, lua_upvalueindex(1));
+  luaL_requiref(L, LUA_STRLIBNAME, luaopen_string, 1);
+  lua_settop(L, (op == LUA_OPUNM) ? 1 : 2);
+  if (op < 0)
+    lua_gettable(L, 1);
+  else
+    lua_arith(L, op);
+  return 1;
+}
+
+
+static const struct {
+  const char *event;
+  int op;
+} strevents[] = {
+  {"__index", -1},
+  {"__add", LUA_OPADD}, {"__sub", LUA_OPSUB}, {"__mul", LUA_OPMUL},
+  {"__mod", LUA_OPMOD}, {"__pow", LUA_OPPOW}, {"__div", LUA_OPDIV},
+  {"__idiv", LUA_OPIDIV}, {"__unm", LUA_OPUNM},
+  {NULL, 0}
+};
+
+
+/*
+** Opens the base and package libraries and arranges for the other
+** libraries in 'loadedlibs' to be opened when first used, either as
+** globals, as modules, or (for the string library) through methods of
+** strings. Libraries in 'preloadedlibs' are preloaded as usual.
+*/
+LUALIB_API void luaL_openlazylibs (lua_State *L) {
+  const luaL_Reg *lib;
+  int i;
+  lua_newtable(L);  /* libraries to be opened on demand */
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+  for (lib = loadedlibs; lib->func; lib++) {
+    if (lib->func == luaopen_base || lib->func == luaopen_package) {
+      luaL_requiref(L, lib->name, lib->func, 1);
+      lua_pop(L, 1);  /* remove lib */
+    }
+    else {
+      lua_pushcfunction(L, lib->func);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, -3, lib->name);  /* preload[name] = open function */
+      lua_setfield(L, -3, lib->name);  /* lazy[name] = open function */
+    }
+  }
+  for (lib = preloadedlibs; lib->func; lib++) {
+    lua_pushcfunction(L, lib->func);
+    lua_setfield(L, -2, lib->name);
+  }
+  lua_pop(L, 1);  /* remove _PRELOAD table */
+  /* set metatable for the global table */
+  lua_pushglobaltable(L);
+  lua_createtable(L, 0, 2);
+  lua_pushvalue(L, -3);  /* lazy libraries */
+  lua_pushcclosure(L, lazyglobal, 1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -3);  /* lazy libraries */
+  lua_pushcclosure(L, lazynewglobal, 1);
+  lua_setfield(L, -2, "__newindex");
+  lua_setmetatable(L, -2);
+  lua_pop(L, 2);  /* remove global table and lazy libraries */
+  /* set temporary metatable for strings */
+  lua_createtable(L, 0, sizeof(strevents) / sizeof(strevents[0]) - 1);
+  for (i = 0; strevents[i].event != NULL; i++) {
+    lua_pushinteger(L, strevents[i].op);
+    lua_pushcclosure(L, lazystring, 1);
+    lua_setfield(L, -2, strevents[i].event);
+  }
+  lua_pushliteral(L, "");  /* dummy string */
+  lua_insert(L, -2);
+  lua_setmetatable(L, -2);  /* set table as metatable for strings */
+  lua_pop(L, 1);  /* pop dummy string */
 }
 
+/* }====================================================== */
+
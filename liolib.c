@@ -12,6 +12,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -86,6 +87,74 @@ static int l_checkmode (const char *mode) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** l_mmap maps a whole file in memory, for reading only
+** =======================================================
+*/
+
+#if !defined(l_mmap)		/* { */
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+** Map file 'fname', putting its size in '*size'. Return NULL (with
+** 'errno' set) on errors. Empty files need no mapping.
+*/
+static const char *l_mmap (lua_State *L, const char *fname, size_t *size) {
+  const char *addr = NULL;
+  struct stat st;
+  int fd = open(fname, O_RDONLY);
+  (void)L;
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) == 0) {
+    if (!S_ISREG(st.st_mode))
+      errno = ENODEV;  /* can map only regular files */
+    else if ((off_t)(*size = (size_t)st.st_size) != st.st_size)
+      errno = EFBIG;  /* too large for this address space */
+    else if (*size == 0)
+      addr = "";
+    else {
+      void *m = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m != MAP_FAILED)
+        addr = (const char *)m;
+    }
+  }
+  if (addr == NULL) {  /* error? */
+    int en = errno;  /* keep it across 'close' */
+    close(fd);
+    errno = en;
+  }
+  else
+    close(fd);  /* mapping does not need the descriptor */
+  return addr;
+}
+
+#define l_munmap(L,addr,size)  \
+	((void)L, (size) > 0 ? munmap((void *)(addr), size) : 0)
+
+#else				/* }{ */
+
+/* ISO C definitions */
+#define l_mmap(L,fname,size)  \
+	  ((void)fname, (void)size, \
+	  luaL_error(L, "'mmap' not supported"), \
+	  (const char *)0)
+#define l_munmap(L,addr,size)		((void)L, (void)addr, (void)size, 0)
+
+#endif				/* } */
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
 #if !defined(l_getc)		/* { */
 
 #if defined(LUA_USE_POSIX)
@@ -101,6 +170,127 @@ static int l_checkmode (const char *mode) {
 #endif				/* } */
 
 
+/*
+** l_getbuff(f,n) returns the address of the data already read into
+** the buffer of stream 'f', and puts its size in 'n'; l_skipbuff(f,n)
+** consumes the first 'n' bytes of that data. Where the stream buffer
+** is not accessible, l_getbuff always gives an empty buffer, and
+** readers fall back to 'l_getc'.
+*/
+#if !defined(l_getbuff)		/* { */
+
+#if defined(__GLIBC__)
+#define l_getbuff(f,n)  \
+	(*(n) = (size_t)((f)->_IO_read_end - (f)->_IO_read_ptr), \
+	 (const char *)(f)->_IO_read_ptr)
+#define l_skipbuff(f,n)		((f)->_IO_read_ptr += (n))
+#else
+#define l_getbuff(f,n)		((void)(f), *(n) = 0, (const char *)NULL)
+#define l_skipbuff(f,n)		((void)(f), (void)(n))
+#endif
+
+#endif				/* } */
+
+
+/*
+** {======================================================
+** l_writev writes several buffers directly to the file of a
+** stream, bypassing its buffer
+** =======================================================
+*/
+
+/* maximum number of arguments gathered in one write */
+#if !defined(L_MAXWRITEV)
+#define L_MAXWRITEV	64
+#endif
+
+
+#if !defined(l_writev)		/* { */
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define l_iovec		struct iovec
+
+#if defined(__GLIBC__)
+
+#include <stdio_ext.h>
+
+/* a stream gets its buffer only on its first use */
+#define l_bufsize(f)  \
+	(__fbufsize(f) > 0 ? __fbufsize(f) : (size_t)BUFSIZ)
+
+#endif
+
+/* set the stream position to the file position (if file is seekable) */
+#define l_syncpos(f,fd)  \
+	{ off_t pos_ = lseek(fd, 0, SEEK_CUR); \
+	  if (pos_ >= 0) fseeko(f, pos_, SEEK_SET); }
+
+/*
+** Write the 'n' buffers in 'iov' with as few 'writev' calls as
+** possible. The stream is flushed first, to keep the order of the
+** output, and its position is synchronized after, to follow the
+** file. Return true on success ('errno' tells the error otherwise).
+*/
+static int l_writev (FILE *f, l_iovec *iov, int n) {
+  int fd = fileno(f);
+  if (fflush(f) != 0)
+    return 0;
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w < 0) {
+      if (errno != EINTR) return 0;
+      continue;  /* interrupted; try again */
+    }
+    while (n > 0 && (size_t)w >= iov->iov_len) {  /* skip written buffers */
+      w -= iov->iov_len;
+      iov++; n--;
+    }
+    if (n > 0) {  /* partial write inside a buffer? */
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  l_syncpos(f, fd);
+  return 1;
+}
+
+#else				/* }{ */
+
+/* ISO C definitions */
+struct l_iov { void *iov_base; size_t iov_len; };
+#define l_iovec		struct l_iov
+
+static int l_writev (FILE *f, l_iovec *iov, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (fwrite(iov[i].iov_base, sizeof(char), iov[i].iov_len, f) !=
+        iov[i].iov_len)
+      return 0;
+  }
+  return 1;
+}
+
+#endif				/* } */
+
+#endif				/* } */
+
+
+/*
+** l_bufsize(f) gives the size of the buffer of stream 'f'. Writes at
+** least this large go directly to the file.
+*/
+#if !defined(l_bufsize)
+#define l_bufsize(f)		((void)(f), (size_t)BUFSIZ)
+#endif
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** l_fseek: configuration for longer offsets
@@ -144,6 +334,7 @@ static int l_checkmode (const char *mode) {
 #define IOPREF_LEN	(sizeof(IO_PREFIX)/sizeof(char) - 1)
 #define IO_INPUT	(IO_PREFIX "input")
 #define IO_OUTPUT	(IO_PREFIX "output")
+#define IO_BUFFERS	(IO_PREFIX "buffers")
 
 
 typedef luaL_Stream LStream;
@@ -234,12 +425,49 @@ static int f_gc (lua_State *L) {
 }
 
 
+/*
+** Buffers given by 'setvbuf' are allocated with the state allocator
+** (so that they count for its limits) and chained in a table with
+** weak keys in the registry, from file handle to its last buffer.
+** They are freed only after the stream is closed, as the C library
+** may keep using a buffer even after it is replaced. (A handle being
+** finalized keeps its entry until the next collection.)
+*/
+typedef struct IOBuffer {
+  struct IOBuffer *previous;  /* buffer given before this one */
+  size_t size;  /* total size of this block */
+} IOBuffer;
+
+
+/* free the buffers of the (already closed) stream at index 1 */
+static void freebuffers (lua_State *L) {
+  if (lua_getfield(L, LUA_REGISTRYINDEX, IO_BUFFERS) == LUA_TTABLE) {
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(L, &ud);
+    IOBuffer *b;
+    lua_pushvalue(L, 1);
+    b = (lua_rawget(L, -2), (IOBuffer *)lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    lua_rawset(L, -3);  /* remove entry */
+    while (b != NULL) {
+      IOBuffer *previous = b->previous;
+      allocf(ud, b, b->size, 0);
+      b = previous;
+    }
+  }
+  lua_pop(L, 1);
+}
+
+
 /*
 ** function to close regular files
 */
 static int io_fclose (lua_State *L) {
   LStream *p = tolstream(L);
   int res = fclose(p->f);
+  freebuffers(L);
   return luaL_fileresult(L, (res == 0), NULL);
 }
 
@@ -276,8 +504,11 @@ static int io_open (lua_State *L) {
 */
 static int io_pclose (lua_State *L) {
   LStream *p = tolstream(L);
+  int stat;
   errno = 0;
-  return luaL_execresult(L, l_pclose(L, p->f));
+  stat = l_pclose(L, p->f);
+  freebuffers(L);
+  return luaL_execresult(L, stat);
 }
 
 
@@ -299,6 +530,198 @@ static int io_tmpfile (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Mapped files
+** =======================================================
+*/
+
+#define IO_MAPPED	"MAPPED*"
+
+
+typedef struct LMap {
+  const char *s;  /* contents of the file (NULL if closed) */
+  size_t len;
+} LMap;
+
+
+#define tolmap(L)	((LMap *)luaL_checkudata(L, 1, IO_MAPPED))
+
+
+static const LMap *tomap (lua_State *L) {
+  LMap *m = tolmap(L);
+  if (m->s == NULL)
+    luaL_error(L, "attempt to use a closed mapped file");
+  return m;
+}
+
+
+/* translate a relative position, as 'string.sub' does */
+static size_t m_posrelat (lua_Integer pos, size_t len) {
+  if (pos > 0)
+    return (size_t)pos;
+  else if (pos == 0)
+    return 1;
+  else if (pos < -(lua_Integer)len)  /* inverted comparison */
+    return 1;  /* clip to 1 */
+  else return len + (size_t)pos + 1;
+}
+
+
+/* end position of a slice, as 'string.sub' does */
+static size_t m_getend (lua_State *L, int arg, lua_Integer def,
+                        size_t len) {
+  lua_Integer pos = luaL_optinteger(L, arg, def);
+  if (pos > (lua_Integer)len)
+    return len;
+  else if (pos >= 0)
+    return (size_t)pos;
+  else if (pos < -(lua_Integer)len)
+    return 0;
+  else return len + (size_t)pos + 1;
+}
+
+
+static int io_mmap (lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  LMap *m = (LMap *)lua_newuserdatauv(L, sizeof(LMap), 0);
+  m->s = NULL;  /* mark it as closed */
+  m->len = 0;
+  luaL_setmetatable(L, IO_MAPPED);
+  m->s = l_mmap(L, filename, &m->len);
+  return (m->s == NULL) ? luaL_fileresult(L, 0, filename) : 1;
+}
+
+
+static int m_close (lua_State *L) {
+  LMap *m = (LMap *)tomap(L);
+  int res = l_munmap(L, m->s, m->len);
+  m->s = NULL;  /* mark it as closed */
+  return luaL_fileresult(L, (res == 0), NULL);
+}
+
+
+static int m_gc (lua_State *L) {
+  LMap *m = tolmap(L);
+  if (m->s != NULL) {
+    (void)l_munmap(L, m->s, m->len);
+    m->s = NULL;
+  }
+  return 0;
+}
+
+
+static int m_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)tomap(L)->len);
+  return 1;
+}
+
+
+static int m_tostring (lua_State *L) {
+  LMap *m = tolmap(L);
+  if (m->s == NULL)
+    lua_pushliteral(L, "mapped file (closed)");
+  else
+    lua_pushfstring(L, "mapped file (%p)", (void *)m->s);
+  return 1;
+}
+
+
+/*
+** Copy the slice [i, j] of the file into a new string.
+*/
+static int m_sub (lua_State *L) {
+  const LMap *m = tomap(L);
+  size_t start = m_posrelat(luaL_optinteger(L, 2, 1), m->len);
+  size_t end = m_getend(L, 3, -1, m->len);
+  if (start <= end)
+    lua_pushlstring(L, m->s + start - 1, (end - start) + 1);
+  else lua_pushliteral(L, "");
+  return 1;
+}
+
+
+static int m_byte (lua_State *L) {
+  const LMap *m = tomap(L);
+  lua_Integer pi = luaL_optinteger(L, 2, 1);
+  size_t start = m_posrelat(pi, m->len);
+  size_t end = m_getend(L, 3, pi, m->len);
+  int n, i;
+  if (start > end)
+    return 0;  /* empty interval; return no values */
+  if (end - start >= (size_t)INT_MAX)
+    return luaL_error(L, "string slice too long");
+  n = (int)(end - start) + 1;
+  luaL_checkstack(L, n, "string slice too long");
+  for (i = 0; i < n; i++)
+    lua_pushinteger(L, (unsigned char)m->s[start + i - 1]);
+  return n;
+}
+
+
+/*
+** Plain search for string 's' in the file, from position 'init'.
+** Return the start and end positions of the first occurrence.
+*/
+static int m_find (lua_State *L) {
+  const LMap *m = tomap(L);
+  size_t ls;
+  const char *s = luaL_checklstring(L, 2, &ls);
+  size_t init = m_posrelat(luaL_optinteger(L, 3, 1), m->len) - 1;
+  if (init <= m->len && ls <= m->len - init) {
+    const char *p = m->s + init;
+    const char *last = m->s + m->len - ls;  /* last possible start */
+    if (ls == 0) {  /* empty string matches at once */
+      lua_pushinteger(L, (lua_Integer)init + 1);
+      lua_pushinteger(L, (lua_Integer)init);
+      return 2;
+    }
+    while (p <= last &&
+           (p = (const char *)memchr(p, *s, (last - p) + 1)) != NULL) {
+      if (memcmp(p + 1, s + 1, ls - 1) == 0) {
+        lua_pushinteger(L, (p - m->s) + 1);
+        lua_pushinteger(L, (p - m->s) + (lua_Integer)ls);
+        return 2;
+      }
+      p++;
+    }
+  }
+  luaL_pushfail(L);  /* not found */
+  return 1;
+}
+
+
+static const luaL_Reg mapmeth[] = {
+  {"sub", m_sub},
+  {"byte", m_byte},
+  {"find", m_find},
+  {"close", m_close},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg mapmetameth[] = {
+  {"__index", NULL},  /* place holder */
+  {"__gc", m_gc},
+  {"__close", m_gc},
+  {"__len", m_len},
+  {"__tostring", m_tostring},
+  {NULL, NULL}
+};
+
+
+static void createmapmeta (lua_State *L) {
+  luaL_newmetatable(L, IO_MAPPED);  /* metatable for mapped files */
+  luaL_setfuncs(L, mapmetameth, 0);
+  luaL_newlibtable(L, mapmeth);
+  luaL_setfuncs(L, mapmeth, 0);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = method table */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
+/* }====================================================== */
+
+
 static FILE *getiofile (lua_State *L, const char *findex) {
   LStream *p;
   lua_getfield(L, LUA_REGISTRYINDEX, findex);
@@ -463,10 +886,73 @@ static int readdigits (RN *rn, int hex) {
 }
 
 
+/*
+** Versions of 'test2' and 'readdigits' for a numeral in memory, at
+** position '*i' of 'p' (with 'n' bytes)
+*/
+static int mtest2 (const char *p, size_t n, size_t *i, const char *set) {
+  if (*i < n && (p[*i] == set[0] || p[*i] == set[1])) {
+    (*i)++;
+    return 1;
+  }
+  else return 0;
+}
+
+
+static int mreaddigits (const char *p, size_t n, size_t *i, int hex) {
+  int count = 0;
+  for (; *i < n; (*i)++, count++) {
+    int c = (unsigned char)p[*i];
+    if (!(hex ? isxdigit(c) : isdigit(c)))
+      break;
+  }
+  return count;
+}
+
+
+/*
+** Try to read a numeral directly from the buffer of stream 'f' into
+** 'rn->buff', following the same syntax used by 'read_number'. Return
+** false (after skipping only spaces) if the numeral is not entirely
+** inside the buffer, so that its end cannot be decided there, or if
+** it is too long.
+*/
+static int buffnumeral (FILE *f, RN *rn, const char *decp) {
+  size_t n, i = 0;
+  int count = 0;
+  int hex = 0;
+  const char *p = l_getbuff(f, &n);
+  while (i < n && isspace((unsigned char)p[i]))  /* skip spaces */
+    i++;
+  l_skipbuff(f, i);
+  p += i; n -= i; i = 0;
+  mtest2(p, n, &i, "-+");  /* optional sign */
+  if (mtest2(p, n, &i, "00")) {
+    if (mtest2(p, n, &i, "xX")) hex = 1;  /* numeral is hexadecimal */
+    else count = 1;  /* count initial '0' as a valid digit */
+  }
+  count += mreaddigits(p, n, &i, hex);  /* integral part */
+  if (mtest2(p, n, &i, decp))  /* decimal point? */
+    count += mreaddigits(p, n, &i, hex);  /* fractional part */
+  if (count > 0 && mtest2(p, n, &i, (hex ? "pP" : "eE"))) {
+    mtest2(p, n, &i, "-+");  /* exponent sign */
+    mreaddigits(p, n, &i, 0);  /* exponent digits */
+  }
+  if (i >= n || i >= L_MAXLENNUM)  /* no look-ahead char or too long? */
+    return 0;  /* use the slow path */
+  memcpy(rn->buff, p, i);
+  rn->n = (int)i;
+  l_skipbuff(f, i);
+  return 1;
+}
+
+
 /*
 ** Read a number: first reads a valid prefix of a numeral into a buffer.
 ** Then it calls 'lua_stringtonumber' to check whether the format is
-** correct and to convert it to a Lua number.
+** correct and to convert it to a Lua number. When the whole numeral is
+** already in the stream buffer, it is taken from there at once;
+** otherwise, it is read character by character.
 */
 static int read_number (lua_State *L, FILE *f) {
   RN rn;
@@ -477,20 +963,22 @@ static int read_number (lua_State *L, FILE *f) {
   decp[0] = lua_getlocaledecpoint();  /* get decimal point from locale */
   decp[1] = '.';  /* always accept a dot */
   l_lockfile(rn.f);
-  do { rn.c = l_getc(rn.f); } while (isspace(rn.c));  /* skip spaces */
-  test2(&rn, "-+");  /* optional sign */
-  if (test2(&rn, "00")) {
-    if (test2(&rn, "xX")) hex = 1;  /* numeral is hexadecimal */
-    else count = 1;  /* count initial '0' as a valid digit */
-  }
-  count += readdigits(&rn, hex);  /* integral part */
-  if (test2(&rn, decp))  /* decimal point? */
-    count += readdigits(&rn, hex);  /* fractional part */
-  if (count > 0 && test2(&rn, (hex ? "pP" : "eE"))) {  /* exponent mark? */
-    test2(&rn, "-+");  /* exponent sign */
-    readdigits(&rn, 0);  /* exponent digits */
+  if (!buffnumeral(rn.f, &rn, decp)) {
+    do { rn.c = l_getc(rn.f); } while (isspace(rn.c));  /* skip spaces */
+    test2(&rn, "-+");  /* optional sign */
+    if (test2(&rn, "00")) {
+      if (test2(&rn, "xX")) hex = 1;  /* numeral is hexadecimal */
+      else count = 1;  /* count initial '0' as a valid digit */
+    }
+    count += readdigits(&rn, hex);  /* integral part */
+    if (test2(&rn, decp))  /* decimal point? */
+      count += readdigits(&rn, hex);  /* fractional part */
+    if (count > 0 && test2(&rn, (hex ? "pP" : "eE"))) {  /* exponent? */
+      test2(&rn, "-+");  /* exponent sign */
+      readdigits(&rn, 0);  /* exponent digits */
+    }
+    ungetc(rn.c, rn.f);  /* unread look-ahead char */
   }
-  ungetc(rn.c, rn.f);  /* unread look-ahead char */
   l_unlockfile(rn.f);
   rn.buff[rn.n] = '\0';  /* finish string */
   if (lua_stringtonumber(L, rn.buff))  /* is this a valid number? */
@@ -510,16 +998,51 @@ static int test_eof (lua_State *L, FILE *f) {
 }
 
 
+/*
+** Read from 'f' into 'buff' (with 'size' bytes) up to the end of a line.
+** Whole runs of characters already in the stream buffer are copied at
+** once. Return the last character read ('\n' or EOF), or 0 if the buffer
+** filled up. Must be called with the stream locked.
+*/
+static int getline_aux (FILE *f, char *buff, size_t size, size_t *pi) {
+  size_t i = 0;
+  int c = 0;
+  while (i < size) {
+    size_t n;
+    const char *p = l_getbuff(f, &n);
+    if (n > 0) {  /* is there buffered data? */
+      const char *nl;
+      if (n > size - i) n = size - i;
+      nl = (const char *)memchr(p, '\n', n);
+      if (nl != NULL) n = nl - p;
+      memcpy(buff + i, p, n);
+      i += n;
+      if (nl != NULL) {  /* found end of line? */
+        l_skipbuff(f, n + 1);  /* skip line and its newline */
+        c = '\n';
+        break;
+      }
+      l_skipbuff(f, n);
+    }
+    else if ((c = l_getc(f)) == EOF || c == '\n')  /* refill buffer */
+      break;
+    else
+      buff[i++] = c;
+  }
+  *pi = i;
+  return c;
+}
+
+
 static int read_line (lua_State *L, FILE *f, int chop) {
   luaL_Buffer b;
   int c;
   luaL_buffinit(L, &b);
   do {  /* may need to read several chunks to get whole line */
     char *buff = luaL_prepbuffer(&b);  /* preallocate buffer space */
-    int i = 0;
+    size_t i;
     l_lockfile(f);  /* no memory errors can happen inside the lock */
-    while (i < LUAL_BUFFERSIZE && (c = l_getc(f)) != EOF && c != '\n')
-      buff[i++] = c;  /* read up to end of line or buffer limit */
+    c = getline_aux(f, buff, LUAL_BUFFERSIZE, &i);
     l_unlockfile(f);
     luaL_addsize(&b, i);
   } while (c != EOF && c != '\n');  /* repeat until end of line */
@@ -617,6 +1140,53 @@ static int f_read (lua_State *L) {
 }
 
 
+/*
+** Read up to 'n' lines (or numbers) from 'f' into a table, from index
+** 1. Arguments start at index 'first': the number of items, an optional
+** table (to be reused), and an optional format ("l", "L", or "n").
+** Return the number of items read (0 at the end of the file) and the
+** table.
+*/
+static int g_readlines (lua_State *L, FILE *f, int first) {
+  static const char *const modenames[] = {"l", "L", "n", NULL};
+  lua_Integer n = luaL_checkinteger(L, first);
+  lua_Integer i = 0;
+  int mode = luaL_checkoption(L, first + 2, "l", modenames);
+  luaL_argcheck(L, n >= 0, first, "negative number of lines");
+  if (lua_isnoneornil(L, first + 1))
+    lua_createtable(L, (n < LUAL_BUFFERSIZE) ? (int)n : LUAL_BUFFERSIZE, 0);
+  else {
+    luaL_checktype(L, first + 1, LUA_TTABLE);
+    lua_pushvalue(L, first + 1);
+  }
+  clearerr(f);
+  while (i < n) {
+    int ok = (mode == 2) ? read_number(L, f) : read_line(L, f, mode == 0);
+    if (!ok) {  /* end of file (or not a numeral)? */
+      lua_pop(L, 1);  /* remove empty result */
+      break;
+    }
+    lua_rawseti(L, -2, ++i);
+  }
+  if (ferror(f))
+    return luaL_fileresult(L, 0, NULL);
+  lua_pushinteger(L, i);
+  lua_insert(L, -2);  /* put count before the table */
+  return 2;
+}
+
+
+static int io_readlines (lua_State *L) {
+  lua_settop(L, 3);  /* keep arguments below the file from 'getiofile' */
+  return g_readlines(L, getiofile(L, IO_INPUT), 1);
+}
+
+
+static int f_readlines (lua_State *L) {
+  return g_readlines(L, tofile(L), 2);
+}
+
+
 /*
 ** Iteration function for 'lines'.
 */
@@ -651,24 +1221,58 @@ static int io_readline (lua_State *L) {
 /* }====================================================== */
 
 
-static int g_write (lua_State *L, FILE *f, int arg) {
-  int nargs = lua_gettop(L) - arg;
-  int status = 1;
-  for (; nargs--; arg++) {
+/*
+** Write arguments 'arg' to 'arg + n - 1', where 'n <= L_MAXWRITEV'.
+** Numbers are converted into 'nbuff'. Small outputs go through the
+** stream buffer; larger ones are written directly by 'l_writev'.
+** After an error ('status' false), arguments are only checked.
+*/
+static int writeargs (lua_State *L, FILE *f, int arg, int n, int status) {
+  l_iovec iov[L_MAXWRITEV];
+  char nbuff[L_MAXWRITEV][LUA_N2SBUFFSZ];
+  size_t total = 0;
+  int i;
+  for (i = 0; i < n; i++, arg++) {
+    size_t l;
+    const char *s;
     if (lua_type(L, arg) == LUA_TNUMBER) {
-      /* optimization: could be done exactly as for strings */
       int len = lua_isinteger(L, arg)
-                ? fprintf(f, LUA_INTEGER_FMT,
-                             (LUAI_UACINT)lua_tointeger(L, arg))
-                : fprintf(f, LUA_NUMBER_FMT,
-                             (LUAI_UACNUMBER)lua_tonumber(L, arg));
+                ? lua_integer2str(nbuff[i], LUA_N2SBUFFSZ,
+                                  lua_tointeger(L, arg))
+                : lua_number2str(nbuff[i], LUA_N2SBUFFSZ,
+                                 lua_tonumber(L, arg));
       status = status && (len > 0);
+      s = nbuff[i];
+      l = (len > 0) ? (size_t)len : 0;
     }
-    else {
-      size_t l;
-      const char *s = luaL_checklstring(L, arg, &l);
-      status = status && (fwrite(s, sizeof(char), l, f) == l);
+    else
+      s = luaL_checklstring(L, arg, &l);
+    iov[i].iov_base = (void *)s;
+    iov[i].iov_len = l;
+    total += l;
+  }
+  if (!status)
+    return 0;
+  else if (total >= l_bufsize(f))  /* would not fit in the buffer? */
+    return l_writev(f, iov, n);
+  else {
+    for (i = 0; i < n; i++) {
+      if (fwrite(iov[i].iov_base, sizeof(char), iov[i].iov_len, f) !=
+          iov[i].iov_len)
+        return 0;
     }
+    return 1;
+  }
+}
+
+
+static int g_write (lua_State *L, FILE *f, int arg) {
+  int nargs = lua_gettop(L) - arg;
+  int status = 1;
+  while (nargs > 0) {
+    int n = (nargs < L_MAXWRITEV) ? nargs : L_MAXWRITEV;
+    status = writeargs(L, f, arg, n, status);
+    arg += n; nargs -= n;
   }
   if (status) return 1;  /* file handle already on stack top */
   else return luaL_fileresult(L, status, NULL);
@@ -706,13 +1310,63 @@ static int f_seek (lua_State *L) {
 }
 
 
+static int io_noclose (lua_State *L);
+
+
+/*
+** With an explicit size, a stream closed by this library gets a buffer
+** of its own (see 'freebuffers'); otherwise, the C library chooses the
+** buffer. Standard files are never closed, so they always get buffers
+** from the C library.
+*/
 static int f_setvbuf (lua_State *L) {
   static const int mode[] = {_IONBF, _IOFBF, _IOLBF};
   static const char *const modenames[] = {"no", "full", "line", NULL};
   FILE *f = tofile(L);
   int op = luaL_checkoption(L, 2, NULL, modenames);
   lua_Integer sz = luaL_optinteger(L, 3, LUAL_BUFFERSIZE);
-  int res = setvbuf(f, NULL, mode[op], (size_t)sz);
+  lua_CFunction cf = tolstream(L)->closef;
+  IOBuffer *b = NULL;
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  int res;
+  luaL_argcheck(L, sz >= 0 && (lua_Integer)(size_t)sz == sz &&
+                   (size_t)sz <= ~(size_t)0 - sizeof(IOBuffer), 3,
+                   "invalid buffer size");
+  if (mode[op] != _IONBF && !lua_isnoneornil(L, 3) && sz > 0 &&
+      (cf == &io_fclose || cf == &io_pclose)) {
+    if (luaL_getsubtable(L, LUA_REGISTRYINDEX, IO_BUFFERS) == 0) {
+      lua_pushliteral(L, "k");
+      lua_setfield(L, -2, "__mode");
+      lua_pushvalue(L, -1);
+      lua_setmetatable(L, -2);  /* new table is its own metatable */
+    }
+    lua_pushvalue(L, 1);
+    if (lua_rawget(L, -2) == LUA_TNIL) {  /* no entry for this handle? */
+      lua_pushvalue(L, 1);
+      lua_pushboolean(L, 0);
+      lua_rawset(L, -4);  /* create it now, as setting it must not fail */
+    }
+    b = (IOBuffer *)allocf(ud, NULL, 0, sizeof(IOBuffer) + (size_t)sz);
+    if (b == NULL) {
+      lua_pushliteral(L, "not enough memory");
+      return lua_error(L);
+    }
+    b->size = sizeof(IOBuffer) + (size_t)sz;
+    b->previous = (IOBuffer *)lua_touserdata(L, -1);
+    lua_pop(L, 1);  /* remove old buffer */
+  }
+  res = setvbuf(f, (b != NULL) ? (char *)(b + 1) : NULL, mode[op],
+                   (size_t)sz);
+  if (b != NULL) {
+    if (res == 0) {  /* chain new buffer */
+      lua_pushvalue(L, 1);
+      lua_pushlightuserdata(L, b);
+      lua_rawset(L, -3);
+    }
+    else
+      allocf(ud, b, b->size, 0);
+  }
   return luaL_fileresult(L, res == 0, NULL);
 }
 
@@ -736,10 +1390,12 @@ static const luaL_Reg iolib[] = {
   {"flush", io_flush},
   {"input", io_input},
   {"lines", io_lines},
+  {"mmap", io_mmap},
   {"open", io_open},
   {"output", io_output},
   {"popen", io_popen},
   {"read", io_read},
+  {"readlines", io_readlines},
   {"tmpfile", io_tmpfile},
   {"type", io_type},
   {"write", io_write},
@@ -752,6 +1408,7 @@ static const luaL_Reg iolib[] = {
 */
 static const luaL_Reg meth[] = {
   {"read", f_read},
+  {"readlines", f_readlines},
   {"write", f_write},
   {"lines", f_lines},
   {"flush", f_flush},
@@ -812,6 +1469,7 @@ static void createstdfile (lua_State *L, FILE *f, const char *k,
 LUAMOD_API int luaopen_io (lua_State *L) {
   luaL_newlib(L, iolib);  /* new module */
   createmeta(L);
+  createmapmeta(L);
   /* create (and set) default files */
   createstdfile(L, stdin, IO_INPUT, "stdin");
   createstdfile(L, stdout, IO_OUTPUT, "stdout");
@@ -275,6 +275,27 @@ static lua_CFunction lsys_sym (lua_State *L, void *lib, const char *sym) {
 #define LUA_CPATH_VAR   "LUA_CPATH"
 #endif
 
+/*
+** LUA_BUNDLEPATH_VAR is the name of the environment variable that Lua
+** checks to set 'package.bundlepath', which by default is
+** LUA_BUNDLEPATH_DEFAULT (no bundles).
+*/
+#if !defined(LUA_BUNDLEPATH_VAR)
+#define LUA_BUNDLEPATH_VAR	"LUA_BUNDLEPATH"
+#endif
+
+#if !defined(LUA_BUNDLEPATH_DEFAULT)
+#define LUA_BUNDLEPATH_DEFAULT	""
+#endif
+
+/*
+** LUA_CACHEDIR_VAR is the name of the environment variable that Lua
+** checks to set the directory for its cache of compiled chunks.
+*/
+#if !defined(LUA_CACHEDIR_VAR)
+#define LUA_CACHEDIR_VAR	"LUA_CACHEDIR"
+#endif
+
 
 
 /*
@@ -324,6 +345,31 @@ static void setpath (lua_State *L, const char *fieldname,
   lua_pop(L, 1);  /* pop versioned variable name ('nver') */
 }
 
+
+/*
+** Set table 'package.cache', the registry table that controls the
+** cache of compiled chunks, with its directory from the environment
+** (if any)
+*/
+static void setcache (lua_State *L) {
+  const char *nver = lua_pushfstring(L, "%s%s", LUA_CACHEDIR_VAR,
+                                                LUA_VERSUFFIX);
+  const char *dir = getenv(nver);  /* try versioned name */
+  if (dir == NULL)  /* no versioned environment variable? */
+    dir = getenv(LUA_CACHEDIR_VAR);  /* try unversioned name */
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_CACHE_TABLE);
+  lua_pushinteger(L, 0);
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, 0);
+  lua_setfield(L, -2, "misses");
+  if (dir != NULL && *dir != '\0' && !noenv(L)) {
+    lua_pushstring(L, dir);
+    lua_setfield(L, -2, "dir");
+  }
+  lua_setfield(L, -3, "cache");  /* package.cache = cache table */
+  lua_pop(L, 1);  /* pop versioned variable name ('nver') */
+}
+
 /* }================================================================== */
 
 
@@ -437,6 +483,89 @@ static int readable (const char *filename) {
 }
 
 
+/*
+** l_listdir(L, dir) pushes a set with the names in directory 'dir' (an
+** empty set if 'dir' does not exist) and returns 1, or returns 0
+** (pushing nothing) if it cannot list 'dir'.
+*/
+#if !defined(l_listdir)	/* { */
+
+#if defined(LUA_USE_POSIX)
+
+#include <dirent.h>
+#include <errno.h>
+
+static int l_listdir (lua_State *L, const char *dir) {
+  struct dirent *e;
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    if (errno != ENOENT && errno != ENOTDIR)
+      return 0;  /* directory may exist, but cannot be listed */
+    lua_newtable(L);  /* no directory: an empty listing */
+    return 1;
+  }
+  lua_newtable(L);
+  while ((e = readdir(d)) != NULL) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, e->d_name);
+  }
+  closedir(d);
+  return 1;
+}
+
+#else
+
+#define l_listdir(L,dir)	((void)(L), (void)(dir), 0)
+
+#endif
+
+#endif				/* } */
+
+
+/*
+** Check whether 'filename' is readable using the search cache at index
+** 'cache'. The cache keeps, for each directory, the set of its names
+** (or false if the directory cannot be listed); a file that is not
+** in its directory listing is not opened. For directories that cannot
+** be listed, the cache keeps the result for each file.
+*/
+static int cachedreadable (lua_State *L, int cache, const char *filename) {
+  const char *base = strrchr(filename, *LUA_DIRSEP);
+  int res;
+  if (base == NULL) {  /* no directory? */
+    lua_pushliteral(L, ".");
+    base = filename;
+  }
+  else {
+    base++;  /* skip separator */
+    lua_pushlstring(L, filename, base - filename);  /* directory */
+  }
+  lua_pushvalue(L, -1);
+  if (lua_rawget(L, cache) == LUA_TNIL) {  /* directory not listed yet? */
+    lua_pop(L, 1);  /* remove nil */
+    if (!l_listdir(L, lua_tostring(L, -1)))
+      lua_pushboolean(L, 0);  /* cannot list it */
+    lua_pushvalue(L, -2);  /* directory */
+    lua_pushvalue(L, -2);  /* listing */
+    lua_rawset(L, cache);  /* cache[directory] = listing */
+  }
+  if (lua_istable(L, -1)) {  /* have a listing? */
+    res = (lua_getfield(L, -1, base) != LUA_TNIL && readable(filename));
+    lua_pop(L, 3);  /* remove directory, listing, and its entry */
+  }
+  else {
+    lua_pop(L, 2);  /* remove directory and its listing */
+    if (lua_getfield(L, cache, filename) == LUA_TNIL) {  /* no result? */
+      lua_pushboolean(L, readable(filename));
+      lua_setfield(L, cache, filename);  /* cache[filename] = result */
+    }
+    res = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  return res;
+}
+
+
 /*
 ** Get the next name in '*path' = 'name1;name2;name3;...', changing
 ** the ending ';' to '\0' to create a zero-terminated string. Return
@@ -476,10 +605,15 @@ static void pusherrornotfound (lua_State *L, const char *path) {
 }
 
 
+/*
+** Search for 'name' in 'path', using the search cache at index 'cache'
+** (if not 0).
+*/
 static const char *searchpath (lua_State *L, const char *name,
                                              const char *path,
                                              const char *sep,
-                                             const char *dirsep) {
+                                             const char *dirsep,
+                                             int cache) {
   luaL_Buffer buff;
   char *pathname;  /* path with name inserted */
   char *endpathname;  /* its end */
@@ -494,7 +628,8 @@ static const char *searchpath (lua_State *L, const char *name,
   pathname = luaL_buffaddr(&buff);  /* writable list of file names */
   endpathname = pathname + luaL_bufflen(&buff) - 1;
   while ((filename = getnextfilename(&pathname, endpathname)) != NULL) {
-    if (readable(filename))  /* does file exist and is readable? */
+    /* does file exist and is readable? */
+    if (cache ? cachedreadable(L, cache, filename) : readable(filename))
       return lua_pushstring(L, filename);  /* save and return name */
   }
   luaL_pushresult(&buff);  /* push path to create error message */
@@ -507,7 +642,7 @@ static int ll_searchpath (lua_State *L) {
   const char *f = searchpath(L, luaL_checkstring(L, 1),
                                 luaL_checkstring(L, 2),
                                 luaL_optstring(L, 3, "."),
-                                luaL_optstring(L, 4, LUA_DIRSEP));
+                                luaL_optstring(L, 4, LUA_DIRSEP), 0);
   if (f != NULL) return 1;
   else {  /* error message is on top of the stack */
     luaL_pushfail(L);
@@ -521,11 +656,14 @@ static const char *findfile (lua_State *L, const char *name,
                                            const char *pname,
                                            const char *dirsep) {
   const char *path;
+  int cache;
   lua_getfield(L, lua_upvalueindex(1), pname);
   path = lua_tostring(L, -1);
   if (path == NULL)
     luaL_error(L, "'package.%s' must be a string", pname);
-  return searchpath(L, name, path, ".", dirsep);
+  lua_getfield(L, lua_upvalueindex(1), "searchcache");
+  cache = lua_istable(L, -1) ? lua_gettop(L) : 0;
+  return searchpath(L, name, path, ".", dirsep, cache);
 }
 
 
@@ -619,6 +757,454 @@ static int searcher_preload (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Bundles
+** =======================================================
+*/
+
+/*
+** A bundle is a single file with several Lua modules. It starts with
+** the signature LUA_BUNDLESIG and the number of modules, followed by an
+** entry for each module, sorted by module name (as byte strings), and
+** then by the names and the chunks of the modules. Each entry has the
+** offset and the size of the module name and of its chunk. All these
+** numbers have 4 bytes, most significant first; offsets count from the
+** start of the bundle. Chunks (usually precompiled) start at offsets
+** multiple of BUNDLEALIGN, so that they can be used in place.
+*/
+
+#define LUA_BUNDLESIG	"\x1bLuB"
+
+#define BUNDLEHEADER	8	/* signature plus number of modules */
+#define BUNDLEENTRY	16	/* size of each entry */
+#define BUNDLEALIGN	16	/* alignment of chunks */
+
+#define MAXBUNDLE	0xFFFFFFFFu	/* maximum size of a bundle */
+
+
+/*
+** key for table in the registry that keeps all open bundles, indexed
+** by their file names
+*/
+static const char *const BUNDLES = "_BUNDLES";
+
+
+typedef struct Bundle {
+  const char *base;  /* contents of the bundle */
+  size_t size;
+  int mapped;  /* is 'base' a memory map of the bundle file? */
+} Bundle;
+
+
+/*
+** l_mapbundle(f,sz) maps file 'f' in memory, setting '*sz' with its
+** size; it returns NULL if it cannot map the file. l_unmapbundle(p,sz)
+** unmaps it.
+*/
+#if !defined(l_mapbundle)	/* { */
+
+#if defined(LUA_USE_POSIX)
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char *l_mapbundle (FILE *f, size_t *sz) {
+  struct stat st;
+  void *p;
+  if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_size == 0 || (off_t)(size_t)st.st_size != st.st_size)
+    return NULL;
+  *sz = (size_t)st.st_size;
+  p = mmap(NULL, *sz, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  return (p == MAP_FAILED) ? NULL : (const char *)p;
+}
+
+#define l_unmapbundle(p,sz)	munmap((void *)(p), sz)
+
+#else
+
+#define l_mapbundle(f,sz)	((void)(f), (void)(sz), NULL)
+#define l_unmapbundle(p,sz)	((void)(p), (void)(sz))
+
+#endif
+
+#endif				/* } */
+
+
+static size_t getbnum (const char *p) {
+  const unsigned char *u = (const unsigned char *)p;
+  return ((size_t)u[0] << 24) | ((size_t)u[1] << 16) |
+         ((size_t)u[2] << 8) | (size_t)u[3];
+}
+
+
+/*
+** __gc tag method for BUNDLES table: unmaps all mapped bundles. (As
+** the table is created with the package library, this finalizer runs
+** after the finalizers of objects created later, which may still
+** call functions from bundles.)
+*/
+static int gcbundles (lua_State *L) {
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    Bundle *b = (Bundle *)lua_touserdata(L, -1);
+    if (b != NULL && b->mapped) {
+      l_unmapbundle(b->base, b->size);
+      b->mapped = 0;
+      b->base = NULL;
+    }
+    lua_pop(L, 1);  /* pop bundle */
+  }
+  return 0;
+}
+
+
+/*
+** Read the contents of file 'f' into a new userdata, set as the user
+** value of the bundle at the top. Return 0 on errors.
+*/
+static int readbundle (lua_State *L, Bundle *b, FILE *f) {
+  long size;
+  char *buff;
+  if (fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0 ||
+      fseek(f, 0, SEEK_SET) != 0)
+    return 0;
+  buff = (char *)lua_newuserdatauv(L, (size_t)size, 0);
+  lua_setiuservalue(L, -2, 1);  /* keep it with the bundle */
+  if (fread(buff, 1, (size_t)size, f) != (size_t)size)
+    return 0;
+  b->base = buff;
+  b->size = (size_t)size;
+  return 1;
+}
+
+
+/*
+** Check the header and the entries of bundle 'b'.
+*/
+static int checkbundle (Bundle *b) {
+  size_t n, i;
+  if (b->size < BUNDLEHEADER || b->size > MAXBUNDLE ||
+      memcmp(b->base, LUA_BUNDLESIG, sizeof(LUA_BUNDLESIG) - 1) != 0)
+    return 0;
+  n = getbnum(b->base + 4);
+  if (n > (b->size - BUNDLEHEADER) / BUNDLEENTRY)
+    return 0;
+  for (i = 0; i < n; i++) {
+    const char *e = b->base + BUNDLEHEADER + i * BUNDLEENTRY;
+    size_t off = getbnum(e), len = getbnum(e + 4);
+    if (off > b->size || len > b->size - off)
+      return 0;  /* bad name */
+    off = getbnum(e + 8); len = getbnum(e + 12);
+    if (off > b->size || len > b->size - off)
+      return 0;  /* bad chunk */
+  }
+  return 1;
+}
+
+
+/*
+** Get the bundle in file 'fname', opening it if needed. Returns NULL
+** plus an error message in the stack if it cannot open the bundle.
+*/
+static Bundle *getbundle (lua_State *L, const char *fname) {
+  Bundle *b;
+  FILE *f;
+  int ok;
+  lua_getfield(L, LUA_REGISTRYINDEX, BUNDLES);
+  if (lua_getfield(L, -1, fname) == LUA_TUSERDATA) {  /* already open? */
+    b = (Bundle *)lua_touserdata(L, -1);
+    lua_pop(L, 2);  /* remove bundle and BUNDLES table */
+    return b;
+  }
+  lua_pop(L, 1);  /* remove non-bundle */
+  f = fopen(fname, "rb");
+  if (f == NULL) {
+    lua_pop(L, 1);  /* remove BUNDLES table */
+    lua_pushfstring(L, "no file '%s'", fname);
+    return NULL;
+  }
+  b = (Bundle *)lua_newuserdatauv(L, sizeof(Bundle), 1);
+  b->base = NULL; b->size = 0; b->mapped = 0;
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -3, fname);  /* BUNDLES[fname] = bundle */
+  b->base = l_mapbundle(f, &b->size);
+  if (b->base != NULL)
+    b->mapped = 1;
+  ok = (b->mapped || readbundle(L, b, f)) && checkbundle(b);
+  fclose(f);
+  if (!ok) {
+    if (b->mapped)
+      l_unmapbundle(b->base, b->size);
+    b->mapped = 0;
+    lua_pushnil(L);
+    lua_setfield(L, -3, fname);  /* BUNDLES[fname] = nil */
+    lua_pop(L, 2);  /* remove bundle and BUNDLES table */
+    lua_pushfstring(L, "file '%s' is not a valid bundle", fname);
+    return NULL;
+  }
+  lua_pop(L, 2);  /* remove bundle (kept in BUNDLES) and BUNDLES table */
+  return b;
+}
+
+
+/*
+** Find module 'name' (with length 'len') in bundle 'b', with a binary
+** search over its sorted entries. Returns its entry or NULL.
+*/
+static const char *findmodule (Bundle *b, const char *name, size_t len) {
+  size_t lo = 0;
+  size_t hi = getbnum(b->base + 4);
+  while (lo < hi) {
+    size_t m = lo + (hi - lo) / 2;
+    const char *e = b->base + BUNDLEHEADER + m * BUNDLEENTRY;
+    size_t elen = getbnum(e + 4);
+    int res = memcmp(name, b->base + getbnum(e), (len < elen) ? len : elen);
+    if (res == 0)
+      res = (len > elen) - (len < elen);
+    if (res == 0)
+      return e;
+    else if (res < 0)
+      hi = m;
+    else
+      lo = m + 1;
+  }
+  return NULL;
+}
+
+
+/*
+** Release function for chunks loaded from bundles: bundles stay open
+** until the state is closed (see 'gcbundles'), so there is nothing to
+** release.
+*/
+static void *keepbundle (void *ud, void *ptr, size_t osize, size_t nsize) {
+  (void)ud; (void)ptr; (void)osize; (void)nsize;  /* not used */
+  return NULL;
+}
+
+
+static int searcher_bundle (lua_State *L) {
+  size_t len;
+  const char *name = luaL_checklstring(L, 1, &len);
+  const char *bpath;
+  int nmsg = 0;  /* number of error messages in the stack */
+  lua_getfield(L, lua_upvalueindex(1), "bundlepath");
+  bpath = lua_tostring(L, -1);
+  if (bpath == NULL)
+    luaL_error(L, "'package.bundlepath' must be a string");
+  while (*bpath != '\0') {
+    const char *sep = strchr(bpath, *LUA_PATH_SEP);
+    size_t l = (sep == NULL) ? strlen(bpath) : (size_t)(sep - bpath);
+    if (l > 0) {  /* not an empty name? */
+      const char *fname = lua_pushlstring(L, bpath, l);
+      Bundle *b = getbundle(L, fname);
+      const char *e;
+      if (b == NULL)  /* cannot open bundle? */
+        nmsg++;  /* keep error message */
+      else if ((e = findmodule(b, name, len)) == NULL) {
+        lua_pushfstring(L, "no module '%s' in file '%s'", name, fname);
+        nmsg++;
+      }
+      else {  /* found it */
+        int stat;
+        lua_pushfstring(L, "@%s:%s", fname, name);  /* chunk name */
+        stat = (lua_loadmapped(L, b->base + getbnum(e + 8), getbnum(e + 12),
+                                  keepbundle, NULL, lua_tostring(L, -1), NULL)
+                == LUA_OK);
+        return checkload(L, stat, fname);
+      }
+      lua_remove(L, -2);  /* remove file name */
+      if (nmsg > 1) {  /* join with previous message */
+        lua_pushliteral(L, "\n\t");
+        lua_insert(L, -2);
+        lua_concat(L, 3);
+        nmsg = 1;
+      }
+    }
+    if (sep == NULL) break;
+    bpath = sep + 1;
+  }
+  return nmsg;  /* error message (or nothing, if no bundles) */
+}
+
+
+/*
+** Writer for 'lua_dump' that adds to a buffer
+*/
+static int bundlewriter (lua_State *L, const void *b, size_t sz, void *ud) {
+  (void)L;  /* not used */
+  luaL_addlstring((luaL_Buffer *)ud, (const char *)b, sz);
+  return 0;
+}
+
+
+/*
+** Push the chunk for module in file 'fname': its source (skipping
+** an optional BOM and a first line starting with '#', except for its
+** end of line) if 'mode' has a 't', or else its precompiled chunk
+** (stripped if 'mode' has an 's').
+*/
+static void pushchunk (lua_State *L, const char *fname, const char *mode) {
+  luaL_Buffer b;
+  if (luaL_loadfile(L, fname) != LUA_OK)
+    lua_error(L);  /* propagate error message */
+  if (strchr(mode, 't') != NULL) {
+    FILE *f = fopen(fname, "rb");
+    size_t n;
+    const char *s;
+    if (f == NULL)
+      luaL_error(L, "cannot open %s", fname);
+    luaL_buffinit(L, &b);
+    do {
+      char *p = luaL_prepbuffer(&b);
+      n = fread(p, 1, LUAL_BUFFERSIZE, f);
+      luaL_addsize(&b, n);
+    } while (n == LUAL_BUFFERSIZE);
+    n = (size_t)ferror(f);
+    fclose(f);
+    if (n)
+      luaL_error(L, "cannot read %s", fname);
+    luaL_pushresult(&b);
+    s = lua_tolstring(L, -1, &n);
+    if (n >= 3 && memcmp(s, "\xEF\xBB\xBF", 3) == 0) {  /* BOM? */
+      s += 3; n -= 3;
+    }
+    if (n > 0 && *s == '#') {  /* first-line comment? */
+      size_t l = strcspn(s, "\n");
+      s += l; n -= l;
+    }
+    lua_pushlstring(L, s, n);
+    lua_replace(L, -3);  /* source replaces function */
+    lua_pop(L, 1);  /* remove whole contents */
+  }
+  else {
+    luaL_buffinit(L, &b);
+    lua_dump(L, bundlewriter, &b, strchr(mode, 's') != NULL);
+    luaL_pushresult(&b);
+    lua_replace(L, -2);  /* chunk replaces function */
+  }
+}
+
+
+typedef struct BundleEntry {
+  const char *name;
+  size_t len;
+  int idx;  /* index of its chunk in the chunks table */
+} BundleEntry;
+
+
+static int cmpentries (const void *a, const void *b) {
+  const BundleEntry *e1 = (const BundleEntry *)a;
+  const BundleEntry *e2 = (const BundleEntry *)b;
+  int res = memcmp(e1->name, e2->name,
+                   (e1->len < e2->len) ? e1->len : e2->len);
+  return (res != 0) ? res : (e1->len > e2->len) - (e1->len < e2->len);
+}
+
+
+static void putbnum (char *p, size_t x) {
+  p[0] = (char)((x >> 24) & 0xFF);
+  p[1] = (char)((x >> 16) & 0xFF);
+  p[2] = (char)((x >> 8) & 0xFF);
+  p[3] = (char)(x & 0xFF);
+}
+
+
+/*
+** package.makebundle(filename, modules [, mode]): create bundle
+** 'filename' with the modules in table 'modules', which maps module
+** names to the files with their sources. The bundle is written under a
+** temporary name and then renamed, as other processes may have the old
+** one mapped in memory.
+*/
+static int ll_makebundle (lua_State *L) {
+  const char *fname = luaL_checkstring(L, 1);
+  const char *mode = luaL_optstring(L, 3, "b");
+  BundleEntry *es;
+  luaL_Buffer b;
+  size_t i, n = 0, total;
+  FILE *f;
+  const char *tname;
+  int ok;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 3);
+  lua_newtable(L);  /* chunks table, at index 4 */
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {  /* count modules and check their names */
+    if (lua_type(L, -2) != LUA_TSTRING || !lua_isstring(L, -1))
+      luaL_error(L, "module names and file names must be strings");
+    lua_pop(L, 1);
+    n++;
+  }
+  if (n > (MAXBUNDLE - BUNDLEHEADER) / BUNDLEENTRY)
+    luaL_error(L, "too many modules");
+  es = (BundleEntry *)lua_newuserdatauv(L, n * sizeof(BundleEntry), 0);
+  total = BUNDLEHEADER + n * BUNDLEENTRY;
+  i = 0;
+  lua_pushnil(L);
+  while (lua_next(L, 2)) {  /* compile modules */
+    if (i == n)
+      luaL_error(L, "table of modules changed while being traversed");
+    pushchunk(L, lua_tostring(L, -1), mode);
+    lua_rawseti(L, 4, (lua_Integer)i + 1);  /* chunks[i + 1] = chunk */
+    lua_pop(L, 1);  /* remove file name */
+    es[i].name = lua_tolstring(L, -1, &es[i].len);  /* kept by 'modules' */
+    es[i].idx = (int)i + 1;
+    i++;
+  }
+  qsort(es, n, sizeof(BundleEntry), cmpentries);
+  luaL_buffinit(L, &b);  /* to build the header, entries, and names */
+  luaL_addstring(&b, LUA_BUNDLESIG);
+  putbnum(luaL_prepbuffsize(&b, 4), n); luaL_addsize(&b, 4);
+  for (i = 0; i < n; i++) {  /* compute entries */
+    char *p = luaL_prepbuffsize(&b, BUNDLEENTRY);
+    size_t len;
+    lua_rawgeti(L, 4, es[i].idx);
+    len = luaL_len(L, -1);
+    lua_pop(L, 1);
+    putbnum(p, total);  /* names go after the entries */
+    putbnum(p + 4, es[i].len);
+    total += es[i].len;
+    putbnum(p + 12, len);  /* (chunk offset is computed later) */
+    luaL_addsize(&b, BUNDLEENTRY);
+  }
+  for (i = 0; i < n; i++)  /* add names */
+    luaL_addlstring(&b, es[i].name, es[i].len);
+  for (i = 0; i < n; i++) {  /* compute chunk offsets */
+    char *p = luaL_buffaddr(&b) + BUNDLEHEADER + i * BUNDLEENTRY;
+    total = (total + BUNDLEALIGN - 1) / BUNDLEALIGN * BUNDLEALIGN;
+    putbnum(p + 8, total);
+    total += getbnum(p + 12);
+    if (total > MAXBUNDLE)
+      luaL_error(L, "bundle too large");
+  }
+  luaL_pushresult(&b);
+  tname = luaL_pushtmpname(L, fname);
+  f = fopen(tname, "wb");
+  if (f == NULL)
+    return luaL_fileresult(L, 0, fname);
+  total = lua_rawlen(L, -2);
+  ok = (fwrite(lua_tostring(L, -2), 1, total, f) == total);
+  for (i = 0; ok && i < n; i++) {  /* write chunks */
+    static const char zeros[BUNDLEALIGN] = {0};
+    size_t len;
+    const char *s;
+    size_t pad = (BUNDLEALIGN - total % BUNDLEALIGN) % BUNDLEALIGN;
+    lua_rawgeti(L, 4, es[i].idx);
+    s = lua_tolstring(L, -1, &len);
+    ok = (fwrite(zeros, 1, pad, f) == pad && fwrite(s, 1, len, f) == len);
+    total += pad + len;
+    lua_pop(L, 1);
+  }
+  ok = luaL_replacefile(tname, fname, (fclose(f) == 0 && ok));
+  return luaL_fileresult(L, ok, fname);
+}
+
+/* }====================================================== */
+
+
 static void findloader (lua_State *L, const char *name) {
   int i;
   luaL_Buffer msg;  /* to build error message */
@@ -687,11 +1273,13 @@ static int ll_require (lua_State *L) {
 
 static const luaL_Reg pk_funcs[] = {
   {"loadlib", ll_loadlib},
+  {"makebundle", ll_makebundle},
   {"searchpath", ll_searchpath},
   /* placeholders */
   {"preload", NULL},
   {"cpath", NULL},
   {"path", NULL},
+  {"bundlepath", NULL},
   {"searchers", NULL},
   {"loaded", NULL},
   {NULL, NULL}
@@ -706,7 +1294,8 @@ static const luaL_Reg ll_funcs[] = {
 
 static void createsearcherstable (lua_State *L) {
   static const lua_CFunction searchers[] =
-    {searcher_preload, searcher_Lua, searcher_C, searcher_Croot, NULL};
+    {searcher_preload, searcher_bundle, searcher_Lua, searcher_C,
+     searcher_Croot, NULL};
   int i;
   /* create 'searchers' table */
   lua_createtable(L, sizeof(searchers)/sizeof(searchers[0]) - 1, 0);
@@ -733,13 +1322,30 @@ static void createclibstable (lua_State *L) {
 }
 
 
+/*
+** create table BUNDLES to keep track of open bundles, setting a
+** finalizer to unmap them when closing state.
+*/
+static void createbundlestable (lua_State *L) {
+  luaL_getsubtable(L, LUA_REGISTRYINDEX, BUNDLES);
+  lua_createtable(L, 0, 1);  /* create metatable for BUNDLES */
+  lua_pushcfunction(L, gcbundles);
+  lua_setfield(L, -2, "__gc");  /* set finalizer for BUNDLES table */
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);  /* pop BUNDLES table */
+}
+
+
 LUAMOD_API int luaopen_package (lua_State *L) {
   createclibstable(L);
+  createbundlestable(L);
   luaL_newlib(L, pk_funcs);  /* create 'package' table */
   createsearcherstable(L);
   /* set paths */
   setpath(L, "path", LUA_PATH_VAR, LUA_PATH_DEFAULT);
   setpath(L, "cpath", LUA_CPATH_VAR, LUA_CPATH_DEFAULT);
+  setpath(L, "bundlepath", LUA_BUNDLEPATH_VAR, LUA_BUNDLEPATH_DEFAULT);
+  setcache(L);
   /* store config information */
   lua_pushliteral(L, LUA_DIRSEP "\n" LUA_PATH_SEP "\n" LUA_PATH_MARK "\n"
                      LUA_EXEC_DIR "\n" LUA_IGMARK "\n");
@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <float.h>
 #include <locale.h>
 #include <math.h>
 #include <stdarg.h>
@@ -146,6 +147,161 @@ static int isneg (const char **s) {
 
 
 
+/*
+** {==================================================================
+** Extended floats
+** ===================================================================
+*/
+
+/*
+** When floats are IEEE doubles, the conversions between floats and
+** decimal numerals use "do-it-yourself" floats ('DiyFp'), with a
+** 64-bit significand, and a table of cached powers of ten.
+*/
+#if LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE && DBL_MANT_DIG == 53 && \
+    defined(LLONG_MAX)
+#define L_DIYFP
+#endif
+
+
+#if defined(L_DIYFP)	/* { */
+
+typedef unsigned long long l_uint64;
+
+/* a float 'f * 2^e' with a 64-bit significand */
+typedef struct DiyFp {
+  l_uint64 f;
+  int e;
+} DiyFp;
+
+
+/* powers of ten (10^k, from 10^-348 to 10^340 by steps of 8) */
+static const struct {
+  l_uint64 f;
+  short e;
+  short k;
+} cachedpowers[] = {
+  {0xfa8fd5a0081c0288ULL, -1220, -348},
+  {0xbaaee17fa23ebf76ULL, -1193, -340},
+  {0x8b16fb203055ac76ULL, -1166, -332},
+  {0xcf42894a5dce35eaULL, -1140, -324},
+  {0x9a6bb0aa55653b2dULL, -1113, -316},
+  {0xe61acf033d1a45dfULL, -1087, -308},
+  {0xab70fe17c79ac6caULL, -1060, -300},
+  {0xff77b1fcbebcdc4fULL, -1034, -292},
+  {0xbe5691ef416bd60cULL, -1007, -284},
+  {0x8dd01fad907ffc3cULL, -980, -276},
+  {0xd3515c2831559a83ULL, -954, -268},
+  {0x9d71ac8fada6c9b5ULL, -927, -260},
+  {0xea9c227723ee8bcbULL, -901, -252},
+  {0xaecc49914078536dULL, -874, -244},
+  {0x823c12795db6ce57ULL, -847, -236},
+  {0xc21094364dfb5637ULL, -821, -228},
+  {0x9096ea6f3848984fULL, -794, -220},
+  {0xd77485cb25823ac7ULL, -768, -212},
+  {0xa086cfcd97bf97f4ULL, -741, -204},
+  {0xef340a98172aace5ULL, -715, -196},
+  {0xb23867fb2a35b28eULL, -688, -188},
+  {0x84c8d4dfd2c63f3bULL, -661, -180},
+  {0xc5dd44271ad3cdbaULL, -635, -172},
+  {0x936b9fcebb25c996ULL, -608, -164},
+  {0xdbac6c247d62a584ULL, -582, -156},
+  {0xa3ab66580d5fdaf6ULL, -555, -148},
+  {0xf3e2f893dec3f126ULL, -529, -140},
+  {0xb5b5ada8aaff80b8ULL, -502, -132},
+  {0x87625f056c7c4a8bULL, -475, -124},
+  {0xc9bcff6034c13053ULL, -449, -116},
+  {0x964e858c91ba2655ULL, -422, -108},
+  {0xdff9772470297ebdULL, -396, -100},
+  {0xa6dfbd9fb8e5b88fULL, -369, -92},
+  {0xf8a95fcf88747d94ULL, -343, -84},
+  {0xb94470938fa89bcfULL, -316, -76},
+  {0x8a08f0f8bf0f156bULL, -289, -68},
+  {0xcdb02555653131b6ULL, -263, -60},
+  {0x993fe2c6d07b7facULL, -236, -52},
+  {0xe45c10c42a2b3b06ULL, -210, -44},
+  {0xaa242499697392d3ULL, -183, -36},
+  {0xfd87b5f28300ca0eULL, -157, -28},
+  {0xbce5086492111aebULL, -130, -20},
+  {0x8cbccc096f5088ccULL, -103, -12},
+  {0xd1b71758e219652cULL, -77, -4},
+  {0x9c40000000000000ULL, -50, 4},
+  {0xe8d4a51000000000ULL, -24, 12},
+  {0xad78ebc5ac620000ULL, 3, 20},
+  {0x813f3978f8940984ULL, 30, 28},
+  {0xc097ce7bc90715b3ULL, 56, 36},
+  {0x8f7e32ce7bea5c70ULL, 83, 44},
+  {0xd5d238a4abe98068ULL, 109, 52},
+  {0x9f4f2726179a2245ULL, 136, 60},
+  {0xed63a231d4c4fb27ULL, 162, 68},
+  {0xb0de65388cc8ada8ULL, 189, 76},
+  {0x83c7088e1aab65dbULL, 216, 84},
+  {0xc45d1df942711d9aULL, 242, 92},
+  {0x924d692ca61be758ULL, 269, 100},
+  {0xda01ee641a708deaULL, 295, 108},
+  {0xa26da3999aef774aULL, 322, 116},
+  {0xf209787bb47d6b85ULL, 348, 124},
+  {0xb454e4a179dd1877ULL, 375, 132},
+  {0x865b86925b9bc5c2ULL, 402, 140},
+  {0xc83553c5c8965d3dULL, 428, 148},
+  {0x952ab45cfa97a0b3ULL, 455, 156},
+  {0xde469fbd99a05fe3ULL, 481, 164},
+  {0xa59bc234db398c25ULL, 508, 172},
+  {0xf6c69a72a3989f5cULL, 534, 180},
+  {0xb7dcbf5354e9beceULL, 561, 188},
+  {0x88fcf317f22241e2ULL, 588, 196},
+  {0xcc20ce9bd35c78a5ULL, 614, 204},
+  {0x98165af37b2153dfULL, 641, 212},
+  {0xe2a0b5dc971f303aULL, 667, 220},
+  {0xa8d9d1535ce3b396ULL, 694, 228},
+  {0xfb9b7cd9a4a7443cULL, 720, 236},
+  {0xbb764c4ca7a44410ULL, 747, 244},
+  {0x8bab8eefb6409c1aULL, 774, 252},
+  {0xd01fef10a657842cULL, 800, 260},
+  {0x9b10a4e5e9913129ULL, 827, 268},
+  {0xe7109bfba19c0c9dULL, 853, 276},
+  {0xac2820d9623bf429ULL, 880, 284},
+  {0x80444b5e7aa7cf85ULL, 907, 292},
+  {0xbf21e44003acdd2dULL, 933, 300},
+  {0x8e679c2f5e44ff8fULL, 960, 308},
+  {0xd433179d9c8cb841ULL, 986, 316},
+  {0x9e19db92b4e31ba9ULL, 1013, 324},
+  {0xeb96bf6ebadf77d9ULL, 1039, 332},
+  {0xaf87023b9bf0ee6bULL, 1066, 340}
+};
+
+
+/*
+** Multiply two DiyFps, rounding the result to 64 bits
+*/
+static DiyFp diymul (DiyFp x, DiyFp y) {
+  const l_uint64 M32 = 0xFFFFFFFFu;
+  l_uint64 a = x.f >> 32, b = x.f & M32;
+  l_uint64 c = y.f >> 32, d = y.f & M32;
+  l_uint64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  l_uint64 tmp = (bd >> 32) + (ad & M32) + (bc & M32) + (1u << 31);
+  DiyFp r;
+  r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+
+static DiyFp diynormalize (DiyFp x) {
+  while (!(x.f & ((l_uint64)1 << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+
+
+#endif				/* } */
+
+/* }================================================================== */
+
+
 /*
 ** {==================================================================
 ** Lua's implementation for 'lua_strx2number'
@@ -305,10 +461,213 @@ static const char *l_str2int (const char *s, lua_Integer *result) {
 }
 
 
+/*
+** {==================================================================
+** Fast conversion of decimal numerals
+** ===================================================================
+*/
+
+#if defined(L_DIYFP)	/* { */
+
+/* maximum number of decimal digits kept in a 64-bit significand */
+#define MAXDIYDIG	19
+
+/*
+** Doubles are computed without extended precision? (Method 16, from
+** ISO/IEC TS 18661-3, extends only '_Float16' operations.)
+*/
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0 || FLT_EVAL_METHOD == 16)
+#define L_EXACTDBL
+#endif
+
+#if defined(L_EXACTDBL)
+/* powers of ten that are exact as doubles */
+static const double exactpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#endif
+
+/* powers 10^1 to 10^7 as (exact) normalized DiyFps */
+static const DiyFp adjustpow10[] = {
+  {0xa000000000000000ULL, -60}, {0xc800000000000000ULL, -57},
+  {0xfa00000000000000ULL, -54}, {0x9c40000000000000ULL, -50},
+  {0xc350000000000000ULL, -47}, {0xf424000000000000ULL, -44},
+  {0x9896800000000000ULL, -40}
+};
+
+
+/*
+** Compute the double nearest to 'm * 10^e', where 'm' has 'nd' digits;
+** 'inexact' means that 'm' was rounded from a longer numeral. Return 0
+** if the result is too close to a rounding boundary to be decided.
+** First, when 'm' and the power of ten are both exact doubles, the
+** result is a single correctly rounded floating-point operation (that
+** assumes no extended precision in intermediate results). Otherwise,
+** the product is computed with DiyFps, keeping track of its error
+** (in eighths of a unit in the last place); that gives the correct
+** rounding unless the half-way point is inside the error interval.
+** The result must be in the range of normal floats.
+** (This is the method used in David Gay's and Florian Loitsch's
+** conversion routines.)
+*/
+static int decimal2float (l_uint64 m, int nd, int e, int inexact,
+                          double *res) {
+  DiyFp x, c;
+  l_uint64 error, bits, halfway;
+  int olde, i;
+#if defined(L_EXACTDBL)
+  if (!inexact && m <= ((l_uint64)1 << 53)) {  /* exact significand? */
+    if (0 <= e && e <= 22) {
+      *res = cast_num(m) * exactpow10[e];
+      return 1;
+    }
+    else if (-22 <= e && e < 0) {
+      *res = cast_num(m) / exactpow10[-e];
+      return 1;
+    }
+    else if (nd <= 15 && 0 <= e && e - (15 - nd) <= 22) {
+      /* move some zeros to 'm' (keeping it exact) */
+      *res = (cast_num(m) * exactpow10[15 - nd]) * exactpow10[e - (15 - nd)];
+      return 1;
+    }
+  }
+#endif
+  error = inexact ? 4 : 0;  /* error of 'm' is at most 1/2 */
+  x.f = m; x.e = 0;
+  x = diynormalize(x);
+  error <<= -x.e;
+  i = (e + 348) / 8;  /* index of power 10^k, with k <= e < k + 8 */
+  if (cachedpowers[i].k != e) {  /* must adjust for the difference? */
+    int adj = e - cachedpowers[i].k;
+    x = diymul(x, adjustpow10[adj - 1]);
+    if (MAXDIYDIG - nd < adj)  /* product may not fit in 64 bits? */
+      error += 4;  /* it has been rounded */
+  }
+  c.f = cachedpowers[i].f; c.e = cachedpowers[i].e;
+  x = diymul(x, c);
+  /* errors of cached power (1/2), of rounding (1/2) and of the product
+     of the previous errors (less than 1/8) */
+  error += 4 + 4 + (error != 0);
+  olde = x.e;
+  x = diynormalize(x);
+  error <<= olde - x.e;
+  /* result is a normal float; round off the 11 extra bits of 'x' */
+  bits = (x.f & 0x7FF) * 8;
+  halfway = 0x400 * 8;
+  if (halfway - error < bits && bits < halfway + error)
+    return 0;  /* too close to the half-way point; cannot decide */
+  x.f >>= 11;
+  x.e += 11;
+  if (bits > halfway) {  /* round up? */
+    x.f++;
+    if (x.f == (l_uint64)1 << 53) {  /* carry to a new bit? */
+      x.f >>= 1;
+      x.e++;
+    }
+  }
+  /* build the double: significand without hidden bit plus exponent */
+  x.f = (x.f - ((l_uint64)1 << 52)) | ((l_uint64)(x.e + 1075) << 52);
+  memcpy(res, &x.f, sizeof(*res));
+  return 1;
+}
+
+
+/*
+** Convert a decimal numeral 's' to a number (an integer if it has no
+** dot nor exponent and it fits in an integer, a float otherwise) with
+** no help from 'strtod'. Return NULL if the numeral is not a valid
+** decimal numeral (maybe it is hexadecimal, or it uses a locale radix
+** mark) or if it is outside the range of normal floats or too hard to
+** round; the caller then uses the general conversions.
+*/
+static const char *l_str2dec (const char *s, TValue *o) {
+  l_uint64 m = 0;  /* first MAXDIYDIG significant digits */
+  int nd = 0;  /* number of digits in 'm' */
+  int e = 0;  /* decimal exponent */
+  int dropped = 0;  /* number of digits not kept in 'm' */
+  int inexact = 0;  /* true if some dropped digit is not zero */
+  int empty = 1;
+  int hasdot = 0;
+  int isint = 1;
+  int neg;
+  double r;
+  while (lisspace(cast_uchar(*s))) s++;  /* skip initial spaces */
+  neg = isneg(&s);
+  for (; ; s++) {
+    if (*s == '.') {
+      if (hasdot) break;  /* second dot? stop loop */
+      hasdot = 1;
+      isint = 0;
+    }
+    else if (lisdigit(cast_uchar(*s))) {
+      int d = *s - '0';
+      empty = 0;
+      if (nd < MAXDIYDIG) {
+        if (m != 0 || d != 0) {  /* not a leading zero? */
+          m = m * 10 + d;
+          nd++;
+        }
+        if (hasdot) e--;
+      }
+      else {  /* too many digits; round 'm' */
+        if (dropped++ == 0 && d >= 5)  /* first dropped digit rounds up? */
+          m++;
+        if (d != 0) inexact = 1;
+        if (!hasdot) e++;
+      }
+    }
+    else break;  /* neither a dot nor a digit */
+  }
+  if (empty)
+    return NULL;  /* no digits */
+  if (*s == 'e' || *s == 'E') {  /* exponent part? */
+    int exp1 = 0;
+    int neg1;
+    s++;  /* skip 'e' */
+    neg1 = isneg(&s);
+    if (!lisdigit(cast_uchar(*s)))
+      return NULL;  /* invalid; must have at least one digit */
+    for (; lisdigit(cast_uchar(*s)); s++) {
+      if (exp1 < 100000)  /* avoid overflows */
+        exp1 = exp1 * 10 + (*s - '0');
+    }
+    e += (neg1) ? -exp1 : exp1;
+    isint = 0;
+  }
+  while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
+  if (*s != '\0')
+    return NULL;  /* something wrong in the numeral */
+  if (isint && dropped == 0 &&
+      m <= l_castS2U(LUA_MAXINTEGER) + cast_uint(neg)) {  /* integer? */
+    setivalue(o, l_castU2S((neg) ? 0u - m : m));
+    return s;
+  }
+  else if (m == 0)
+    r = 0.0;
+  else if (e + nd <= -307 || e + nd > 308)
+    return NULL;  /* let 'strtod' handle subnormals and overflows */
+  else if (!decimal2float(m, nd, e, inexact, &r))
+    return NULL;  /* hard case; let 'strtod' handle it */
+  setfltvalue(o, cast_num((neg) ? -r : r));
+  return s;
+}
+
+#else				/* }{ */
+
+#define l_str2dec(s,o)	NULL
+
+#endif				/* } */
+
+/* }================================================================== */
+
+
 size_t luaO_str2num (const char *s, TValue *o) {
   lua_Integer i; lua_Number n;
   const char *e;
-  if ((e = l_str2int(s, &i)) != NULL) {  /* try as an integer */
+  if ((e = l_str2dec(s, o)) != NULL)  /* common decimal numeral? */
+    return (e - s) + 1;  /* 'o' already has the result */
+  else if ((e = l_str2int(s, &i)) != NULL) {  /* try as an integer */
     setivalue(o, i);
   }
   else if ((e = l_str2d(s, &n)) != NULL) {  /* else try as a float */
@@ -348,17 +707,424 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 */
 #define MAXNUMBER2STR	44
 
+#if MAXNUMBER2STR >= LUA_N2SBUFFSZ
+#error "LUA_N2SBUFFSZ is too small"
+#endif
+
+
+/*
+** {==================================================================
+** Conversion of numbers to strings
+** ===================================================================
+*/
+
+/* pairs of decimal digits, for fast conversion of integers */
+static const char digitpairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233"
+  "34353637383940414243444546474849505152535455565758596061626364656667"
+  "68697071727374757677787980818283848586878889909192939495969798990";
+
+
+/*
+** Convert integer 'i' to a decimal numeral in 'buff' (without the
+** final '\0'), two digits at a time. Return the numeral's length.
+*/
+static int int2str (char *buff, lua_Integer i) {
+  char temp[MAXNUMBER2STR];
+  char *p = temp + MAXNUMBER2STR;  /* digits are written backwards */
+  lua_Unsigned u = l_castS2U(i);
+  int len;
+  if (i < 0) u = 0u - u;  /* absolute value (works for MININTEGER too) */
+  while (u >= 100) {
+    int d = cast_int(u % 100) * 2;
+    u /= 100;
+    *--p = digitpairs[d + 1];
+    *--p = digitpairs[d];
+  }
+  if (u >= 10) {
+    int d = cast_int(u) * 2;
+    *--p = digitpairs[d + 1];
+    *--p = digitpairs[d];
+  }
+  else
+    *--p = cast_char('0' + cast_int(u));
+  if (i < 0)
+    *--p = '-';
+  len = cast_int(temp + MAXNUMBER2STR - p);
+  memcpy(buff, p, len * sizeof(char));
+  return len;
+}
+
+
+/*
+** When floats are IEEE doubles, Lua converts them with its own code
+** (an adaptation of Florian Loitsch's Grisu algorithms), which either
+** gives the correct digits or reports that it could not decide them;
+** only in those rare cases it resorts to 'snprintf'. Floats are written
+** with LUAI_NUMDIGITS significant digits (the same as LUA_NUMBER_FMT)
+** or, if LUAI_NUMSHORTEST is defined, with the shortest numeral that
+** reads back as the same float.
+*/
+#if (defined(LUAI_NUMDIGITS) || defined(LUAI_NUMSHORTEST)) && \
+    defined(L_DIYFP)	/* { */
+
+/* maximum number of significant digits needed by a double */
+#define MAXDBLDIG	17
+
+/*
+** Get a power of ten '10^k' (returning -k in '*mk') such that the
+** product of a normalized float with exponent 'e' by this power has
+** its binary exponent in the range [-60,-32].
+*/
+static DiyFp cachedpower (int e, int *mk) {
+  int minexp = -60 - (e + 64);
+  int k = cast_int(ceil((minexp + 63) * 0.30102999566398114));
+  int i = (348 + k - 1) / 8 + 1;
+  DiyFp c;
+  c.f = cachedpowers[i].f;
+  c.e = cachedpowers[i].e;
+  *mk = cachedpowers[i].k;
+  return c;
+}
+
+
+/*
+** Get the largest power of ten not larger than 'n', and its number of
+** digits.
+*/
+static l_uint32 biggestpow10 (l_uint32 n, int *ndigits) {
+  l_uint32 p = 1;
+  int d = 1;
+  if (n == 0) {  /* no integral digits */
+    *ndigits = 0;
+    return 1;
+  }
+  while (n / 10 >= p) {
+    p *= 10;
+    d++;
+  }
+  *ndigits = d;
+  return p;
+}
+
+
+/*
+** Round the 'n' digits in 'buff' ('rest' is what is left after them,
+** in units of 'ten_kappa', with error 'unit'). Return false if the
+** rounding direction cannot be decided.
+*/
+static int roundcounted (char *buff, int n, l_uint64 rest,
+                         l_uint64 ten_kappa, l_uint64 unit, int *kappa) {
+  if (unit >= ten_kappa || ten_kappa - unit <= unit)
+    return 0;
+  if ((ten_kappa - rest > rest) && (ten_kappa - 2 * rest >= 2 * unit))
+    return 1;  /* round down */
+  if ((rest > unit) && (ten_kappa - (rest - unit) <= (rest - unit))) {
+    int i;  /* round up */
+    buff[n - 1]++;
+    for (i = n - 1; i > 0 && buff[i] == '0' + 10; i--) {
+      buff[i] = '0';
+      buff[i - 1]++;
+    }
+    if (buff[0] == '0' + 10) {  /* carry out of the first digit? */
+      buff[0] = '1';
+      (*kappa)++;
+    }
+    return 1;
+  }
+  return 0;  /* cannot decide */
+}
+
+
+/*
+** Generate exactly 'ndig' correctly rounded digits of the scaled
+** float 'w' into 'buff'.
+*/
+static int digitscounted (DiyFp w, int ndig, char *buff, int *kappa) {
+  l_uint64 werror = 1;
+  l_uint64 one = (l_uint64)1 << -w.e;
+  l_uint32 integrals = cast(l_uint32, w.f >> -w.e);
+  l_uint64 fractionals = w.f & (one - 1);
+  int n = 0;
+  l_uint32 divisor = biggestpow10(integrals, kappa);
+  while (*kappa > 0) {
+    buff[n++] = cast_char('0' + integrals / divisor);
+    integrals %= divisor;
+    (*kappa)--;
+    if (--ndig == 0)
+      return roundcounted(buff, n, ((l_uint64)integrals << -w.e) + fractionals,
+                         (l_uint64)divisor << -w.e, werror, kappa);
+    divisor /= 10;
+  }
+  while (ndig > 0 && fractionals > werror) {
+    fractionals *= 10;
+    werror *= 10;
+    buff[n++] = cast_char('0' + cast_int(fractionals >> -w.e));
+    fractionals &= one - 1;
+    (*kappa)--;
+    ndig--;
+  }
+  if (ndig != 0) return 0;
+  return roundcounted(buff, n, fractionals, one, werror, kappa);
+}
+
+
+#if defined(LUAI_NUMSHORTEST)
+
+/*
+** Weed out digits that are not closest to 'w' in the shortest
+** representation; return false if the result cannot be proved
+** correct.
+*/
+static int roundweed (char *buff, int n, l_uint64 dist_high_w,
+                      l_uint64 unsafe, l_uint64 rest, l_uint64 ten_kappa,
+                      l_uint64 unit) {
+  l_uint64 small = dist_high_w - unit;
+  l_uint64 big = dist_high_w + unit;
+  while (rest < small && unsafe - rest >= ten_kappa &&
+         (rest + ten_kappa < small ||
+          small - rest >= rest + ten_kappa - small)) {
+    buff[n - 1]--;
+    rest += ten_kappa;
+  }
+  if (rest < big && unsafe - rest >= ten_kappa &&
+      (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+    return 0;
+  return (2 * unit <= rest) && (rest <= unsafe - 4 * unit);
+}
+
+
+/*
+** Generate the shortest digits that identify scaled float 'w', whose
+** neighbors' boundaries are 'low' and 'high'.
+*/
+static int digitsshortest (DiyFp low, DiyFp w, DiyFp high, char *buff,
+                           int *ndig, int *kappa) {
+  l_uint64 unit = 1;
+  l_uint64 toohigh = high.f + unit;
+  l_uint64 unsafe = toohigh - (low.f - unit);
+  l_uint64 one = (l_uint64)1 << -w.e;
+  l_uint32 integrals = cast(l_uint32, toohigh >> -w.e);
+  l_uint64 fractionals = toohigh & (one - 1);
+  l_uint32 divisor = biggestpow10(integrals, kappa);
+  int n = 0;
+  while (*kappa > 0) {
+    l_uint64 rest;
+    buff[n++] = cast_char('0' + integrals / divisor);
+    integrals %= divisor;
+    (*kappa)--;
+    rest = ((l_uint64)integrals << -w.e) + fractionals;
+    if (rest < unsafe) {
+      *ndig = n;
+      return roundweed(buff, n, toohigh - w.f, unsafe, rest,
+                       (l_uint64)divisor << -w.e, unit);
+    }
+    divisor /= 10;
+  }
+  for (;;) {
+    fractionals *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    buff[n++] = cast_char('0' + cast_int(fractionals >> -w.e));
+    fractionals &= one - 1;
+    (*kappa)--;
+    if (fractionals < unsafe) {
+      *ndig = n;
+      return roundweed(buff, n, (toohigh - w.f) * unit, unsafe,
+                       fractionals, one, unit);
+    }
+  }
+}
+
+#endif
+
+
+/*
+** Break positive float 'x' into its significand and exponent.
+*/
+static DiyFp float2diy (double x) {
+  l_uint64 bits;
+  DiyFp r;
+  int be;
+  memcpy(&bits, &x, sizeof(bits));
+  be = cast_int((bits >> 52) & 0x7FF);
+  r.f = bits & (((l_uint64)1 << 52) - 1);
+  if (be == 0)  /* subnormal? */
+    r.e = 1 - 1075;
+  else {
+    r.f += (l_uint64)1 << 52;  /* add hidden bit */
+    r.e = be - 1075;
+  }
+  return r;
+}
+
+
+/*
+** Compute the decimal digits of positive float 'x' into 'buff',
+** either 'ndig' of them or, if 'ndig' is zero, the shortest ones that
+** identify 'x'. Return the number of digits and set '*dexp' so that
+** 'x' is "buff * 10^dexp". Return 0 if the digits cannot be computed
+** by the fast method.
+*/
+static int float2digits (double x, int ndig, char *buff, int *dexp) {
+  DiyFp w = diynormalize(float2diy(x));
+  int mk, kappa;
+  DiyFp c = cachedpower(w.e, &mk);
+  DiyFp sw = diymul(w, c);
+#if defined(LUAI_NUMSHORTEST)
+  if (ndig == 0) {  /* shortest representation? */
+    DiyFp v = float2diy(x);
+    DiyFp high, low;
+    high.f = (v.f << 1) + 1; high.e = v.e - 1;
+    high = diynormalize(high);
+    if (v.f == ((l_uint64)1 << 52) && v.e != 1 - 1075) {  /* closer low? */
+      low.f = (v.f << 2) - 1; low.e = v.e - 2;
+    }
+    else {
+      low.f = (v.f << 1) - 1; low.e = v.e - 1;
+    }
+    low.f <<= low.e - high.e;
+    low.e = high.e;
+    if (!digitsshortest(diymul(low, c), sw, diymul(high, c), buff,
+                        &ndig, &kappa))
+      return 0;
+    *dexp = kappa - mk;
+    return ndig;
+  }
+#endif
+  if (!digitscounted(sw, ndig, buff, &kappa))
+    return 0;
+  *dexp = kappa - mk;
+  return ndig;
+}
+
+
+/*
+** Write float 'x' in format '%.<ndig-1>e' into 'temp' using 'snprintf'.
+*/
+static void float2exp (char *temp, double x, int ndig) {
+  char form[16];
+  l_sprintf(form, sizeof(form), "%%.%de", ndig - 1);
+  l_sprintf(temp, MAXDBLDIG + 20, form, x);
+}
+
+
+/*
+** Slow path: get the digits of positive float 'x' from 'snprintf'
+** (with 'ndig' significant digits).
+*/
+static int float2digitsC (double x, int ndig, char *buff, int *dexp) {
+  char temp[MAXDBLDIG + 20];
+  const char *p = temp;
+  int n = 0;
+  float2exp(temp, x, ndig);
+  for (; *p != 'e'; p++) {  /* collect digits (skipping the radix mark) */
+    if (lisdigit(cast_uchar(*p)))
+      buff[n++] = *p;
+  }
+  *dexp = atoi(p + 1) - (n - 1);
+  return n;
+}
+
+
+/*
+** Convert float 'x' to a numeral in 'buff', in the same format used
+** by '%g'. (With LUAI_NUMSHORTEST, uses the shortest digits and the
+** precision of MAXDBLDIG to choose between the fixed and exponential
+** notations.) Return the numeral's length.
+*/
+static int float2str (char *buff, lua_Number x) {
+  char digits[MAXDBLDIG + 1];
+  char *b = buff;
+  int n, dexp, e, prec;
+  if (x != x || x == HUGE_VAL || x == -HUGE_VAL)  /* inf or NaN? */
+    return lua_number2str(buff, MAXNUMBER2STR, x);
+  if (signbit(x)) {  /* negative (including -0.0)? */
+    *b++ = '-';
+    x = -x;
+  }
+  if (x == 0) {
+    *b++ = '0';
+    return cast_int(b - buff);
+  }
+#if defined(LUAI_NUMSHORTEST)
+  prec = MAXDBLDIG;
+  n = float2digits(x, 0, digits, &dexp);
+  if (n == 0) {  /* fast method failed? */
+    int p;
+    for (p = 1; p < MAXDBLDIG; p++) {  /* try increasing precisions */
+      char temp[MAXDBLDIG + 20];
+      float2exp(temp, x, p);
+      if (lua_str2number(temp, NULL) == x) break;
+    }
+    n = float2digitsC(x, p, digits, &dexp);
+  }
+#else
+  prec = LUAI_NUMDIGITS;
+  n = float2digits(x, prec, digits, &dexp);
+  if (n == 0)  /* fast method failed? */
+    n = float2digitsC(x, prec, digits, &dexp);
+#endif
+  e = dexp + n - 1;  /* exponent in scientific notation */
+  while (n > 1 && digits[n - 1] == '0') n--;  /* remove trailing zeros */
+  if (e < -4 || e >= prec) {  /* exponential notation? */
+    int ae = (e < 0) ? -e : e;
+    *b++ = digits[0];
+    if (n > 1) {
+      *b++ = lua_getlocaledecpoint();
+      memcpy(b, digits + 1, (n - 1) * sizeof(char));
+      b += n - 1;
+    }
+    *b++ = 'e';
+    *b++ = (e < 0) ? '-' : '+';
+    if (ae >= 100) {
+      *b++ = cast_char('0' + ae / 100);
+      ae %= 100;
+    }
+    *b++ = digitpairs[ae * 2];
+    *b++ = digitpairs[ae * 2 + 1];
+  }
+  else if (e >= 0) {  /* fixed notation with integral digits */
+    int i;
+    for (i = 0; i <= e; i++)
+      *b++ = (i < n) ? digits[i] : '0';
+    if (n > e + 1) {
+      *b++ = lua_getlocaledecpoint();
+      memcpy(b, digits + e + 1, (n - e - 1) * sizeof(char));
+      b += n - e - 1;
+    }
+  }
+  else {  /* fixed notation with only fractional digits */
+    *b++ = '0';
+    *b++ = lua_getlocaledecpoint();
+    for (e = -e - 1; e > 0; e--)
+      *b++ = '0';
+    memcpy(b, digits, n * sizeof(char));
+    b += n;
+  }
+  return cast_int(b - buff);
+}
+
+#else				/* }{ */
+
+#define float2str(b,x)	lua_number2str(b, MAXNUMBER2STR, x)
+
+#endif				/* } */
+
+/* }================================================================== */
+
 
 /*
 ** Convert a number object to a string, adding it to a buffer
 */
-static int tostringbuff (TValue *obj, char *buff) {
+int luaO_tostringbuff (const TValue *obj, char *buff) {
   int len;
   lua_assert(ttisnumber(obj));
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, MAXNUMBER2STR, ivalue(obj));
+    len = int2str(buff, ivalue(obj));
   else {
-    len = lua_number2str(buff, MAXNUMBER2STR, fltvalue(obj));
+    len = float2str(buff, fltvalue(obj));
+    buff[len] = '\0';
     if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
       buff[len++] = lua_getlocaledecpoint();
       buff[len++] = '0';  /* adds '.0' to result */
@@ -373,7 +1139,7 @@ static int tostringbuff (TValue *obj, char *buff) {
 */
 void luaO_tostring (lua_State *L, TValue *obj) {
   char buff[MAXNUMBER2STR];
-  int len = tostringbuff(obj, buff);
+  int len = luaO_tostringbuff(obj, buff);
   setsvalue(L, obj, luaS_newlstr(L, buff, len));
 }
 
@@ -458,7 +1224,7 @@ static void addstr2buff (BuffFS *buff, const char *str, size_t slen) {
 */
 static void addnum2buff (BuffFS *buff, TValue *num) {
   char *numbuff = getbuff(buff, MAXNUMBER2STR);
-  int len = tostringbuff(num, numbuff);  /* format number into 'numbuff' */
+  int len = luaO_tostringbuff(num, numbuff);  /* format number */
   addsize(buff, len);
 }
 
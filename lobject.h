@@ -522,6 +522,23 @@ typedef struct AbsLineInfo {
   int line;
 } AbsLineInfo;
 
+/*
+** A buffer given to 'lua_loadmapped' (e.g., a memory-mapped file),
+** shared by the prototypes whose code and line information point into
+** it and by the prototypes not loaded yet. It is released when the last
+** of these prototypes is freed.
+*/
+typedef struct Mapped {
+  const char *buff;
+  size_t size;
+  lua_Alloc release;  /* function to release 'buff' */
+  void *ud;  /* auxiliary data to 'release' */
+  l_mem nrefs;  /* number of prototypes using the buffer */
+  lu_byte lazy;  /* true if nested functions are loaded on demand */
+  lu_byte format;  /* format of the chunk (see 'LUAC_FORMAT') */
+} Mapped;
+
+
 /*
 ** Function Prototypes
 */
@@ -547,6 +564,8 @@ typedef struct Proto {
   AbsLineInfo *abslineinfo;  /* idem */
   LocVar *locvars;  /* information about local variables (debug information) */
   TString  *source;  /* used for debug information */
+  Mapped *mapped;  /* buffer holding 'code' and 'lineinfo' (or NULL) */
+  const char *lazy;  /* dump of a prototype not loaded yet (or NULL) */
   GCObject *gclist;
 } Proto;
 
@@ -777,6 +796,7 @@ LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, StkId res);
 LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC int luaO_tostringbuff (const TValue *obj, char *buff);
 LUAI_FUNC void luaO_tostring (lua_State *L, TValue *obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
@@ -50,6 +50,49 @@
 	(sizeof(size_t) < sizeof(int) ? MAX_SIZET : (size_t)(INT_MAX))
 
 
+/*
+** When the compiler offers SSE2 (or AVX2), some functions handle whole
+** blocks of bytes at a time (type 'l_vec'). Comparisons for order are
+** signed, so bytes above 0x7F never fall in ranges of ASCII characters.
+** Define LUA_NOVECTOR to use only the portable code.
+*/
+#if !defined(LUA_NOVECTOR) && defined(__GNUC__)
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+typedef __m256i l_vec;
+#define L_VECSIZE	32
+#define vecload(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define vecstore(p,v)	_mm256_storeu_si256((__m256i *)(p), v)
+#define vecsplat(c)	_mm256_set1_epi8(c)
+#define veceqmask(a,b)	((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a,b)))
+#define vechighmask(a)	((unsigned)_mm256_movemask_epi8(a))
+#define vecgt(a,b)	_mm256_cmpgt_epi8(a,b)
+#define vecand(a,b)	_mm256_and_si256(a,b)
+#define vecxor(a,b)	_mm256_xor_si256(a,b)
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+typedef __m128i l_vec;
+#define L_VECSIZE	16
+#define vecload(p)	_mm_loadu_si128((const __m128i *)(p))
+#define vecstore(p,v)	_mm_storeu_si128((__m128i *)(p), v)
+#define vecsplat(c)	_mm_set1_epi8(c)
+#define veceqmask(a,b)	((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a,b)))
+#define vechighmask(a)	((unsigned)_mm_movemask_epi8(a))
+#define vecgt(a,b)	_mm_cmpgt_epi8(a,b)
+#define vecand(a,b)	_mm_and_si128(a,b)
+#define vecxor(a,b)	_mm_xor_si128(a,b)
+
+#endif
+
+#endif
+
+
 
 
 static int str_len (lua_State *L) {
@@ -110,24 +153,104 @@ static int str_sub (lua_State *L) {
 
 
 static int str_reverse (lua_State *L) {
-  size_t l, i;
+  size_t l, i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i = 0; i < l; i++)
+#if !defined(LUA_NOVECTOR) && defined(__GNUC__)
+  for (; i + 8 <= l; i += 8) {  /* reverse 8 bytes at a time */
+    unsigned long long w;
+    memcpy(&w, s + l - i - 8, 8);
+    w = __builtin_bswap64(w);
+    memcpy(p + i, &w, 8);
+  }
+#endif
+  for (; i < l; i++)
     p[i] = s[l - i - 1];
   luaL_pushresultsize(&b, l);
   return 1;
 }
 
 
+#if defined(L_VECSIZE)
+
+/* minimum length of a string to change its case by blocks */
+#define MINVECCASE	(4 * L_VECSIZE)
+
+
+/*
+** Check whether 'f' changes the case of the 26 ASCII letters starting
+** at 'first' as in the C locale. (Other ASCII characters are assumed
+** to be unchanged.)
+*/
+static int asciicase (int (*f)(int), int first) {
+  int c;
+  for (c = first; c < first + 26; c++) {
+    if (f(c) != (c ^ 0x20) || f(c ^ 0x20) != (c ^ 0x20))
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+** Check whether 'f' does not change non-ASCII bytes (as in the C
+** locale or in UTF-8 locales).
+*/
+static int highfixed (int (*f)(int)) {
+  int c;
+  for (c = 0x80; c <= UCHAR_MAX; c++) {
+    if (f(c) != c)
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+** Change the case of 'l' bytes from 's' into 'p' a block at a time,
+** flipping bit 0x20 of the letters from 'first' to 'first' + 25.
+** Blocks with non-ASCII bytes use 'f', unless the locale does not
+** change those bytes. Return how many bytes were changed.
+*/
+static size_t veccase (char *p, const char *s, size_t l, int (*f)(int),
+                       int first) {
+  const l_vec below = vecsplat((char)(first - 1));
+  const l_vec above = vecsplat((char)(first + 26));
+  const l_vec bit = vecsplat(0x20);
+  int high = -1;  /* 'f' does not change non-ASCII bytes? (unknown yet) */
+  size_t i;
+  for (i = 0; i + L_VECSIZE <= l; i += L_VECSIZE) {
+    l_vec v = vecload(s + i);
+    if (vechighmask(v) != 0) {  /* some non-ASCII byte? */
+      if (high < 0) high = highfixed(f);  /* check it only once */
+      if (!high) {  /* use the locale for the whole block */
+        size_t j;
+        for (j = i; j < i + L_VECSIZE; j++)
+          p[j] = f(uchar(s[j]));
+        continue;
+      }
+    }
+    v = vecxor(v, vecand(vecand(vecgt(v, below), vecgt(above, v)), bit));
+    vecstore(p + i, v);
+  }
+  return i;
+}
+
+#endif
+
+
 static int str_lower (lua_State *L) {
   size_t l;
-  size_t i;
+  size_t i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
+#if defined(L_VECSIZE)
+  if (l >= MINVECCASE && asciicase(tolower, 'A'))
+    i = veccase(p, s, l, tolower, 'A');
+#endif
+  for (; i<l; i++)
     p[i] = tolower(uchar(s[i]));
   luaL_pushresultsize(&b, l);
   return 1;
@@ -136,11 +259,15 @@ static int str_lower (lua_State *L) {
 
 static int str_upper (lua_State *L) {
   size_t l;
-  size_t i;
+  size_t i = 0;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
   char *p = luaL_buffinitsize(L, &b, l);
-  for (i=0; i<l; i++)
+#if defined(L_VECSIZE)
+  if (l >= MINVECCASE && asciicase(toupper, 'a'))
+    i = veccase(p, s, l, toupper, 'a');
+#endif
+  for (; i<l; i++)
     p[i] = toupper(uchar(s[i]));
   luaL_pushresultsize(&b, l);
   return 1;
@@ -159,14 +286,17 @@ static int str_rep (lua_State *L) {
     size_t totallen = (size_t)n * l + (size_t)(n - 1) * lsep;
     luaL_Buffer b;
     char *p = luaL_buffinitsize(L, &b, totallen);
-    while (n-- > 1) {  /* first n-1 copies (followed by separator) */
-      memcpy(p, s, l * sizeof(char)); p += l;
-      if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
-        memcpy(p, sep, lsep * sizeof(char));
-        p += lsep;
-      }
+    size_t done = l;  /* number of bytes already in the result */
+    memcpy(p, s, l * sizeof(char));  /* first copy */
+    if (n > 1 && lsep > 0) {  /* empty 'memcpy' is not that cheap */
+      memcpy(p + l, sep, lsep * sizeof(char));  /* first separator */
+      done += lsep;
+    }
+    while (done < totallen) {  /* double what is done, up to the total */
+      size_t chunk = (done <= totallen - done) ? done : totallen - done;
+      memcpy(p + done, p, chunk * sizeof(char));
+      done += chunk;
     }
-    memcpy(p, s, l * sizeof(char));  /* last copy (not followed by separator) */
     luaL_pushresultsize(&b, totallen);
   }
   return 1;
@@ -353,10 +483,54 @@ static const luaL_Reg stringmetamethods[] = {
 #define CAP_POSITION	(-2)
 
 
+/*
+** Size of the cache of compiled patterns kept by each state, and
+** maximum length of a pattern that can be compiled.
+*/
+#if !defined(LUA_PATCACHESIZE)
+#define LUA_PATCACHESIZE	64
+#endif
+
+#define MAXCOMPPAT	UCHAR_MAX
+
+
+/* size of a bitmap for a set of characters */
+#define CLASSSIZE	((UCHAR_MAX + 1) / CHAR_BIT)
+
+
+/*
+** A compiled pattern keeps, for each single-character class in the
+** pattern (indexed by its position), where the class ends and the
+** set of characters it matches, so that the matcher does not need
+** to parse the class again at each use. (Sets are computed with the
+** locale in effect when the pattern is compiled; patterns with classes
+** that depend on the locale keep its name, and are compiled again when
+** it changes.)
+*/
+typedef struct PatItem {
+  unsigned char next;  /* offset from the class to its end */
+  unsigned char cls;  /* index of its character set */
+} PatItem;
+
+
+typedef struct CPattern {
+  size_t len;  /* length of the pattern */
+  const char *p;  /* copy of the pattern */
+  PatItem *item;  /* class items, indexed by position in pattern */
+  unsigned char *cls;  /* character sets ('CLASSSIZE' bytes each) */
+  const char *prefix;  /* literal text that starts any match */
+  size_t lprefix;  /* length of 'prefix' */
+  int first;  /* set for the first character of any match (or -1) */
+  const char *locale;  /* LC_CTYPE locale of its sets (or NULL if none) */
+} CPattern;
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end ('\0') of source string */
+  const char *p_init;  /* init of pattern */
   const char *p_end;  /* end ('\0') of pattern */
+  const CPattern *cp;  /* compiled pattern (or NULL) */
   lua_State *L;
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   unsigned char level;  /* total number of captures (finished or unfinished) */
@@ -397,19 +571,21 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/*
+** Find the end of the class starting at 'p'; return NULL if the
+** class is malformed.
+*/
+static const char *classlimit (const char *p, const char *p_end) {
   switch (*p++) {
     case L_ESC: {
-      if (p == ms->p_end)
-        luaL_error(ms->L, "malformed pattern (ends with '%%')");
-      return p+1;
+      return (p == p_end) ? NULL : p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a ']' */
-        if (p == ms->p_end)
-          luaL_error(ms->L, "malformed pattern (missing ']')");
-        if (*(p++) == L_ESC && p < ms->p_end)
+        if (p == p_end)
+          return NULL;
+        if (*(p++) == L_ESC && p < p_end)
           p++;  /* skip escapes (e.g. '%]') */
       } while (*p != ']');
       return p+1;
@@ -421,6 +597,22 @@ static const char *classend (MatchState *ms, const char *p) {
 }
 
 
+static const char *classend (MatchState *ms, const char *p) {
+  if (ms->cp != NULL)  /* compiled pattern? */
+    return p + ms->cp->item[p - ms->p_init].next;
+  else {
+    const char *ep = classlimit(p, ms->p_end);
+    if (ep == NULL) {
+      if (*p == L_ESC)
+        luaL_error(ms->L, "malformed pattern (ends with '%%')");
+      else
+        luaL_error(ms->L, "malformed pattern (missing ']')");
+    }
+    return ep;
+  }
+}
+
+
 static int match_class (int c, int cl) {
   int res;
   switch (tolower(cl)) {
@@ -464,19 +656,39 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
 }
 
 
+/*
+** Check whether character 'c' matches the class 'p' (ending at 'ep').
+*/
+static int classmatch (int c, const char *p, const char *ep) {
+  switch (*p) {
+    case '.': return 1;  /* matches any char */
+    case L_ESC: return match_class(c, uchar(*(p+1)));
+    case '[': return matchbracketclass(c, p, ep-1);
+    default:  return (uchar(*p) == c);
+  }
+}
+
+
+/* check whether 'c' is in character set 'set' */
+#define testset(set,c)	(((set)[(c) / CHAR_BIT] >> ((c) % CHAR_BIT)) & 1)
+
+
+static int inclass (MatchState *ms, int c, const char *p, const char *ep) {
+  if (ms->cp != NULL) {  /* compiled pattern? */
+    const CPattern *cp = ms->cp;
+    return testset(cp->cls + cp->item[p - ms->p_init].cls * CLASSSIZE, c);
+  }
+  else
+    return classmatch(c, p, ep);
+}
+
+
 static int singlematch (MatchState *ms, const char *s, const char *p,
                         const char *ep) {
   if (s >= ms->src_end)
     return 0;
-  else {
-    int c = uchar(*s);
-    switch (*p) {
-      case '.': return 1;  /* matches any char */
-      case L_ESC: return match_class(c, uchar(*(p+1)));
-      case '[': return matchbracketclass(c, p, ep-1);
-      default:  return (uchar(*p) == c);
-    }
-  }
+  else
+    return inclass(ms, uchar(*s), p, ep);
 }
 
 
@@ -603,8 +815,8 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
               luaL_error(ms->L, "missing '[' after '%%f' in pattern");
             ep = classend(ms, p);  /* points to what is next */
             previous = (s == ms->src_init) ? '\0' : *(s - 1);
-            if (!matchbracketclass(uchar(previous), p, ep - 1) &&
-               matchbracketclass(uchar(*s), p, ep - 1)) {
+            if (!inclass(ms, uchar(previous), p, ep) &&
+               inclass(ms, uchar(*s), p, ep)) {
               p = ep; goto init;  /* return match(ms, s, ep); */
             }
             s = NULL;  /* match failed */
@@ -667,8 +879,12 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
-static const char *lmemfind (const char *s1, size_t l1,
-                               const char *s2, size_t l2) {
+/*
+** Portable search: 'memchr' finds candidates for the first character
+** and the last character is checked before comparing the whole string.
+*/
+static const char *lscanfind (const char *s1, size_t l1,
+                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
   else {
@@ -677,7 +893,8 @@ static const char *lmemfind (const char *s1, size_t l1,
     l1 = l1-l2;  /* 's2' cannot be found after that */
     while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
       init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
+      if (init[l2 - 1] == s2[l2] &&  /* (when 'l2' is 0, both are '*s2') */
+          memcmp(init, s2+1, l2) == 0)
         return init-1;
       else {  /* correct 'l1' and 's1' to try again */
         l1 -= init-s1;
@@ -689,6 +906,45 @@ static const char *lmemfind (const char *s1, size_t l1,
 }
 
 
+#if defined(L_VECSIZE)
+
+/*
+** Block search: compare a whole block of candidate positions at a time,
+** checking both the first and the last character of the searched string
+** before calling 'memcmp'.
+*/
+static const char *lmemfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  if (l2 < 2 || l1 < l2 + L_VECSIZE)  /* too short for blocks? */
+    return lscanfind(s1, l1, s2, l2);
+  else {
+    const l_vec first = vecsplat(s2[0]);
+    const l_vec last = vecsplat(s2[l2 - 1]);
+    /* all blocks starting at or before 'lim' can be fully read */
+    const char *lim = s1 + (l1 - l2 - L_VECSIZE + 1);
+    const char *s = s1;
+    for (; s <= lim; s += L_VECSIZE) {
+      unsigned mask = veceqmask(vecload(s), first) &
+                      veceqmask(vecload(s + l2 - 1), last);
+      while (mask != 0) {  /* check each candidate in the block */
+        const char *c = s + __builtin_ctz(mask);
+        if (memcmp(c + 1, s2 + 1, l2 - 2) == 0)
+          return c;
+        mask &= mask - 1;  /* clear lowest bit */
+      }
+    }
+    /* search the final candidates (less than a block) */
+    return lscanfind(s, l1 - (s - s1), s2, l2);
+  }
+}
+
+#else
+
+#define lmemfind	lscanfind
+
+#endif
+
+
 /*
 ** get information about the i-th capture. If there are no captures
 ** and 'i==0', return information about the whole match, which
@@ -751,13 +1007,286 @@ static int nospecials (const char *p, size_t l) {
 }
 
 
-static void prepstate (MatchState *ms, lua_State *L,
-                       const char *s, size_t ls, const char *p, size_t lp) {
+/*
+** Add the set of characters matched by class 'p' (ending at 'ep'),
+** at position 'pos' of the pattern, to compiled pattern 'cp'. Equal
+** sets are shared. 'n' is the number of sets already in 'cp'; return
+** the new number. (When 'cp' is NULL, only count the class.)
+*/
+static int addclass (CPattern *cp, int n, size_t pos,
+                     const char *p, const char *ep) {
+  if (cp != NULL) {
+    unsigned char set[CLASSSIZE];
+    int c, i;
+    memset(set, 0, CLASSSIZE);
+    for (c = 0; c <= UCHAR_MAX; c++) {
+      if (classmatch(c, p, ep))
+        set[c / CHAR_BIT] |= (unsigned char)(1 << (c % CHAR_BIT));
+    }
+    for (i = 0; i < n; i++) {  /* look for an equal set */
+      if (memcmp(cp->cls + i * CLASSSIZE, set, CLASSSIZE) == 0)
+        break;
+    }
+    if (i == n)  /* new set? */
+      memcpy(cp->cls + n++ * CLASSSIZE, set, CLASSSIZE);
+    cp->item[pos].next = (unsigned char)(ep - p);
+    cp->item[pos].cls = (unsigned char)i;
+    return n;
+  }
+  else
+    return n + 1;
+}
+
+
+/*
+** Walk pattern 'p' visiting its items as 'match' does, and add each
+** single-character class to 'cp' (if not NULL). Return the number of
+** sets added, or -1 if the pattern is malformed; malformed patterns
+** are not compiled, so that 'match' raises the error only when (and
+** if) it reaches the bad item.
+*/
+static int walkpattern (const char *p, const char *p_end, CPattern *cp) {
+  const char *p_init = p;
+  int n = 0;
+  while (p < p_end) {
+    const char *ep;
+    switch (*p) {
+      case '(': {
+        p += (*(p + 1) == ')') ? 2 : 1;
+        continue;
+      }
+      case ')': {
+        p++;
+        continue;
+      }
+      case '$': {
+        if (p + 1 == p_end) {  /* anchor at the end? */
+          p++;
+          continue;
+        }
+        break;  /* else it is a single char */
+      }
+      case L_ESC: {
+        switch (*(p + 1)) {
+          case 'b': {
+            if (p + 2 >= p_end - 1)  /* missing arguments? */
+              return -1;
+            p += 4;
+            continue;
+          }
+          case 'f': {
+            p += 2;
+            if (*p != '[' || (ep = classlimit(p, p_end)) == NULL)
+              return -1;
+            n = addclass(cp, n, p - p_init, p, ep);
+            p = ep;
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {
+            p += 2;
+            continue;
+          }
+          default: break;  /* a single char class */
+        }
+        break;
+      }
+      default: break;
+    }
+    /* single char class plus optional suffix */
+    if ((ep = classlimit(p, p_end)) == NULL)
+      return -1;
+    n = addclass(cp, n, p - p_init, p, ep);
+    p = ep;
+    if (*p == '*' || *p == '+' || *p == '?' || *p == '-')
+      p++;  /* skip suffix */
+  }
+  return n;
+}
+
+
+/* check whether set 'set' has only one character; return it (or -1) */
+static int singlechar (const unsigned char *set) {
+  int c, res = -1;
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (testset(set, c)) {
+      if (res >= 0) return -1;  /* more than one */
+      res = c;
+    }
+  }
+  return res;
+}
+
+
+/*
+** Find what any match of compiled pattern 'cp' must start with: the
+** literal text formed by its initial single-character classes (put in
+** 'buff') or, failing that, the set of its first character. Only
+** classes that must match at least once count, and captures in
+** between are skipped, as they do not consume characters.
+*/
+static void findprefix (CPattern *cp, char *buff) {
+  const char *p = cp->p;
+  const char *p_end = p + cp->len;
+  size_t n = 0;
+  cp->first = -1;
+  while (p < p_end) {
+    if (*p == '(')
+      p += (*(p + 1) == ')') ? 2 : 1;
+    else if (*p == ')')
+      p++;
+    else {
+      const PatItem *it = &cp->item[p - cp->p];
+      const char *ep = p + it->next;
+      int c;
+      if (it->next == 0 || *ep == '*' || *ep == '?' || *ep == '-')
+        break;  /* not a class or it may match the empty string */
+      c = singlechar(cp->cls + it->cls * CLASSSIZE);
+      if (c < 0) {  /* not a literal? */
+        if (n == 0) cp->first = it->cls;
+        break;
+      }
+      buff[n++] = (char)c;
+      if (*ep == '+') break;  /* next literal may repeat this one */
+      p = ep;
+    }
+  }
+  cp->prefix = buff;
+  cp->lprefix = n;
+}
+
+
+/* name of the current LC_CTYPE locale */
+static const char *ctypelocale (void) {
+  const char *l = setlocale(LC_CTYPE, NULL);
+  return (l != NULL) ? l : "";
+}
+
+
+/*
+** Check whether pattern 'p' has classes that depend on the locale
+** (such as '%a'); items like '%%a' also count, which is harmless.
+*/
+static int localepattern (const char *p, size_t lp) {
+  size_t i;
+  for (i = 0; i + 1 < lp; i++) {
+    if (p[i] == L_ESC && p[i + 1] != '\0' &&
+        strchr("acdglpsuwxACDGLPSUWX", p[i + 1]) != NULL)
+      return 1;
+  }
+  return 0;
+}
+
+
+/* check whether the sets of compiled pattern 'cp' are still valid */
+static int currentpattern (const CPattern *cp) {
+  return (cp->locale == NULL || strcmp(cp->locale, ctypelocale()) == 0);
+}
+
+
+/*
+** Create a compiled pattern for 'p', push it on the stack and put
+** it in the cache at 'slot'. If the pattern cannot be compiled, push
+** nil and return NULL.
+*/
+static const CPattern *newpattern (lua_State *L, const char *p, size_t lp,
+                                   int slot) {
+  int n = walkpattern(p, p + lp, NULL);  /* count classes */
+  if (n < 0) {  /* malformed pattern? */
+    lua_pushnil(L);
+    return NULL;
+  }
+  else {
+    size_t isize = lp * sizeof(PatItem);
+    size_t csize = (size_t)n * CLASSSIZE;
+    const char *locale = localepattern(p, lp) ? ctypelocale() : NULL;
+    size_t llocale = (locale != NULL) ? strlen(locale) + 1 : 0;
+    CPattern *cp = (CPattern *)lua_newuserdatauv(L,
+                sizeof(CPattern) + isize + csize + 2 * lp + 1 + llocale, 0);
+    char *pcopy;
+    cp->item = (PatItem *)(cp + 1);
+    memset(cp->item, 0, isize);  /* positions without classes have no end */
+    cp->cls = (unsigned char *)cp->item + isize;
+    pcopy = (char *)cp->cls + csize;
+    memcpy(pcopy, p, lp * sizeof(char));
+    pcopy[lp] = '\0';
+    cp->p = pcopy;
+    cp->len = lp;
+    cp->locale = NULL;
+    if (locale != NULL)  /* keep a copy of the locale name */
+      cp->locale = (char *)memcpy(pcopy + 2 * lp + 1, locale, llocale);
+    walkpattern(p, p + lp, cp);
+    findprefix(cp, pcopy + lp + 1);
+    lua_pushvalue(L, -1);
+    lua_setiuservalue(L, lua_upvalueindex(1), slot);  /* cache it */
+    return cp;
+  }
+}
+
+
+/*
+** Get the compiled version of pattern 'p' from the cache (which is
+** the first upvalue of the calling function), compiling it if needed.
+** Push the compiled pattern (to keep it alive while in use) or nil,
+** when the pattern cannot be compiled; in that case, return NULL.
+*/
+static const CPattern *getpattern (lua_State *L, const char *p, size_t lp) {
+  if (lp > MAXCOMPPAT) {  /* pattern too long? */
+    lua_pushnil(L);
+    return NULL;
+  }
+  else {
+    unsigned int h = (unsigned int)lp;
+    const CPattern *cp;
+    size_t i;
+    int slot;
+    for (i = 0; i < lp; i++)
+      h ^= ((h<<5) + (h>>2) + uchar(p[i]));
+    slot = (int)(h % LUA_PATCACHESIZE) + 1;
+    lua_getiuservalue(L, lua_upvalueindex(1), slot);
+    cp = (const CPattern *)lua_touserdata(L, -1);
+    if (cp != NULL && cp->len == lp && memcmp(cp->p, p, lp) == 0 &&
+        currentpattern(cp))
+      return cp;  /* found it */
+    lua_pop(L, 1);  /* remove old entry */
+    return newpattern(L, p, lp, slot);
+  }
+}
+
+
+/*
+** Return the first position from 's' where a match of the pattern
+** may start, or NULL if there is none (only compiled patterns know
+** how to skip positions).
+*/
+static const char *nextstart (MatchState *ms, const char *s) {
+  const CPattern *cp = ms->cp;
+  if (cp == NULL)
+    return s;
+  else if (cp->lprefix > 0)  /* go to the next occurrence of the prefix */
+    return lmemfind(s, ms->src_end - s, cp->prefix, cp->lprefix);
+  else if (cp->first >= 0) {  /* go to a possible first character */
+    const unsigned char *set = cp->cls + cp->first * CLASSSIZE;
+    while (s < ms->src_end && !testset(set, uchar(*s)))
+      s++;
+    return (s < ms->src_end) ? s : NULL;
+  }
+  else
+    return s;
+}
+
+
+static void prepstate (MatchState *ms, lua_State *L, const char *s,
+                       size_t ls, const char *p, size_t lp,
+                       const CPattern *cp) {
   ms->L = L;
   ms->matchdepth = MAXCCALLS;
   ms->src_init = s;
   ms->src_end = s + ls;
+  ms->p_init = p;
   ms->p_end = p + lp;
+  ms->cp = cp;
 }
 
 
@@ -793,9 +1322,11 @@ static int str_find_aux (lua_State *L, int find) {
     if (anchor) {
       p++; lp--;  /* skip anchor character */
     }
-    prepstate(&ms, L, s, ls, p, lp);
+    prepstate(&ms, L, s, ls, p, lp, getpattern(L, p, lp));
     do {
       const char *res;
+      if (!anchor && (s1 = nextstart(&ms, s1)) == NULL)
+        break;  /* no more places where a match could start */
       reprepstate(&ms);
       if ((res=match(&ms, s1, p)) != NULL) {
         if (find) {
@@ -833,11 +1364,15 @@ typedef struct GMatchState {
 
 
 static int gmatch_aux (lua_State *L) {
-  GMatchState *gm = (GMatchState *)lua_touserdata(L, lua_upvalueindex(3));
+  GMatchState *gm = (GMatchState *)lua_touserdata(L, lua_upvalueindex(4));
   const char *src;
   gm->ms.L = L;
+  if (gm->ms.cp != NULL && !currentpattern(gm->ms.cp))
+    gm->ms.cp = NULL;  /* locale changed; match without compiled sets */
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if ((src = nextstart(&gm->ms, src)) == NULL)
+      break;  /* no more places where a match could start */
     reprepstate(&gm->ms);
     if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
@@ -853,14 +1388,16 @@ static int gmatch (lua_State *L) {
   const char *s = luaL_checklstring(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
   size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
+  const CPattern *cp;
   GMatchState *gm;
   lua_settop(L, 2);  /* keep strings on closure to avoid being collected */
+  cp = getpattern(L, p, lp);  /* also kept on closure */
   gm = (GMatchState *)lua_newuserdatauv(L, sizeof(GMatchState), 0);
   if (init > ls)  /* start after string's end? */
     init = ls + 1;  /* avoid overflows in 's + init' */
-  prepstate(&gm->ms, L, s, ls, p, lp);
+  prepstate(&gm->ms, L, s, ls, p, lp, cp);
   gm->src = s + init; gm->p = p; gm->lastmatch = NULL;
-  lua_pushcclosure(L, gmatch_aux, 3);
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -944,6 +1481,7 @@ static int str_gsub (lua_State *L) {
   int tr = lua_type(L, 3);  /* replacement type */
   lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);  /* max replacements */
   int anchor = (*p == '^');
+  int plain;  /* true iff pattern has no special characters */
   lua_Integer n = 0;  /* replacement count */
   int changed = 0;  /* change flag */
   MatchState ms;
@@ -951,13 +1489,21 @@ static int str_gsub (lua_State *L) {
   luaL_argexpected(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table");
-  luaL_buffinit(L, &b);
   if (anchor) {
     p++; lp--;  /* skip anchor character */
   }
-  prepstate(&ms, L, src, srcl, p, lp);
+  plain = (!anchor && lp > 0 && nospecials(p, lp));
+  prepstate(&ms, L, src, srcl, p, lp, plain ? NULL : getpattern(L, p, lp));
+  luaL_buffinit(L, &b);
   while (n < max_s) {
     const char *e;
+    if (!anchor) {  /* go straight to where the next match may start */
+      const char *s2 = (plain) ? lmemfind(src, ms.src_end - src, p, lp)
+                               : nextstart(&ms, src);
+      if (s2 == NULL) break;  /* no more matches */
+      luaL_addlstring(&b, src, s2 - src);  /* keep text before it */
+      src = s2;
+    }
     reprepstate(&ms);  /* (re)prepare state for new match */
     if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
       n++;
@@ -1098,24 +1644,64 @@ static int lua_number2strx (lua_State *L, char *buff, int sz,
 #define MAX_FORMAT	32
 
 
+/*
+** Size of the cache of compiled formats kept by each state. Its
+** entries follow the ones of the pattern cache.
+*/
+#if !defined(LUA_FMTCACHESIZE)
+#define LUA_FMTCACHESIZE	32
+#endif
+
+
+/*
+** A compiled format is a sequence of items, each one with a piece
+** of literal text followed by a conversion specification. Simple
+** specifications for integers and strings (with only a width and
+** the flags '-' and '0') are written directly; all others go through
+** 'addformat' with the specification kept in 'form'.
+*/
+typedef struct FmtItem {
+  size_t init;  /* start of the literal text (in the format) */
+  size_t len;  /* length of the literal text */
+  char conv;  /* conversion, or '\0' if item has only literal text */
+  char direct;  /* true if conversion can be written directly */
+  char left;  /* flag '-' */
+  char zero;  /* flag '0' */
+  int width;
+  char form[MAX_FORMAT];  /* the specification (as in 'scanformat') */
+} FmtItem;
+
+
+typedef struct CFormat {
+  const char *fmt;  /* format string (kept as the entry's user value) */
+  int nitems;
+  FmtItem *item;
+} CFormat;
+
+
 static void addquoted (luaL_Buffer *b, const char *s, size_t len) {
+  const char *e = s + len;
   luaL_addchar(b, '"');
-  while (len--) {
-    if (*s == '"' || *s == '\\' || *s == '\n') {
-      luaL_addchar(b, '\\');
-      luaL_addchar(b, *s);
-    }
-    else if (iscntrl(uchar(*s))) {
-      char buff[10];
-      if (!isdigit(uchar(*(s+1))))
-        l_sprintf(buff, sizeof(buff), "\\%d", (int)uchar(*s));
-      else
-        l_sprintf(buff, sizeof(buff), "\\%03d", (int)uchar(*s));
-      luaL_addstring(b, buff);
+  for (;;) {
+    const char *p = s;
+    while (p < e && *p != '"' && *p != '\\' && *p != '\n' &&
+                    !iscntrl(uchar(*p)))
+      p++;  /* skip characters that need no escapes */
+    luaL_addlstring(b, s, p - s);
+    if (p == e) break;
+    luaL_addchar(b, '\\');
+    if (*p == '"' || *p == '\\' || *p == '\n')
+      luaL_addchar(b, *p);
+    else {  /* control character; write its code in decimal */
+      int c = uchar(*p);
+      int full = (p + 1 < e && isdigit(uchar(*(p+1))));  /* need 3 digits? */
+      if (c >= 100 || full)
+        luaL_addchar(b, '0' + c / 100);
+      if (c >= 10 || full)
+        luaL_addchar(b, '0' + c / 10 % 10);
+      luaL_addchar(b, '0' + c % 10);
     }
-    else
-      luaL_addchar(b, *s);
-    s++;
+    s = p + 1;
   }
   luaL_addchar(b, '"');
 }
@@ -1166,10 +1752,11 @@ static void addliteral (lua_State *L, luaL_Buffer *b, int arg) {
         nb = quotefloat(L, buff, lua_tonumber(L, arg));
       else {  /* integers */
         lua_Integer n = lua_tointeger(L, arg);
-        const char *format = (n == LUA_MININTEGER)  /* corner case? */
-                           ? "0x%" LUA_INTEGER_FRMLEN "x"  /* use hex */
-                           : LUA_INTEGER_FMT;  /* else use default format */
-        nb = l_sprintf(buff, MAX_ITEM, format, (LUAI_UACINT)n);
+        if (n == LUA_MININTEGER)  /* corner case? */
+          nb = l_sprintf(buff, MAX_ITEM, "0x%" LUA_INTEGER_FRMLEN "x",
+                                         (LUAI_UACINT)n);  /* use hex */
+        else  /* else use default format */
+          nb = (int)lua_numbertostrbuff(L, arg, buff) - 1;  /* no '\0' */
       }
       luaL_addsize(b, nb);
       break;
@@ -1186,11 +1773,19 @@ static void addliteral (lua_State *L, luaL_Buffer *b, int arg) {
 }
 
 
-static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+/*
+** Read the specification that follows a '%' in 'strfrmt' into 'form'
+** (including the '%'). Return the address of its conversion, or NULL
+** if the specification is invalid, with an error message in '*msg'.
+*/
+static const char *readspec (const char *strfrmt, char *form,
+                             const char **msg) {
   const char *p = strfrmt;
   while (*p != '\0' && strchr(L_FMTFLAGS, *p) != NULL) p++;  /* skip flags */
-  if ((size_t)(p - strfrmt) >= sizeof(L_FMTFLAGS)/sizeof(char))
-    luaL_error(L, "invalid format (repeated flags)");
+  if ((size_t)(p - strfrmt) >= sizeof(L_FMTFLAGS)/sizeof(char)) {
+    *msg = "invalid format (repeated flags)";
+    return NULL;
+  }
   if (isdigit(uchar(*p))) p++;  /* skip width */
   if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   if (*p == '.') {
@@ -1198,8 +1793,10 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
     if (isdigit(uchar(*p))) p++;  /* skip precision */
     if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   }
-  if (isdigit(uchar(*p)))
-    luaL_error(L, "invalid format (width or precision too long)");
+  if (isdigit(uchar(*p))) {
+    *msg = "invalid format (width or precision too long)";
+    return NULL;
+  }
   *(form++) = '%';
   memcpy(form, strfrmt, ((p - strfrmt) + 1) * sizeof(char));
   form += (p - strfrmt) + 1;
@@ -1208,6 +1805,15 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
 }
 
 
+static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+  const char *msg;
+  const char *p = readspec(strfrmt, form, &msg);
+  if (p == NULL)
+    luaL_error(L, "%s", msg);
+  return p;
+}
+
+
 /*
 ** add length modifier into formats
 */
@@ -1221,93 +1827,319 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
+/*
+** Add to the buffer argument 'arg' formatted according to the
+** specification 'form'.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg, char *form) {
+  int maxitem = MAX_ITEM;
+  char *buff = luaL_prepbuffsize(b, maxitem);  /* to put formatted item */
+  int nb = 0;  /* number of bytes in added item */
+  switch (form[strlen(form) - 1]) {
+    case 'c': {
+      nb = l_sprintf(buff, maxitem, form, (int)luaL_checkinteger(L, arg));
+      break;
+    }
+    case 'd': case 'i': {
+      if (form[2] == '\0' && lua_isinteger(L, arg)) {  /* no modifiers? */
+        nb = (int)lua_numbertostrbuff(L, arg, buff) - 1;  /* no '\0' */
+        break;
+      }
+    }  /* FALLTHROUGH */
+    case 'o': case 'u': case 'x': case 'X': {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      addlenmod(form, LUA_INTEGER_FRMLEN);
+      nb = l_sprintf(buff, maxitem, form, (LUAI_UACINT)n);
+      break;
+    }
+    case 'a': case 'A':
+      addlenmod(form, LUA_NUMBER_FRMLEN);
+      nb = lua_number2strx(L, buff, maxitem, form,
+                              luaL_checknumber(L, arg));
+      break;
+    case 'f':
+      maxitem = MAX_ITEMF;  /* extra space for '%f' */
+      buff = luaL_prepbuffsize(b, maxitem);
+      /* FALLTHROUGH */
+    case 'e': case 'E': case 'g': case 'G': {
+      lua_Number n = luaL_checknumber(L, arg);
+      addlenmod(form, LUA_NUMBER_FRMLEN);
+      nb = l_sprintf(buff, maxitem, form, (LUAI_UACNUMBER)n);
+      break;
+    }
+    case 'p': {
+      const void *p = lua_topointer(L, arg);
+      if (p == NULL) {  /* avoid calling 'printf' with argument NULL */
+        p = "(null)";  /* result */
+        form[strlen(form) - 1] = 's';  /* format it as a string */
+      }
+      nb = l_sprintf(buff, maxitem, form, p);
+      break;
+    }
+    case 'q': {
+      if (form[2] != '\0')  /* modifiers? */
+        luaL_error(L, "specifier '%%q' cannot have modifiers");
+      addliteral(L, b, arg);
+      break;
+    }
+    case 's': {
+      size_t l;
+      const char *s;
+      if (form[2] == '\0' && lua_type(L, arg) == LUA_TNUMBER) {
+        if (!lua_getmetatable(L, arg)) {  /* no '__tostring'? */
+          nb = (int)lua_numbertostrbuff(L, arg, buff) - 1;  /* no '\0' */
+          break;
+        }
+        lua_pop(L, 1);  /* remove metatable */
+      }
+      s = luaL_tolstring(L, arg, &l);
+      if (form[2] == '\0')  /* no modifiers? */
+        luaL_addvalue(b);  /* keep entire string */
+      else {
+        luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
+        if (!strchr(form, '.') && l >= 100) {
+          /* no precision and string is too long to be formatted */
+          luaL_addvalue(b);  /* keep entire string */
+        }
+        else {  /* format the string into 'buff' */
+          nb = l_sprintf(buff, maxitem, form, s);
+          lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
+        }
+      }
+      break;
+    }
+    default: {  /* also treat cases 'pnLlh' */
+      luaL_error(L, "invalid conversion '%s' to 'format'", form);
+    }
+  }
+  lua_assert(nb < maxitem);
+  luaL_addsize(b, nb);
+}
+
+
+/*
+** Add 'n' copies of 'c' to the buffer.
+*/
+static void addpadding (luaL_Buffer *b, int c, size_t n) {
+  char *p = luaL_prepbuffsize(b, n);
+  memset(p, c, n);
+  luaL_addsize(b, n);
+}
+
+
+/*
+** Write argument 'arg' for a simple specification without 'snprintf'.
+** Return 0 if it cannot (e.g., the argument does not have the expected
+** type), so that the caller uses 'addformat'. '*plainstr' tells whether
+** strings have a '__tostring' metamethod (-1 if not checked yet).
+*/
+static int adddirect (lua_State *L, luaL_Buffer *b, int arg,
+                      const FmtItem *it, int *plainstr) {
+  char buff[LUA_N2SBUFFSZ];
+  const char *s;
+  size_t l;
+  switch (it->conv) {
+    case 'd': case 'i': {
+      if (!lua_isinteger(L, arg))
+        return 0;
+      s = buff;
+      l = lua_numbertostrbuff(L, arg, buff) - 1;  /* no '\0' */
+      break;
+    }
+    case 'x': case 'X': {
+      const char *digits = (it->conv == 'x') ? "0123456789abcdef"
+                                             : "0123456789ABCDEF";
+      lua_Unsigned u;
+      char *p = buff + sizeof(buff);
+      if (!lua_isinteger(L, arg))
+        return 0;
+      u = (lua_Unsigned)lua_tointeger(L, arg);
+      do {  /* write digits backwards */
+        *--p = digits[u & 0xF];
+        u >>= 4;
+      } while (u != 0);
+      s = p;
+      l = buff + sizeof(buff) - p;
+      break;
+    }
+    default: {  /* 's' */
+      if (lua_type(L, arg) != LUA_TSTRING)
+        return 0;
+      if (*plainstr < 0) {  /* not checked yet? */
+        *plainstr = (luaL_getmetafield(L, arg, "__tostring") == LUA_TNIL);
+        if (!*plainstr)
+          lua_pop(L, 1);  /* remove metamethod */
+      }
+      if (!*plainstr)
+        return 0;
+      s = lua_tolstring(L, arg, &l);
+      if ((it->width > 0 || it->left) && strlen(s) != l)
+        return 0;  /* let 'addformat' raise the error */
+      break;
+    }
+  }
+  if (l >= (size_t)it->width)  /* no padding? */
+    luaL_addlstring(b, s, l);
+  else if (it->left) {  /* pad on the right */
+    luaL_addlstring(b, s, l);
+    addpadding(b, ' ', it->width - l);
+  }
+  else if (it->zero) {  /* pad with zeros after the sign */
+    size_t sign = (*s == '-');
+    luaL_addlstring(b, s, sign);
+    addpadding(b, '0', it->width - l);
+    luaL_addlstring(b, s + sign, l - sign);
+  }
+  else {  /* pad on the left */
+    addpadding(b, ' ', it->width - l);
+    luaL_addlstring(b, s, l);
+  }
+  return 1;
+}
+
+
+/*
+** Fill the fields of item 'it' that describe its specification (in
+** 'form'), whose conversion is 'conv'. Return 0 if the specification
+** is not valid.
+*/
+static int compilespec (FmtItem *it, const char *form, int conv) {
+  const char *f = form + 1;  /* skip '%' */
+  if (conv == '\0' || strchr("cdiouxXaAfeEgGpqs", conv) == NULL)
+    return 0;  /* invalid conversion */
+  else if (conv == 'q' && form[2] != '\0')
+    return 0;  /* '%q' cannot have modifiers */
+  it->conv = (char)conv;
+  it->left = it->zero = 0;
+  it->width = 0;
+  for (; *f == '-' || *f == '0'; f++) {
+    if (*f == '-') it->left = 1;
+    else it->zero = 1;
+  }
+  it->direct = (strchr("dixXs", conv) != NULL && !(conv == 's' && it->zero));
+  if (*f != conv && !isdigit(uchar(*f)))  /* other flags? */
+    it->direct = 0;
+  for (; isdigit(uchar(*f)); f++)
+    it->width = it->width * 10 + (*f - '0');
+  if (*f == '.')  /* precision? */
+    it->direct = 0;
+  return 1;
+}
+
+
+/*
+** Create a compiled format for 'strfrmt', push it on the stack and
+** put it in the cache at 'slot'. If the format is invalid (and so
+** will raise an error), push nil and return NULL.
+*/
+static const CFormat *newformat (lua_State *L, const char *strfrmt,
+                                 size_t sfl, int slot) {
+  const char *strfrmt_end = strfrmt + sfl;
+  const char *p = strfrmt;
+  int n = 1;  /* one item for each '%' plus the final text */
+  CFormat *cf;
+  FmtItem *it;
+  while ((p = (const char *)memchr(p, L_ESC, strfrmt_end - p)) != NULL) {
+    n++;
+    p++;
+  }
+  cf = (CFormat *)lua_newuserdatauv(L, sizeof(CFormat) + n * sizeof(FmtItem),
+                                    1);
+  cf->item = it = (FmtItem *)(cf + 1);
+  it->init = 0;
+  p = strfrmt;
+  while ((p = (const char *)memchr(p, L_ESC, strfrmt_end - p)) != NULL) {
+    it->len = p - (strfrmt + it->init);
+    if (*(p + 1) == L_ESC) {  /* %%? */
+      it->len++;  /* text includes the first '%' */
+      it->conv = '\0';
+      p += 2;
+    }
+    else {
+      const char *msg;
+      const char *conv = readspec(p + 1, it->form, &msg);
+      if (conv == NULL || !compilespec(it, it->form, *conv)) {
+        lua_pop(L, 1);  /* remove incomplete compiled format */
+        lua_pushnil(L);
+        return NULL;
+      }
+      p = conv + 1;
+    }
+    it++;
+    it->init = p - strfrmt;
+  }
+  it->len = sfl - it->init;  /* final text */
+  it->conv = '\0';
+  cf->nitems = (int)(it - cf->item) + 1;
+  cf->fmt = strfrmt;
+  lua_pushvalue(L, 1);  /* format string */
+  lua_setiuservalue(L, -2, 1);  /* keep it alive with the entry */
+  lua_pushvalue(L, -1);
+  lua_setiuservalue(L, lua_upvalueindex(1), slot);  /* cache it */
+  return cf;
+}
+
+
+/*
+** Get the compiled version of format 'strfrmt' (the first argument
+** of the calling function) from the cache, compiling it if needed.
+** Entries are keyed by the address of the string, which they keep
+** alive. Push the compiled format or nil, when the format is invalid;
+** in that case, return NULL.
+*/
+static const CFormat *getformat (lua_State *L, const char *strfrmt,
+                                 size_t sfl) {
+  size_t h = (size_t)strfrmt;
+  int slot = (int)((h >> 3) % LUA_FMTCACHESIZE) + LUA_PATCACHESIZE + 1;
+  const CFormat *cf;
+  lua_getiuservalue(L, lua_upvalueindex(1), slot);
+  cf = (const CFormat *)lua_touserdata(L, -1);
+  if (cf != NULL && cf->fmt == strfrmt)
+    return cf;  /* found it */
+  lua_pop(L, 1);  /* remove old entry */
+  return newformat(L, strfrmt, sfl, slot);
+}
+
+
 static int str_format (lua_State *L) {
   int top = lua_gettop(L);
   int arg = 1;
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
+  const CFormat *cf = getformat(L, strfrmt, sfl);
   luaL_Buffer b;
   luaL_buffinit(L, &b);
-  while (strfrmt < strfrmt_end) {
-    if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
-    else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
-    else { /* format item */
-      char form[MAX_FORMAT];  /* to store the format ('%...') */
-      int maxitem = MAX_ITEM;
-      char *buff = luaL_prepbuffsize(&b, maxitem);  /* to put formatted item */
-      int nb = 0;  /* number of bytes in added item */
-      if (++arg > top)
-        return luaL_argerror(L, arg, "no value");
-      strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          nb = l_sprintf(buff, maxitem, form, (int)luaL_checkinteger(L, arg));
-          break;
-        }
-        case 'd': case 'i':
-        case 'o': case 'u': case 'x': case 'X': {
-          lua_Integer n = luaL_checkinteger(L, arg);
-          addlenmod(form, LUA_INTEGER_FRMLEN);
-          nb = l_sprintf(buff, maxitem, form, (LUAI_UACINT)n);
-          break;
-        }
-        case 'a': case 'A':
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = lua_number2strx(L, buff, maxitem, form,
-                                  luaL_checknumber(L, arg));
-          break;
-        case 'f':
-          maxitem = MAX_ITEMF;  /* extra space for '%f' */
-          buff = luaL_prepbuffsize(&b, maxitem);
-          /* FALLTHROUGH */
-        case 'e': case 'E': case 'g': case 'G': {
-          lua_Number n = luaL_checknumber(L, arg);
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = l_sprintf(buff, maxitem, form, (LUAI_UACNUMBER)n);
-          break;
-        }
-        case 'p': {
-          const void *p = lua_topointer(L, arg);
-          if (p == NULL) {  /* avoid calling 'printf' with argument NULL */
-            p = "(null)";  /* result */
-            form[strlen(form) - 1] = 's';  /* format it as a string */
-          }
-          nb = l_sprintf(buff, maxitem, form, p);
-          break;
-        }
-        case 'q': {
-          if (form[2] != '\0')  /* modifiers? */
-            return luaL_error(L, "specifier '%%q' cannot have modifiers");
-          addliteral(L, &b, arg);
-          break;
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_tolstring(L, arg, &l);
-          if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
-          else {
-            luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
-            if (!strchr(form, '.') && l >= 100) {
-              /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
-            }
-            else {  /* format the string into 'buff' */
-              nb = l_sprintf(buff, maxitem, form, s);
-              lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
-            }
-          }
-          break;
-        }
-        default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid conversion '%s' to 'format'", form);
+  if (cf != NULL) {  /* compiled format? */
+    int plainstr = -1;  /* strings have no '__tostring'? (unknown yet) */
+    int i;
+    for (i = 0; i < cf->nitems; i++) {
+      const FmtItem *it = &cf->item[i];
+      luaL_addlstring(&b, strfrmt + it->init, it->len);
+      if (it->conv != '\0') {
+        if (++arg > top)
+          return luaL_argerror(L, arg, "no value");
+        if (!it->direct || !adddirect(L, &b, arg, it, &plainstr)) {
+          char form[MAX_FORMAT];
+          strcpy(form, it->form);  /* 'addformat' may change it */
+          addformat(L, &b, arg, form);
         }
       }
-      lua_assert(nb < maxitem);
-      luaL_addsize(&b, nb);
+    }
+  }
+  else {  /* invalid format; go through it to raise the proper error */
+    while (strfrmt < strfrmt_end) {
+      if (*strfrmt != L_ESC)
+        luaL_addchar(&b, *strfrmt++);
+      else if (*++strfrmt == L_ESC)
+        luaL_addchar(&b, *strfrmt++);  /* %% */
+      else { /* format item */
+        char form[MAX_FORMAT];  /* to store the format ('%...') */
+        if (++arg > top)
+          return luaL_argerror(L, arg, "no value");
+        strfrmt = scanformat(L, strfrmt, form) + 1;
+        addformat(L, &b, arg, form);
+      }
     }
   }
   luaL_pushresult(&b);
@@ -1480,15 +2312,15 @@ static KOption getoption (Header *h, const char **fmt, int *size) {
 
 /*
 ** Read, classify, and fill other details about the next option.
-** 'psize' is filled with option's size, 'notoalign' with its
-** alignment requirements.
-** Local variable 'size' gets the size to be aligned. (Kpadal option
+** 'psize' is filled with option's size, 'palign' with its alignment
+** (1 when it needs no alignment).
+** Local variable 'align' gets the size to be aligned. (Kpadal option
 ** always gets its full alignment, other options are limited by
 ** the maximum alignment ('maxalign'). Kchar option needs no alignment
 ** despite its size.
 */
-static KOption getdetails (Header *h, size_t totalsize,
-                           const char **fmt, int *psize, int *ntoalign) {
+static KOption getalign (Header *h, const char **fmt, int *psize,
+                         int *palign) {
   KOption opt = getoption(h, fmt, psize);
   int align = *psize;  /* usually, alignment follows size */
   if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
@@ -1496,14 +2328,32 @@ static KOption getdetails (Header *h, size_t totalsize,
       luaL_argerror(h->L, 1, "invalid next option for option 'X'");
   }
   if (align <= 1 || opt == Kchar)  /* need no alignment? */
-    *ntoalign = 0;
+    align = 1;
   else {
     if (align > h->maxalign)  /* enforce maximum alignment */
       align = h->maxalign;
     if ((align & (align - 1)) != 0)  /* is 'align' not a power of 2? */
       luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
-    *ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
   }
+  *palign = align;
+  return opt;
+}
+
+
+/* number of bytes to align 'pos' to 'align' (a power of 2) */
+#define toalign(pos,align)  \
+	((align - (int)((pos) & (align - 1))) & (align - 1))
+
+
+/*
+** Read the next option, as 'getalign', filling 'ntoalign' with the
+** number of bytes needed to align it after 'totalsize' bytes.
+*/
+static KOption getdetails (Header *h, size_t totalsize,
+                           const char **fmt, int *psize, int *ntoalign) {
+  int align;
+  KOption opt = getalign(h, fmt, psize, &align);
+  *ntoalign = toalign(totalsize, align);
   return opt;
 }
 
@@ -1549,6 +2399,83 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 }
 
 
+/* true for options that take or give a value */
+#define hasvalue(opt)	((opt) < Kpadding)
+
+
+/*
+** Pack argument 'arg' according to option 'opt', with the given size
+** and endianness. Return the number of bytes added beyond 'size'
+** (for strings).
+*/
+static size_t packitem (lua_State *L, luaL_Buffer *b, KOption opt,
+                        int size, int islittle, int arg) {
+  switch (opt) {
+    case Kint: {  /* signed integers */
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (size < SZINT) {  /* need overflow check? */
+        lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+        luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
+      }
+      packint(b, (lua_Unsigned)n, islittle, size, (n < 0));
+      break;
+    }
+    case Kuint: {  /* unsigned integers */
+      lua_Integer n = luaL_checkinteger(L, arg);
+      if (size < SZINT)  /* need overflow check? */
+        luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
+                         arg, "unsigned overflow");
+      packint(b, (lua_Unsigned)n, islittle, size, 0);
+      break;
+    }
+    case Kfloat: {  /* floating-point options */
+      volatile Ftypes u;
+      char *buff = luaL_prepbuffsize(b, size);
+      lua_Number n = luaL_checknumber(L, arg);  /* get argument */
+      if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
+      else if (size == sizeof(u.d)) u.d = (double)n;
+      else u.n = n;
+      /* move 'u' to final result, correcting endianness if needed */
+      copywithendian(buff, u.buff, size, islittle);
+      luaL_addsize(b, size);
+      break;
+    }
+    case Kchar: {  /* fixed-size string */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, len <= (size_t)size, arg,
+                       "string longer than given size");
+      luaL_addlstring(b, s, len);  /* add string */
+      while (len++ < (size_t)size)  /* pad extra space */
+        luaL_addchar(b, LUAL_PACKPADBYTE);
+      break;
+    }
+    case Kstring: {  /* strings with length count */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, size >= (int)sizeof(size_t) ||
+                       len < ((size_t)1 << (size * NB)),
+                       arg, "string length does not fit in given size");
+      packint(b, (lua_Unsigned)len, islittle, size, 0);  /* pack length */
+      luaL_addlstring(b, s, len);
+      return len;
+    }
+    case Kzstr: {  /* zero-terminated string */
+      size_t len;
+      const char *s = luaL_checklstring(L, arg, &len);
+      luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
+      luaL_addlstring(b, s, len);
+      luaL_addchar(b, '\0');  /* add zero at the end */
+      return len + 1;
+    }
+    case Kpadding: luaL_addchar(b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
+    case Kpaddalign: case Knop:
+      break;
+  }
+  return 0;
+}
+
+
 static int str_pack (lua_State *L) {
   luaL_Buffer b;
   Header h;
@@ -1564,72 +2491,8 @@ static int str_pack (lua_State *L) {
     totalsize += ntoalign + size;
     while (ntoalign-- > 0)
      luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
-    arg++;
-    switch (opt) {
-      case Kint: {  /* signed integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT) {  /* need overflow check? */
-          lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-        }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
-        break;
-      }
-      case Kuint: {  /* unsigned integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT)  /* need overflow check? */
-          luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-                           arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
-        break;
-      }
-      case Kfloat: {  /* floating-point options */
-        volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
-        lua_Number n = luaL_checknumber(L, arg);  /* get argument */
-        if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
-        else if (size == sizeof(u.d)) u.d = (double)n;
-        else u.n = n;
-        /* move 'u' to final result, correcting endianness if needed */
-        copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-      case Kchar: {  /* fixed-size string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, len <= (size_t)size, arg,
-                         "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
-        while (len++ < (size_t)size)  /* pad extra space */
-          luaL_addchar(&b, LUAL_PACKPADBYTE);
-        break;
-      }
-      case Kstring: {  /* strings with length count */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, size >= (int)sizeof(size_t) ||
-                         len < ((size_t)1 << (size * NB)),
-                         arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
-        totalsize += len;
-        break;
-      }
-      case Kzstr: {  /* zero-terminated string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
-        totalsize += len + 1;
-        break;
-      }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
-      case Kpaddalign: case Knop:
-        arg--;  /* undo increment */
-        break;
-    }
+    if (hasvalue(opt)) arg++;
+    totalsize += packitem(L, &b, opt, size, h.islittle, arg);
   }
   luaL_pushresult(&b);
   return 1;
@@ -1690,6 +2553,58 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
+/*
+** Unpack an item of option 'opt', with the given size and endianness,
+** from position 'pos' of 'data' (argument 'arg', with length 'ld'),
+** which has at least 'size' bytes. Push its value, if it has one,
+** and return the position after the item.
+*/
+static size_t unpackitem (lua_State *L, KOption opt, int size, int islittle,
+                          const char *data, size_t ld, size_t pos, int arg) {
+  switch (opt) {
+    case Kint:
+    case Kuint: {
+      lua_Integer res = unpackint(L, data + pos, islittle, size,
+                                     (opt == Kint));
+      lua_pushinteger(L, res);
+      break;
+    }
+    case Kfloat: {
+      volatile Ftypes u;
+      lua_Number num;
+      copywithendian(u.buff, data + pos, size, islittle);
+      if (size == sizeof(u.f)) num = (lua_Number)u.f;
+      else if (size == sizeof(u.d)) num = (lua_Number)u.d;
+      else num = u.n;
+      lua_pushnumber(L, num);
+      break;
+    }
+    case Kchar: {
+      lua_pushlstring(L, data + pos, size);
+      break;
+    }
+    case Kstring: {
+      size_t len = (size_t)unpackint(L, data + pos, islittle, size, 0);
+      luaL_argcheck(L, len <= ld - pos - size, arg, "data string too short");
+      lua_pushlstring(L, data + pos + size, len);
+      pos += len;  /* skip string */
+      break;
+    }
+    case Kzstr: {
+      size_t len = (int)strlen(data + pos);
+      luaL_argcheck(L, pos + len < ld, arg,
+                       "unfinished string for format 'z'");
+      lua_pushlstring(L, data + pos, len);
+      pos += len + 1;  /* skip string plus final '\0' */
+      break;
+    }
+    case Kpaddalign: case Kpadding: case Knop:
+      break;
+  }
+  return pos + size;
+}
+
+
 static int str_unpack (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);
@@ -1707,54 +2622,165 @@ static int str_unpack (lua_State *L) {
     pos += ntoalign;  /* skip alignment */
     /* stack space for item + next position */
     luaL_checkstack(L, 2, "too many results");
-    n++;
-    switch (opt) {
-      case Kint:
-      case Kuint: {
-        lua_Integer res = unpackint(L, data + pos, h.islittle, size,
-                                       (opt == Kint));
-        lua_pushinteger(L, res);
-        break;
-      }
-      case Kfloat: {
-        volatile Ftypes u;
-        lua_Number num;
-        copywithendian(u.buff, data + pos, size, h.islittle);
-        if (size == sizeof(u.f)) num = (lua_Number)u.f;
-        else if (size == sizeof(u.d)) num = (lua_Number)u.d;
-        else num = u.n;
-        lua_pushnumber(L, num);
-        break;
-      }
-      case Kchar: {
-        lua_pushlstring(L, data + pos, size);
-        break;
-      }
-      case Kstring: {
-        size_t len = (size_t)unpackint(L, data + pos, h.islittle, size, 0);
-        luaL_argcheck(L, len <= ld - pos - size, 2, "data string too short");
-        lua_pushlstring(L, data + pos + size, len);
-        pos += len;  /* skip string */
-        break;
-      }
-      case Kzstr: {
-        size_t len = (int)strlen(data + pos);
-        luaL_argcheck(L, pos + len < ld, 2,
-                         "unfinished string for format 'z'");
-        lua_pushlstring(L, data + pos, len);
-        pos += len + 1;  /* skip string plus final '\0' */
-        break;
-      }
-      case Kpaddalign: case Kpadding: case Knop:
-        n--;  /* undo increment */
-        break;
-    }
-    pos += size;
+    if (hasvalue(opt)) n++;
+    pos = unpackitem(L, opt, size, h.islittle, data, ld, pos, 2);
   }
   lua_pushinteger(L, pos + 1);  /* next position */
   return n + 1;
 }
 
+
+/*
+** Precompiled layouts: 'string.packer' and 'string.unpacker' parse
+** a format once, into a list of items, and return a function that
+** packs or unpacks with that layout.
+*/
+
+typedef struct PackItem {
+  KOption opt;
+  int size;
+  int align;  /* alignment (a power of 2) */
+  int islittle;
+} PackItem;
+
+
+typedef struct Layout {
+  int nitems;
+  int nvalues;  /* number of items with values */
+  size_t minsize;  /* minimum number of bytes read by a record */
+  PackItem *item;
+} Layout;
+
+
+/*
+** Parse format 'fmt' and push the resulting layout.
+*/
+static const Layout *newlayout (lua_State *L, const char *fmt) {
+  Header h;
+  size_t lf = strlen(fmt);
+  Layout *lo = (Layout *)lua_newuserdatauv(L,
+                                  sizeof(Layout) + lf * sizeof(PackItem), 0);
+  lo->item = (PackItem *)(lo + 1);
+  lo->nitems = lo->nvalues = 0;
+  lo->minsize = 0;
+  initheader(L, &h);
+  while (*fmt != '\0') {
+    PackItem *it = &lo->item[lo->nitems];
+    it->opt = getalign(&h, &fmt, &it->size, &it->align);
+    it->islittle = h.islittle;
+    if (it->opt != Knop) {  /* item is not only configuration? */
+      lo->nitems++;
+      if (hasvalue(it->opt)) lo->nvalues++;
+      lo->minsize += it->size + (it->opt == Kzstr);  /* (plus its '\0') */
+    }
+  }
+  return lo;
+}
+
+
+static int packer_aux (lua_State *L) {
+  const Layout *lo = (const Layout *)lua_touserdata(L, lua_upvalueindex(1));
+  luaL_Buffer b;
+  size_t totalsize = 0;
+  int arg = 0;  /* current argument to pack */
+  int i;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  for (i = 0; i < lo->nitems; i++) {
+    const PackItem *it = &lo->item[i];
+    int ntoalign = toalign(totalsize, it->align);
+    totalsize += ntoalign + it->size;
+    while (ntoalign-- > 0)
+     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+    if (hasvalue(it->opt)) arg++;
+    totalsize += packitem(L, &b, it->opt, it->size, it->islittle, arg);
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+static int str_packer (lua_State *L) {
+  newlayout(L, luaL_checkstring(L, 1));
+  lua_pushcclosure(L, packer_aux, 1);
+  return 1;
+}
+
+
+/*
+** Unpack one record with layout 'lo' from position 'pos' of 'data'
+** (argument 1). Push its values and return the position after it.
+*/
+static size_t unpackrecord (lua_State *L, const Layout *lo,
+                            const char *data, size_t ld, size_t pos) {
+  int i;
+  for (i = 0; i < lo->nitems; i++) {
+    const PackItem *it = &lo->item[i];
+    int ntoalign = toalign(pos, it->align);
+    luaL_argcheck(L, (size_t)ntoalign + it->size <= ld - pos, 1,
+                    "data string too short");
+    pos += ntoalign;  /* skip alignment */
+    pos = unpackitem(L, it->opt, it->size, it->islittle, data, ld, pos, 1);
+  }
+  return pos;
+}
+
+
+/*
+** unpacker(s [, pos]) -> values of the record at 'pos' + next position;
+** unpacker(s, pos, n [, t]) -> table with the values of 'n' records
+** (in sequence, from t[1]) + next position
+*/
+static int unpacker_aux (lua_State *L) {
+  const Layout *lo = (const Layout *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t ld;
+  const char *data = luaL_checklstring(L, 1, &ld);
+  size_t pos = posrelatI(luaL_optinteger(L, 2, 1), ld) - 1;
+  luaL_argcheck(L, pos <= ld, 2, "initial position out of string");
+  if (lua_isnoneornil(L, 3)) {  /* a single record? */
+    luaL_checkstack(L, lo->nvalues + 1, "too many results");
+    pos = unpackrecord(L, lo, data, ld, pos);
+    lua_pushinteger(L, pos + 1);  /* next position */
+    return lo->nvalues + 1;
+  }
+  else {  /* 'n' records into a table */
+    lua_Integer n = luaL_checkinteger(L, 3);
+    lua_Integer k = 0;  /* number of values in the table */
+    luaL_argcheck(L, n >= 0, 3, "negative number of records");
+    if (n > 0) {  /* records must fit in the data */
+      luaL_argcheck(L, lo->minsize > 0, 3, "records with no size");
+      luaL_argcheck(L, (lua_Unsigned)n <= (ld - pos) / lo->minsize, 1,
+                       "data string too short");
+    }
+    if (lua_isnoneornil(L, 4)) {
+      luaL_argcheck(L, n <= INT_MAX / (lo->nvalues + 1), 3,
+                       "too many records");
+      lua_createtable(L, (int)n * lo->nvalues, 0);
+    }
+    else {
+      luaL_checktype(L, 4, LUA_TTABLE);
+      lua_settop(L, 4);
+    }
+    luaL_checkstack(L, lo->nvalues, "too many results");
+    while (n-- > 0) {
+      int i;
+      pos = unpackrecord(L, lo, data, ld, pos);
+      for (i = lo->nvalues; i > 0; i--)  /* move values to the table */
+        lua_rawseti(L, -1 - i, k + i);
+      k += lo->nvalues;
+    }
+    lua_pushinteger(L, pos + 1);  /* next position */
+    return 2;
+  }
+}
+
+
+static int str_unpacker (lua_State *L) {
+  newlayout(L, luaL_checkstring(L, 1));
+  lua_pushcclosure(L, unpacker_aux, 1);
+  return 1;
+}
+
 /* }====================================================== */
 
 
@@ -1776,6 +2802,8 @@ static const luaL_Reg strlib[] = {
   {"pack", str_pack},
   {"packsize", str_packsize},
   {"unpack", str_unpack},
+  {"packer", str_packer},
+  {"unpacker", str_unpacker},
   {NULL, NULL}
 };
 
@@ -1798,7 +2826,11 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
-  luaL_newlib(L, strlib);
+  luaL_checkversion(L);
+  luaL_newlibtable(L, strlib);
+  /* cache for compiled patterns and formats, shared by all functions */
+  lua_newuserdatauv(L, 0, LUA_PATCACHESIZE + LUA_FMTCACHESIZE);
+  luaL_setfuncs(L, strlib, 1);
   createmetatable(L);
   return 1;
 }
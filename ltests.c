@@ -1182,6 +1182,11 @@ static int loadlib (lua_State *L) {
   return 0;
 }
 
+static int openlazylibs (lua_State *L) {
+  luaL_openlazylibs(getstate(L));
+  return 0;
+}
+
 static int closestate (lua_State *L) {
   lua_State *L1 = getstate(L);
   lua_close(L1);
@@ -1213,6 +1218,96 @@ static int doremote (lua_State *L) {
 }
 
 
+static int imagewriter (lua_State *L, const void *b, size_t size,
+                        void *ud) {
+  UNUSED(L);
+  luaL_addlstring((luaL_Buffer *)ud, (const char *)b, size);
+  return 0;
+}
+
+
+static int dosaveimage (lua_State *L1) {
+  luaL_saveimage(L1, imagewriter, lua_touserdata(L1, 1));
+  return 0;
+}
+
+
+static int dorestoreimage (lua_State *L1) {
+  size_t size;
+  const char *image = lua_tolstring(L1, 1, &size);
+  luaL_restoreimage(L1, image, size);
+  return 0;
+}
+
+
+/*
+** Save an image of state 'L1' as a string; errors in 'L1' return
+** nil plus the message.
+*/
+static int saveimage (lua_State *L) {
+  lua_State *L1 = getstate(L);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  lua_pushcfunction(L1, dosaveimage);
+  lua_pushlightuserdata(L1, &b);
+  if (lua_pcall(L1, 1, 0, 0) != LUA_OK) {
+    lua_pushnil(L);
+    lua_pushstring(L, lua_tostring(L1, -1));
+    lua_pop(L1, 1);
+    return 2;
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+static int restoreimage (lua_State *L) {
+  lua_State *L1 = getstate(L);
+  size_t size;
+  const char *image = luaL_checklstring(L, 2, &size);
+  lua_pushcfunction(L1, dorestoreimage);
+  lua_pushlstring(L1, image, size);
+  if (lua_pcall(L1, 1, 0, 0) != LUA_OK) {
+    lua_pushnil(L);
+    lua_pushstring(L, lua_tostring(L1, -1));
+    lua_pop(L1, 1);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+
+/*
+** T.compilefiles(sources, outputs [, strip [, nthreads]]): returns the
+** status of 'luaL_compilefiles' plus its error messages, if any
+*/
+static int compilefiles (lua_State *L) {
+  int n = (int)luaL_len(L, 1);
+  int strip = lua_toboolean(L, 3);
+  int nthreads = (int)luaL_optinteger(L, 4, 0);
+  const char **src = (const char **)lua_newuserdatauv(L,
+                                         2 * n * sizeof(char *), 0);
+  int i, status;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  for (i = 0; i < n; i++) {  /* strings are kept alive by the tables */
+    luaL_argcheck(L, lua_geti(L, 1, i + 1) == LUA_TSTRING, 1,
+                     "string expected");
+    src[i] = lua_tostring(L, -1);
+    luaL_argcheck(L, lua_geti(L, 2, i + 1) == LUA_TSTRING, 2,
+                     "string expected");
+    src[n + i] = lua_tostring(L, -1);
+    lua_pop(L, 2);
+  }
+  status = luaL_compilefiles(L, n, src, src + n, strip, nthreads);
+  lua_pushinteger(L, status);
+  if (status == LUA_OK)
+    return 1;
+  lua_insert(L, -2);  /* put status before message */
+  return 2;
+}
+
+
 static int log2_aux (lua_State *L) {
   unsigned int x = (unsigned int)luaL_checkinteger(L, 1);
   lua_pushinteger(L, luaO_ceillog2(x));
@@ -1423,6 +1518,9 @@ static int runC (lua_State *L, lua_State *L1, const char *pc) {
       int sz = getnum;
       lua_pushboolean(L1, lua_checkstack(L1, sz));
     }
+    else if EQ("codeid") {
+      lua_pushlightuserdata(L1, lua_codeid(L1, getindex));
+    }
     else if EQ("compare") {
       const char *opt = getstring;  /* EQ, LT, or LE */
       int op = (opt[0] == 'E') ? LUA_OPEQ
@@ -1888,6 +1986,7 @@ static int coresume (lua_State *L) {
 static const struct luaL_Reg tests_funcs[] = {
   {"checkmemory", lua_checkmemory},
   {"closestate", closestate},
+  {"compilefiles", compilefiles},
   {"d2s", d2s},
   {"doonnewstack", doonnewstack},
   {"doremote", doremote},
@@ -1905,6 +2004,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"listabslineinfo", listabslineinfo},
   {"listlocals", listlocals},
   {"loadlib", loadlib},
+  {"openlazylibs", openlazylibs},
   {"checkpanic", checkpanic},
   {"newstate", newstate},
   {"newuserdata", newuserdata},
@@ -1913,8 +2013,10 @@ static const struct luaL_Reg tests_funcs[] = {
   {"querystr", string_query},
   {"querytab", table_query},
   {"ref", tref},
+  {"restoreimage", restoreimage},
   {"resume", coresume},
   {"s2d", s2d},
+  {"saveimage", saveimage},
   {"sethook", sethook},
   {"stacklevel", stacklevel},
   {"testC", testC},
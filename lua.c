@@ -62,16 +62,24 @@ static void laction (int i) {
 
 static void print_usage (const char *badoption) {
   lua_writestringerror("%s: ", progname);
-  if (badoption[1] == 'e' || badoption[1] == 'l')
+  if (badoption[1] == 'b' || badoption[1] == 'e' || badoption[1] == 'l')
     lua_writestringerror("'%s' needs argument\n", badoption);
+  else if (badoption[1] == 's')
+    lua_writestringerror("'%s' needs '-b' or '-c'\n", badoption);
+  else if (badoption[1] == 't')
+    lua_writestringerror("'%s' needs '-b'\n", badoption);
   else
     lua_writestringerror("unrecognized option '%s'\n", badoption);
   lua_writestringerror(
   "usage: %s [options] [script [args]]\n"
   "Available options are:\n"
+  "  -b file  write bundle 'file' with the modules given as arguments\n"
+  "  -c       compile the files given as arguments\n"
   "  -e stat  execute string 'stat'\n"
   "  -i       enter interactive mode after executing 'script'\n"
   "  -l name  require library 'name' into global 'name'\n"
+  "  -s       strip debug information from files in '-b' or '-c'\n"
+  "  -t       write sources instead of binary chunks in '-b'\n"
   "  -v       show version information\n"
   "  -E       ignore environment variables\n"
   "  -W       turn warnings on\n"
@@ -237,6 +245,10 @@ static int handle_script (lua_State *L, char **argv) {
 #define has_v		4	/* -v */
 #define has_e		8	/* -e */
 #define has_E		16	/* -E */
+#define has_b		32	/* -b */
+#define has_c		64	/* -c */
+#define has_s		128	/* -s */
+#define has_t		256	/* -t */
 
 
 /*
@@ -269,6 +281,12 @@ static int collectargs (char **argv, int *first) {
         if (argv[i][2] != '\0')  /* extra characters? */
           return has_error;  /* invalid option */
         break;
+      case 'c':  case 's':  case 't':
+        if (argv[i][2] != '\0')  /* extra characters? */
+          return has_error;  /* invalid option */
+        args |= (argv[i][1] == 'c') ? has_c
+              : (argv[i][1] == 's') ? has_s : has_t;
+        break;
       case 'i':
         args |= has_i;  /* (-i implies -v) *//* FALLTHROUGH */
       case 'v':
@@ -278,7 +296,9 @@ static int collectargs (char **argv, int *first) {
         break;
       case 'e':
         args |= has_e;  /* FALLTHROUGH */
-      case 'l':  /* both options need an argument */
+      case 'l':  case 'b':  /* these options need an argument */
+        if (argv[i][1] == 'b')
+          args |= has_b;
         if (argv[i][2] == '\0') {  /* no concatenated argument? */
           i++;  /* try next 'argv' */
           if (argv[i] == NULL || argv[i][0] == '-')
@@ -294,6 +314,29 @@ static int collectargs (char **argv, int *first) {
 }
 
 
+/*
+** Checks that the options collected in 'args' that modify other options
+** ('-s', which modifies '-b' or '-c', and '-t', which modifies '-b')
+** come with them. Otherwise, sets 'first' to the lone option and
+** returns an error.
+*/
+static int checkdeps (char **argv, int args, int *first) {
+  const char *lone;
+  int i;
+  if (args == has_error)
+    return args;
+  else if ((args & has_s) && !(args & (has_b | has_c)))
+    lone = "-s";
+  else if ((args & has_t) && !(args & has_b))
+    lone = "-t";
+  else
+    return args;
+  for (i = 1; strcmp(argv[i], lone) != 0; i++) ;  /* find it */
+  *first = i;
+  return has_error;
+}
+
+
 /*
 ** Processes options 'e' and 'l', which involve running Lua code, and
 ** 'W', which also affects the state.
@@ -319,12 +362,98 @@ static int runargs (lua_State *L, char **argv, int n) {
       case 'W':
         lua_warning(L, "@on", 0);  /* warnings on */
         break;
+      case 'b':
+        if (argv[i][2] == '\0') i++;  /* skip argument */
+        break;
     }
   }
   return 1;
 }
 
 
+/*
+** Handles option 'b': writes to the bundle named in its (last)
+** occurrence in 'argv' the modules in 'argv + script', each one given
+** as 'modname=filename' or as a module name to be searched in
+** 'package.path'. 'mode' is the mode for 'package.makebundle'.
+*/
+static int dobundle (lua_State *L, char **argv, int script,
+                     const char *mode) {
+  const char *bname = NULL;
+  int status;
+  int i;
+  for (i = 1; i < script; i++) {  /* find bundle name */
+    if (argv[i][0] == '-' && argv[i][1] == 'b')
+      bname = (argv[i][2] != '\0') ? argv[i] + 2 : argv[++i];
+  }
+  lua_assert(bname != NULL);
+  if (lua_getglobal(L, "package") != LUA_TTABLE)
+    luaL_error(L, "'package' is not a table");
+  lua_getfield(L, -1, "makebundle");
+  lua_pushstring(L, bname);
+  lua_newtable(L);  /* table of modules */
+  for (argv += script; *argv != NULL; argv++) {
+    const char *eq = strchr(*argv, '=');
+    if (eq != NULL) {  /* 'modname=filename'? */
+      lua_pushlstring(L, *argv, eq - *argv);
+      lua_pushstring(L, eq + 1);
+    }
+    else {  /* search module */
+      lua_pushstring(L, *argv);
+      lua_getfield(L, -5, "searchpath");
+      lua_pushvalue(L, -2);
+      lua_getfield(L, -7, "path");
+      lua_call(L, 2, 2);  /* call 'package.searchpath(modname, path)' */
+      if (lua_isnil(L, -2))
+        luaL_error(L, "module '%s' not found:\n\t%s", *argv,
+                      lua_tostring(L, -1));
+      lua_pop(L, 1);  /* remove extra result */
+    }
+    lua_settable(L, -3);  /* modules[modname] = filename */
+  }
+  lua_pushstring(L, mode);
+  status = docall(L, 3, 2);  /* call 'package.makebundle' */
+  if (status == LUA_OK && !lua_toboolean(L, -2))  /* failed? */
+    status = LUA_ERRRUN;  /* error message is on the top */
+  return report(L, status);
+}
+
+
+/*
+** Handles option 'c': compiles in parallel the files in 'argv + script',
+** each one given as 'output=source' or as a source whose output has
+** the same name with extension ".luac" (replacing ".lua", if present).
+*/
+static int docompile (lua_State *L, char **argv, int script, int strip) {
+  const char **src;
+  const char **dst;
+  int n, i;
+  for (n = 0; argv[script + n] != NULL; n++) ;  /* count files */
+  src = (const char **)lua_newuserdatauv(L, 2 * n * sizeof(char *), 0);
+  dst = src + n;
+  lua_createtable(L, n, 0);  /* keeps the output names */
+  for (i = 0; i < n; i++) {
+    const char *arg = argv[script + i];
+    const char *eq = strchr(arg, '=');
+    size_t l = strlen(arg);
+    if (eq != NULL) {  /* 'output=source'? */
+      lua_pushlstring(L, arg, eq - arg);
+      src[i] = eq + 1;
+    }
+    else {
+      if (l >= 4 && strcmp(arg + l - 4, ".lua") == 0)
+        lua_pushfstring(L, "%sc", arg);
+      else
+        lua_pushfstring(L, "%s.luac", arg);
+      src[i] = arg;
+    }
+    dst[i] = lua_tostring(L, -1);
+    lua_rawseti(L, -2, i + 1);
+  }
+  return report(L, luaL_compilefiles(L, n, src, dst, strip, 0));
+}
+
+
 static int handle_luainit (lua_State *L) {
   const char *name = "=" LUA_INITVARVERSION;
   const char *init = getenv(name + 1);
@@ -577,7 +706,7 @@ static int pmain (lua_State *L) {
   int argc = (int)lua_tointeger(L, 1);
   char **argv = (char **)lua_touserdata(L, 2);
   int script;
-  int args = collectargs(argv, &script);
+  int args = checkdeps(argv, collectargs(argv, &script), &script);
   luaL_checkversion(L);  /* check that interpreter has correct version */
   if (argv[0] && argv[0][0]) progname = argv[0];
   if (args == has_error) {  /* bad arg? */
@@ -599,12 +728,22 @@ static int pmain (lua_State *L) {
   }
   if (!runargs(L, argv, script))  /* execute arguments -e and -l */
     return 0;  /* something failed */
-  if (script < argc &&  /* execute main script (if there is one) */
+  if (args & has_b) {  /* option '-b'? */
+    const char *mode = (args & has_t) ? "t" : (args & has_s) ? "s" : "b";
+    if (dobundle(L, argv, script, mode) != LUA_OK)  /* write bundle */
+      return 0;
+  }
+  else if (args & has_c) {  /* option '-c'? */
+    if (docompile(L, argv, script, args & has_s) != LUA_OK)
+      return 0;
+  }
+  else if (script < argc &&  /* execute main script (if there is one) */
       handle_script(L, argv + script) != LUA_OK)
     return 0;
   if (args & has_i)  /* -i option? */
     doREPL(L);  /* do read-eval-print loop */
-  else if (script == argc && !(args & (has_e | has_v))) {  /* no arguments? */
+  else if (script == argc &&  /* no arguments? */
+           !(args & (has_e | has_v | has_b | has_c))) {
     if (lua_stdin_is_tty()) {  /* running in interactive mode? */
       print_version();
       doREPL(L);  /* do read-eval-print loop */
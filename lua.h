@@ -288,6 +288,9 @@ LUA_API int   (lua_pcallk) (lua_State *L, int nargs, int nresults, int errfunc,
 
 LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                           const char *chunkname, const char *mode);
+LUA_API int   (lua_loadmapped) (lua_State *L, const char *buff, size_t sz,
+                                lua_Alloc release, void *ud,
+                                const char *chunkname, const char *mode);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data, int strip);
 
@@ -344,6 +347,11 @@ LUA_API void  (lua_len)    (lua_State *L, int idx);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 
+/* minimum size for the buffer used by 'lua_numbertostrbuff' */
+#define LUA_N2SBUFFSZ	64
+
+LUA_API unsigned (lua_numbertostrbuff) (lua_State *L, int idx, char *buff);
+
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
 
@@ -459,6 +467,9 @@ LUA_API void *(lua_upvalueid) (lua_State *L, int fidx, int n);
 LUA_API void  (lua_upvaluejoin) (lua_State *L, int fidx1, int n1,
                                                int fidx2, int n2);
 
+LUA_API void *(lua_codeid) (lua_State *L, int fidx);
+LUA_API void  (lua_clonefunction) (lua_State *L, int fidx);
+
 LUA_API void (lua_sethook) (lua_State *L, lua_Hook func, int mask, int count);
 LUA_API lua_Hook (lua_gethook) (lua_State *L);
 LUA_API int (lua_gethookmask) (lua_State *L);
@@ -403,6 +403,12 @@
 @@ LUA_NUMBER_FRMLEN is the length modifier for writing floats.
 @@ LUA_NUMBER_FMT is the format for writing floats.
 @@ lua_number2str converts a float to a string.
+@@ LUAI_NUMDIGITS is the number of significant digits written by
+** LUA_NUMBER_FMT, when that format is "%.<n>g"; if defined, Lua
+** writes floats with its own (faster) code instead of 'lua_number2str'.
+@@ LUAI_NUMSHORTEST makes Lua write each float with the shortest
+** numeral that reads back as the same value, instead of using a
+** fixed number of digits. (Both work only when floats are doubles.)
 @@ l_mathop allows the addition of an 'l' or 'f' to all math operations.
 @@ l_floor takes the floor of a float.
 @@ lua_str2number converts a decimal numeral to a number.
@@ -474,6 +480,7 @@
 
 #define LUA_NUMBER_FRMLEN	""
 #define LUA_NUMBER_FMT		"%.14g"
+#define LUAI_NUMDIGITS		14
 
 #define l_mathop(op)		op
 
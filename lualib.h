@@ -44,10 +44,16 @@ LUAMOD_API int (luaopen_debug) (lua_State *L);
 #define LUA_LOADLIBNAME	"package"
 LUAMOD_API int (luaopen_package) (lua_State *L);
 
+#define LUA_AIOLIBNAME	"aio"
+LUAMOD_API int (luaopen_aio) (lua_State *L);
 
-/* open all previous libraries */
+
+/* open all previous libraries (preloading 'aio') */
 LUALIB_API void (luaL_openlibs) (lua_State *L);
 
+/* open base and package, and the other libraries when first used */
+LUALIB_API void (luaL_openlazylibs) (lua_State *L);
+
 
 
 #if !defined(lua_assert)
@@ -21,6 +21,7 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lstring.h"
+#include "ltable.h"
 #include "lundump.h"
 #include "lzio.h"
 
@@ -34,6 +35,10 @@ typedef struct {
   lua_State *L;
   ZIO *Z;
   const char *name;
+  Mapped *map;  /* buffer being loaded in place (or NULL) */
+  Mapped *hmap;  /* its copy shared by the prototypes (or NULL) */
+  Table *strings;  /* strings of the chunk (or NULL, in old formats) */
+  int format;  /* format of the chunk */
 } LoadState;
 
 
@@ -66,13 +71,13 @@ static lu_byte loadByte (LoadState *S) {
 }
 
 
-static size_t loadUnsigned (LoadState *S, size_t limit) {
-  size_t x = 0;
+static lua_Unsigned loadUnsigned (LoadState *S, lua_Unsigned limit) {
+  lua_Unsigned x = 0;
   int b;
   limit >>= 7;
   do {
     b = loadByte(S);
-    if (x >= limit)
+    if (x > limit)
       error(S, "integer overflow");
     x = (x << 7) | (b & 0x7f);
   } while ((b & 0x80) == 0);
@@ -81,7 +86,7 @@ static size_t loadUnsigned (LoadState *S, size_t limit) {
 
 
 static size_t loadSize (LoadState *S) {
-  return loadUnsigned(S, ~(size_t)0);
+  return cast_sizet(loadUnsigned(S, ~(size_t)0));
 }
 
 
@@ -105,9 +110,24 @@ static lua_Integer loadInteger (LoadState *S) {
 
 
 /*
-** Load a nullable string into prototype 'p'.
+** Load an integer constant, which format 2 encodes as a varint of its
+** "zigzag" encoding (see 'dumpIntConstant').
 */
-static TString *loadStringN (LoadState *S, Proto *p) {
+static lua_Integer loadIntConstant (LoadState *S) {
+  if (S->format < 2)
+    return loadInteger(S);
+  else {
+    lua_Unsigned x = loadUnsigned(S, ~(lua_Unsigned)0);
+    return l_castU2S((x >> 1) ^ (0u - (x & 1)));
+  }
+}
+
+
+/*
+** Load a nullable string written in full. 'p' is the object that will
+** refer to the string (for the barrier).
+*/
+static TString *loadInlineString (LoadState *S, GCObject *p) {
   lua_State *L = S->L;
   TString *ts;
   size_t size = loadSize(S);
@@ -130,6 +150,50 @@ static TString *loadStringN (LoadState *S, Proto *p) {
 }
 
 
+/*
+** Load a nullable string into prototype 'p'. Format 2 writes only the
+** index of the string in the string table of the chunk.
+*/
+static TString *loadStringN (LoadState *S, Proto *p) {
+  if (S->strings == NULL)  /* old format? */
+    return loadInlineString(S, obj2gco(p));
+  else {
+    int idx = loadInt(S);
+    const TValue *o;
+    if (idx == 0)  /* no string? */
+      return NULL;
+    o = luaH_getint(S->strings, idx);
+    if (!ttisstring(o))
+      error(S, "bad string index");
+    luaC_objbarrier(S->L, p, tsvalue(o));
+    return tsvalue(o);
+  }
+}
+
+
+/*
+** Load the string table of a chunk into a new table, left on the top
+** of the stack.
+*/
+static void loadStringTable (LoadState *S) {
+  lua_State *L = S->L;
+  int i;
+  int n = loadInt(S);
+  S->strings = luaH_new(L);
+  sethvalue2s(L, L->top, S->strings);  /* anchor it */
+  luaD_inctop(L);
+  luaH_resize(L, S->strings, n, 0);
+  for (i = 1; i <= n; i++) {
+    TValue v;
+    TString *ts = loadInlineString(S, obj2gco(S->strings));
+    if (ts == NULL)
+      error(S, "bad string table");
+    setsvalue(L, &v, ts);
+    luaH_setint(L, S->strings, i, &v);
+  }
+}
+
+
 /*
 ** Load a non-nullable string into prototype 'p'.
 */
@@ -141,11 +205,78 @@ static TString *loadString (LoadState *S, Proto *p) {
 }
 
 
+/*
+** Skip the padding that aligns the next block relative to the start of
+** the chunk (see 'dumpAlign').
+*/
+static void loadAlign (LoadState *S, int align) {
+  char buff[8];
+  int padding;
+  if (S->format < 1)  /* no padding in the official format? */
+    return;
+  padding = loadByte(S);
+  if (padding >= align)
+    error(S, "bad padding");
+  loadBlock(S, buff, padding);
+}
+
+
+/*
+** Make prototype 'f' use the mapped buffer. The first prototype using
+** the buffer creates the copy of its description that prototypes
+** share; from then on, releasing the buffer is up to them.
+*/
+static void refMapped (LoadState *S, Proto *f) {
+  if (f->mapped == NULL) {
+    if (S->hmap == NULL) {  /* first use of the buffer? */
+      S->hmap = luaM_new(S->L, Mapped);
+      *S->hmap = *S->map;
+      S->hmap->nrefs = 0;
+      S->hmap->format = cast_byte(S->format);
+      S->map->nrefs = 1;  /* signal that the buffer is in use */
+    }
+    f->mapped = S->hmap;
+    S->hmap->nrefs++;
+  }
+}
+
+
+/*
+** Use the next 'size' bytes of a mapped chunk in place, as an array of
+** prototype 'f' with the given alignment. Returns NULL if the chunk is
+** not mapped or if the array would be misaligned.
+*/
+static void *mapBlock (LoadState *S, Proto *f, size_t size, size_t align) {
+  ZIO *Z = S->Z;
+  void *b;
+  if (S->map == NULL || Z->n < size || point2uint(Z->p) % align != 0)
+    return NULL;
+  refMapped(S, f);
+  b = cast_voidp(Z->p);
+  Z->p += size;
+  Z->n -= size;
+  return b;
+}
+
+
 static void loadCode (LoadState *S, Proto *f) {
   int n = loadInt(S);
-  f->code = luaM_newvectorchecked(S->L, n, Instruction);
-  f->sizecode = n;
-  loadVector(S, f->code, n);
+  Instruction *code;
+  loadAlign(S, sizeof(Instruction));
+  if (luaM_testsize(n, sizeof(Instruction)))  /* too large? */
+    code = NULL;  /* let 'luaM_newvectorchecked' raise the error */
+  else
+    code = (Instruction *)mapBlock(S, f, n * sizeof(Instruction),
+                                         sizeof(Instruction));
+  if (code != NULL) {  /* code used in place? */
+    f->code = code;
+    f->sizecode = n;
+  }
+  else {
+    f->code = luaM_newvectorchecked(S->L, n, Instruction);
+    f->sizecode = n;
+    loadVector(S, f->code, n);
+  }
 }
 
 
@@ -176,7 +307,7 @@ static void loadConstants (LoadState *S, Proto *f) {
         setfltvalue(o, loadNumber(S));
         break;
       case LUA_VNUMINT:
-        setivalue(o, loadInteger(S));
+        setivalue(o, loadIntConstant(S));
         break;
       case LUA_VSHRSTR:
       case LUA_VLNGSTR:
@@ -188,17 +319,65 @@ static void loadConstants (LoadState *S, Proto *f) {
 }
 
 
+/*
+** Load the size of the next nested function; 0 means an unknown size.
+** (The official format has no sizes; format 1 uses a lua_Integer;
+** format 2 uses an Instruction, which is large enough for any function
+** that can be skipped in practice.)
+*/
+static size_t loadProtoSize (LoadState *S) {
+  switch (S->format) {
+    case 0: return 0;
+    case 1: {
+      lua_Integer size = loadInteger(S);
+      return (size < 0) ? 0 : cast_sizet(size);
+    }
+    default: {
+      Instruction size;
+      loadVar(S, size);
+      return cast_sizet(size);
+    }
+  }
+}
+
+
+/*
+** Each nested function comes after its size. In lazy mode, the loader
+** skips it, leaving a placeholder that only records where the function
+** is; the function is loaded when first needed (see 'luaU_loadlazy').
+** The placeholder keeps the string table of the chunk (if any) as its
+** only constant.
+*/
 static void loadProtos (LoadState *S, Proto *f) {
+  lua_State *L = S->L;
   int i;
   int n = loadInt(S);
-  f->p = luaM_newvectorchecked(S->L, n, Proto *);
+  f->p = luaM_newvectorchecked(L, n, Proto *);
   f->sizep = n;
   for (i = 0; i < n; i++)
     f->p[i] = NULL;
   for (i = 0; i < n; i++) {
-    f->p[i] = luaF_newproto(S->L);
-    luaC_objbarrier(S->L, f, f->p[i]);
-    loadFunction(S, f->p[i], f->source);
+    size_t size = loadProtoSize(S);
+    Proto *p = f->p[i] = luaF_newproto(L);
+    luaC_objbarrier(L, f, p);
+    if (S->map != NULL && S->map->lazy && size > 0) {  /* lazy load? */
+      ZIO *Z = S->Z;
+      if (size > Z->n)
+        error(S, "truncated chunk");
+      if (S->strings != NULL) {
+        p->k = luaM_newvectorchecked(L, 1, TValue);
+        sethvalue(L, &p->k[0], S->strings);
+        p->sizek = 1;
+        luaC_objbarrier(L, p, S->strings);
+      }
+      refMapped(S, p);
+      p->source = f->source;  /* the most it can have for now */
+      p->lazy = Z->p;
+      Z->p += size;
+      Z->n -= size;
+    }
+    else
+      loadFunction(S, p, f->source);
   }
 }
 
@@ -227,9 +406,16 @@ static void loadUpvalues (LoadState *S, Proto *f) {
 static void loadDebug (LoadState *S, Proto *f) {
   int i, n;
   n = loadInt(S);
-  f->lineinfo = luaM_newvectorchecked(S->L, n, ls_byte);
-  f->sizelineinfo = n;
-  loadVector(S, f->lineinfo, n);
+  if (f->mapped != NULL) {  /* code in place? then line info too */
+    if (n > 0 && (f->lineinfo = (ls_byte *)mapBlock(S, f, n, 1)) == NULL)
+      error(S, "truncated chunk");
+    f->sizelineinfo = n;
+  }
+  else {
+    f->lineinfo = luaM_newvectorchecked(S->L, n, ls_byte);
+    f->sizelineinfo = n;
+    loadVector(S, f->lineinfo, n);
+  }
   n = loadInt(S);
   f->abslineinfo = luaM_newvectorchecked(S->L, n, AbsLineInfo);
   f->sizeabslineinfo = n;
@@ -292,7 +478,8 @@ static void checkHeader (LoadState *S) {
   checkliteral(S, &LUA_SIGNATURE[1], "not a binary chunk");
   if (loadByte(S) != LUAC_VERSION)
     error(S, "version mismatch");
-  if (loadByte(S) != LUAC_FORMAT)
+  S->format = loadByte(S);
+  if (S->format > LUAC_FORMAT)
     error(S, "format mismatch");
   checkliteral(S, LUAC_DATA, "corrupted chunk");
   checksize(S, Instruction);
@@ -305,29 +492,108 @@ static void checkHeader (LoadState *S) {
 }
 
 
+static const char *chunkname (const char *name) {
+  if (*name == '@' || *name == '=')
+    return name + 1;
+  else if (*name == LUA_SIGNATURE[0])
+    return "binary string";
+  else
+    return name;
+}
+
+
 /*
-** Load precompiled chunk.
+** Load precompiled chunk. If 'map' is not NULL, all the chunk is in the
+** buffer of 'Z' and it is described by 'map'; code and line information
+** may then be used in place, and nested functions may be loaded lazily.
 */
-LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
+LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name, Mapped *map) {
   LoadState S;
   LClosure *cl;
-  if (*name == '@' || *name == '=')
-    S.name = name + 1;
-  else if (*name == LUA_SIGNATURE[0])
-    S.name = "binary string";
-  else
-    S.name = name;
+  S.name = chunkname(name);
   S.L = L;
   S.Z = Z;
+  S.map = map;
+  S.hmap = NULL;
+  S.strings = NULL;
   checkHeader(&S);
   cl = luaF_newLclosure(L, loadByte(&S));
   setclLvalue2s(L, L->top, cl);
   luaD_inctop(L);
+  if (S.format >= 2)
+    loadStringTable(&S);
   cl->p = luaF_newproto(L);
   luaC_objbarrier(L, cl, cl->p);
   loadFunction(&S, cl->p, NULL);
+  if (S.strings != NULL)
+    L->top--;  /* remove string table */
   lua_assert(cl->nupvalues == cl->p->sizeupvalues);
   luai_verifycode(L, cl->p);
   return cl;
 }
 
+
+static const char *noreader (lua_State *L, void *data, size_t *size) {
+  UNUSED(L); UNUSED(data);
+  *size = 0;
+  return NULL;
+}
+
+
+/*
+** Data for 'f_loadlazy'
+*/
+struct SLazy {
+  LoadState S;
+  Proto *np;
+  TString *source;
+};
+
+
+static void f_loadlazy (lua_State *L, void *ud) {
+  struct SLazy *sl = cast(struct SLazy *, ud);
+  UNUSED(L);  /* 'luai_verifycode' may be empty */
+  loadFunction(&sl->S, sl->np, sl->source);
+  luai_verifycode(L, sl->np);
+}
+
+
+/*
+** Load the nested function 'i' of 'f', which was left as a placeholder
+** by a lazy load, and return it. The new prototype replaces the
+** placeholder in 'f' only after it is complete, so that an error
+** leaves 'f' unchanged. A corrupt body is found while the program
+** runs, so it is raised as a runtime error (with position and
+** message handler), not as a syntax error. (The stack may be
+** reallocated.)
+*/
+Proto *luaU_loadlazy (lua_State *L, Proto *f, int i) {
+  Proto *lp = f->p[i];
+  Mapped *m = lp->mapped;
+  struct SLazy sl;
+  ZIO Z;
+  int status;
+  lua_assert(lp->lazy != NULL);
+  sl.S.name = (lp->source != NULL) ? chunkname(getstr(lp->source)) : "?";
+  sl.S.L = L;
+  sl.S.Z = &Z;
+  sl.S.map = sl.S.hmap = m;
+  sl.S.format = m->format;
+  sl.S.strings = (lp->sizek > 0) ? hvalue(&lp->k[0]) : NULL;
+  sl.source = lp->source;
+  luaZ_init(L, &Z, noreader, NULL);
+  Z.p = lp->lazy;
+  Z.n = cast_sizet((m->buff + m->size) - lp->lazy);
+  sl.np = luaF_newproto(L);
+  setgcovalue(L, s2v(L->top), obj2gco(sl.np));  /* anchor it */
+  luaD_inctop(L);
+  status = luaD_pcall(L, f_loadlazy, &sl, savestack(L, L->top), L->errfunc);
+  if (status == LUA_ERRMEM)
+    luaD_throw(L, status);
+  else if (status != LUA_OK)
+    luaG_runerror(L, "%s", svalue(s2v(L->top - 1)));
+  f->p[i] = sl.np;
+  luaC_objbarrier(L, f, sl.np);
+  L->top--;  /* remove anchor */
+  return sl.np;
+}
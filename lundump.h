@@ -24,10 +24,21 @@
 #define MYINT(s)	(s[0]-'0')  /* assume one-digit numerals */
 #define LUAC_VERSION	(MYINT(LUA_VERSION_MAJOR)*16+MYINT(LUA_VERSION_MINOR))
 
-#define LUAC_FORMAT	0	/* this is the official format */
+/*
+** Format 0 is the official one; format 1 adds padding to align code
+** and sizes before nested functions; format 2 (the current one) adds a
+** table with all the strings of the chunk and compact encodings for
+** integer constants and sizes of nested functions. The loader accepts
+** all of them.
+*/
+#define LUAC_FORMAT	2
 
 /* load one chunk; from lundump.c */
-LUAI_FUNC LClosure* luaU_undump (lua_State* L, ZIO* Z, const char* name);
+LUAI_FUNC LClosure* luaU_undump (lua_State* L, ZIO* Z, const char* name,
+                                 Mapped* map);
+
+/* load a nested function left by a lazy load; from lundump.c */
+LUAI_FUNC Proto* luaU_loadlazy (lua_State* L, Proto* f, int i);
 
 /* dump one chunk; from ldump.c */
 LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w,
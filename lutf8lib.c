@@ -38,6 +38,193 @@ typedef unsigned long utfint;
 #define iscont(p)	((*(p) & 0xC0) == 0x80)
 
 
+/*
+** {======================================================
+** Block processing
+** =======================================================
+*/
+
+/*
+** When the compiler offers AVX2 (or SSSE3), strict validation checks
+** whole blocks of bytes at a time with table lookups on their nibbles
+** (the method from Keiser and Lemire, "Validating UTF-8 in less than
+** one instruction per byte"), and counting characters counts the bytes
+** that are not continuation bytes. Define LUA_NOVECTOR to use only the
+** portable code.
+*/
+#if !defined(LUA_NOVECTOR) && defined(__GNUC__)
+
+#define vb(c)	((char)(c))
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+typedef __m256i l_vec;
+#define L_VECSIZE	32
+#define vecload(p)	_mm256_loadu_si256((const __m256i *)(p))
+#define vecsplat(c)	_mm256_set1_epi8(vb(c))
+#define vechighmask(a)	((unsigned)_mm256_movemask_epi8(a))
+#define vecgt(a,b)	_mm256_cmpgt_epi8(a,b)
+#define vecand(a,b)	_mm256_and_si256(a,b)
+#define vecor(a,b)	_mm256_or_si256(a,b)
+#define vecxor(a,b)	_mm256_xor_si256(a,b)
+#define vecsubs(a,b)	_mm256_subs_epu8(a,b)
+#define vecshr4(a)	vecand(_mm256_srli_epi16(a, 4), vecsplat(0x0F))
+#define veclookup(t,i)	_mm256_shuffle_epi8(t,i)
+#define veczero(a)	_mm256_testz_si256(a,a)
+/* block 'in' shifted by 'n' bytes, with the last bytes of 'prev' */
+#define vecprev(in,prev,n)  \
+	_mm256_alignr_epi8(in, _mm256_permute2x128_si256(prev, in, 0x21), 16 - n)
+#define vectable(a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p)  _mm256_setr_epi8( \
+	vb(a), vb(b), vb(c), vb(d), vb(e), vb(f), vb(g), vb(h), \
+	vb(i), vb(j), vb(k), vb(l), vb(m), vb(n), vb(o), vb(p), \
+	vb(a), vb(b), vb(c), vb(d), vb(e), vb(f), vb(g), vb(h), \
+	vb(i), vb(j), vb(k), vb(l), vb(m), vb(n), vb(o), vb(p))
+
+#elif defined(__SSSE3__)
+
+#include <tmmintrin.h>
+
+typedef __m128i l_vec;
+#define L_VECSIZE	16
+#define vecload(p)	_mm_loadu_si128((const __m128i *)(p))
+#define vecsplat(c)	_mm_set1_epi8(vb(c))
+#define vechighmask(a)	((unsigned)_mm_movemask_epi8(a))
+#define vecgt(a,b)	_mm_cmpgt_epi8(a,b)
+#define vecand(a,b)	_mm_and_si128(a,b)
+#define vecor(a,b)	_mm_or_si128(a,b)
+#define vecxor(a,b)	_mm_xor_si128(a,b)
+#define vecsubs(a,b)	_mm_subs_epu8(a,b)
+#define vecshr4(a)	vecand(_mm_srli_epi16(a, 4), vecsplat(0x0F))
+#define veclookup(t,i)	_mm_shuffle_epi8(t,i)
+#define veczero(a)  \
+	(_mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) == 0xFFFF)
+#define vecprev(in,prev,n)	_mm_alignr_epi8(in, prev, 16 - n)
+#define vectable(a,b,c,d,e,f,g,h,i,j,k,l,m,n,o,p)  _mm_setr_epi8( \
+	vb(a), vb(b), vb(c), vb(d), vb(e), vb(f), vb(g), vb(h), \
+	vb(i), vb(j), vb(k), vb(l), vb(m), vb(n), vb(o), vb(p))
+
+#endif
+
+#endif
+
+
+#if defined(L_VECSIZE)
+
+/* number of bytes in block 'v' that start characters */
+#define vecstarts(v)	__builtin_popcount(vechighmask(vecgt(v, vecsplat(0xBF))))
+
+
+/*
+** Kinds of errors, marked by the lookups on the high nibble of a byte
+** (b1h) and on its low nibble (b1l) and on the high nibble of the next
+** byte (b2h). A pair of bytes is invalid when all three lookups mark
+** the same error.
+*/
+#define TOO_SHORT	0x01  /* lead byte followed by a non-continuation */
+#define TOO_LONG	0x02  /* ASCII followed by a continuation */
+#define OVERLONG_3	0x04  /* 11100000 100_____ */
+#define TOO_LARGE	0x08  /* above 0x10FFFF */
+#define SURROGATE	0x10  /* 11101101 101_____ */
+#define OVERLONG_2	0x20  /* 1100000_ 10______ */
+#define TOO_LARGE_1000	0x40  /* above 0x10FFFF, with 1000____ after */
+#define OVERLONG_4	0x40  /* 11110000 1000____ */
+#define TWO_CONTS	0x80  /* two continuations (maybe valid) */
+#define CARRY		(TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+
+/*
+** Return a block with nonzero bytes where the bytes in block 'in'
+** (which follows block 'prev') are not valid UTF-8.
+*/
+static l_vec utf8errors (l_vec in, l_vec prev) {
+  const l_vec b1h = vectable(
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+  const l_vec b1l = vectable(
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000);
+  const l_vec b2h = vectable(
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+      OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+  l_vec prev1 = vecprev(in, prev, 1);
+  l_vec errors = vecand(vecand(veclookup(b1h, vecshr4(prev1)),
+                               veclookup(b1l, vecand(prev1, vecsplat(0x0F)))),
+                        veclookup(b2h, vecshr4(in)));
+  /* third and fourth bytes of a sequence must be continuations, and
+     only they may follow another continuation */
+  l_vec must23 = vecor(vecsubs(vecprev(in, prev, 2), vecsplat(0xE0 - 0x80)),
+                       vecsubs(vecprev(in, prev, 3), vecsplat(0xF0 - 0x80)));
+  return vecxor(vecand(must23, vecsplat(0x80)), errors);
+}
+
+
+/*
+** Validate (in strict mode) the 'l' bytes from 's' a block at a time,
+** stopping at the first block with an error. Return how many bytes
+** were validated, always ending at the end of a character, and add
+** to '*n' the number of characters in them.
+*/
+static size_t vecutf8 (const char *s, size_t l, lua_Integer *n) {
+  l_vec prev = vecsplat(0);
+  int incomplete = 0;  /* previous block ends in the middle of a char.? */
+  lua_Integer count = 0;
+  size_t i, done = 0;
+  for (i = 0; i + L_VECSIZE <= l; i += L_VECSIZE) {
+    l_vec in = vecload(s + i);
+    if (vechighmask(in) == 0) {  /* only ASCII? */
+      if (incomplete) break;  /* previous character is incomplete */
+      count += L_VECSIZE;
+    }
+    else {
+      const unsigned char *e = (const unsigned char *)s + i + L_VECSIZE;
+      if (!veczero(utf8errors(in, prev)))
+        break;
+      count += vecstarts(in);
+      incomplete = (e[-1] >= 0xC0 || e[-2] >= 0xE0 || e[-3] >= 0xF0);
+    }
+    prev = in;
+    if (!incomplete) {  /* all characters so far are complete? */
+      done = i + L_VECSIZE;
+      *n += count;
+      count = 0;
+    }
+  }
+  return done;
+}
+
+#endif
+
+/* }====================================================== */
+
+
+
 /* from strlib */
 /* translate a relative string position: negative means back from end */
 static lua_Integer u_posrelat (lua_Integer pos, size_t len) {
@@ -84,12 +271,36 @@ static const char *utf8_decode (const char *s, utfint *val, int strict) {
 }
 
 
+/*
+** Count in '*n' the characters that start in the range [posi,posj] of
+** 's'. Return the position of the first invalid byte sequence in that
+** range, or -1 if there is none.
+*/
+static lua_Integer utf8count (const char *s, lua_Integer posi,
+                              lua_Integer posj, int lax, lua_Integer *n) {
+#if defined(L_VECSIZE)
+  if (!lax && posi <= posj)
+    posi += vecutf8(s + posi, (size_t)(posj - posi + 1), n);
+#endif
+  while (posi <= posj) {
+    const char *s1 = utf8_decode(s + posi, NULL, !lax);
+    if (s1 == NULL)  /* conversion error? */
+      return posi;
+    posi = s1 - s;
+    (*n)++;
+  }
+  return -1;
+}
+
+
 /*
 ** utf8len(s [, i [, j [, lax]]]) --> number of characters that
 ** start in the range [i,j], or nil + current position if 's' is not
-** well formed in that interval
+** well formed in that interval;
+** utf8valid(s [, i [, j [, lax]]]) --> whether 's' is well formed
+** in the range [i,j]
 */
-static int utflen (lua_State *L) {
+static int utflen_aux (lua_State *L, int isvalid) {
   lua_Integer n = 0;  /* counter for the number of characters */
   size_t len;  /* string length in bytes */
   const char *s = luaL_checklstring(L, 1, &len);
@@ -100,21 +311,29 @@ static int utflen (lua_State *L) {
                    "initial position out of bounds");
   luaL_argcheck(L, --posj < (lua_Integer)len, 3,
                    "final position out of bounds");
-  while (posi <= posj) {
-    const char *s1 = utf8_decode(s + posi, NULL, !lax);
-    if (s1 == NULL) {  /* conversion error? */
-      luaL_pushfail(L);  /* return fail ... */
-      lua_pushinteger(L, posi + 1);  /* ... and current position */
-      return 2;
-    }
-    posi = s1 - s;
-    n++;
+  posi = utf8count(s, posi, posj, lax, &n);
+  if (isvalid)
+    lua_pushboolean(L, posi < 0);
+  else if (posi >= 0) {  /* conversion error? */
+    luaL_pushfail(L);  /* return fail ... */
+    lua_pushinteger(L, posi + 1);  /* ... and current position */
+    return 2;
   }
-  lua_pushinteger(L, n);
+  else
+    lua_pushinteger(L, n);
   return 1;
 }
 
 
+static int utflen (lua_State *L) {
+  return utflen_aux(L, 0);
+}
+
+static int utfvalid (lua_State *L) {
+  return utflen_aux(L, 1);
+}
+
+
 /*
 ** codepoint(s, [i, [j [, lax]]]) -> returns codepoints for all
 ** characters that start in the range [i,j]
@@ -196,6 +415,14 @@ static int byteoffset (lua_State *L) {
     if (iscont(s + posi))
       return luaL_error(L, "initial position is a continuation byte");
     if (n < 0) {
+#if defined(L_VECSIZE)
+       while (posi - L_VECSIZE >= 1) {  /* skip whole blocks back */
+         int c = vecstarts(vecload(s + posi - L_VECSIZE));
+         if (c >= -n) break;  /* character is in this block */
+         n += c;
+         posi -= L_VECSIZE;
+       }
+#endif
        while (n < 0 && posi > 0) {  /* move back */
          do {  /* find beginning of previous character */
            posi--;
@@ -205,6 +432,15 @@ static int byteoffset (lua_State *L) {
      }
      else {
        n--;  /* do not move for 1st character */
+#if defined(L_VECSIZE)
+       while (n > 0 && posi + 1 + L_VECSIZE <= (lua_Integer)len) {
+         /* skip whole blocks after 'posi' */
+         int c = vecstarts(vecload(s + posi + 1));
+         if (c >= n) break;  /* character is in this block */
+         n -= c;
+         posi += L_VECSIZE;
+       }
+#endif
        while (n > 0 && posi < (lua_Integer)len) {
          do {  /* find beginning of next character */
            posi++;
@@ -273,6 +509,7 @@ static const luaL_Reg funcs[] = {
   {"codepoint", codepoint},
   {"char", utfchar},
   {"len", utflen},
+  {"valid", utfvalid},
   {"codes", iter_codes},
   /* placeholders */
   {"charpattern", NULL},
@@ -28,6 +28,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lundump.h"
 #include "lvm.h"
 
 
@@ -1781,6 +1782,10 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
       }
       vmcase(OP_CLOSURE) {
         Proto *p = cl->p->p[GETARG_Bx(i)];
+        if (unlikely(p->lazy != NULL)) {  /* not loaded yet? */
+          Protect(p = luaU_loadlazy(L, cl->p, GETARG_Bx(i)));
+          updatestack(ci);  /* loading can reallocate the stack */
+        }
         halfProtect(pushclosure(L, p, cl->upvals, base, ra));
         checkGC(L, ra + 1);
         vmbreak;
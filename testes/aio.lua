@@ -0,0 +1,218 @@
+-- $Id: testes/aio.lua $
+-- See Copyright Notice in file all.lua
+
+local ok, aio = pcall(require, "aio")
+if not ok then
+  (Message or print)('\n >>> aio library not available <<<\n')
+  return
+end
+
+print "testing asynchronous I/O"
+
+local function checkerror (msg, f, ...)
+  local s, err = pcall(f, ...)
+  assert(not s and string.find(err, msg))
+end
+
+local file = os.tmpname()
+
+assert(aio.backend() == "none")
+checkerror("invalid option", aio.backend, "xuxu")
+
+do  -- synchronous use, outside tasks
+  local f = assert(aio.open(file, "w"))
+  assert(string.find(tostring(f), "^aio file %(%d+%)$"))
+  assert(f:write("hello") == f)
+  assert(f:write("") == f)
+  assert(f:seek() == 5)
+  assert(f:write(" world"):sync() == f)
+  assert(f:write("H", 0):seek() == 1)
+  assert(f:close())
+  assert(tostring(f) == "aio file (closed)")
+  checkerror("closed file", f.read, f, 1)
+  f = assert(aio.open(file))
+  assert(f:read(5) == "Hello" and f:seek() == 5)
+  assert(f:read(100) == " world")
+  assert(f:read(1) == nil)   -- end of file
+  assert(f:read(0) == "")
+  assert(f:read(3, 2) == "llo" and f:seek() == 5)
+  assert(f:seek(10) == 10 and f:read(10) == "d")
+  checkerror("invalid size", f.read, f, -1)
+  checkerror("invalid offset", f.read, f, 1, -1)
+  checkerror("invalid position", f.seek, f, -1)
+  local r, msg = f:write("x")   -- file is read only
+  assert(not r and type(msg) == "string")
+  f:close()
+  local f, msg, code = aio.open("/a/non/existent/file")
+  assert(not f and string.find(msg, "non/existent") and code)
+  checkerror("invalid option", aio.open, file, "rw")
+  assert(aio.backend() == "none")   -- no task ran yet
+end
+
+do  -- append mode: writes go to the end of the file
+  local f <close> = assert(aio.open(file, "a+"))
+  assert(f:write("!", 0):seek() == 12)
+  aio.run(function ()
+    assert(f:write("?"):seek() == 13)
+  end)
+  assert(f:read(20, 0) == "Hello world!?")
+end
+
+do  -- many tasks doing I/O concurrently
+  local N = 100
+  local names = {}
+  local sizes = {}
+  aio.run(function ()
+    for i = 1, N do
+      aio.spawn(function (i)
+        names[i] = os.tmpname()
+        local f <close> = assert(aio.open(names[i], "w+"))
+        local s = string.rep(string.char(65 + i % 26), 100 * i)
+        assert(f:write(s):write("|" .. i) == f)
+        assert(f:sync())
+        f:seek(0)
+        local r = {}
+        repeat
+          local b = f:read(64)
+          r[#r + 1] = b
+        until not b
+        sizes[i] = #table.concat(r)
+        assert(table.concat(r) == s .. "|" .. i)
+        assert(f:read(2, 100 * i + 1) == tostring(i):sub(1, 2))
+      end, i)
+    end
+  end)
+  for i = 1, N do
+    assert(sizes[i] == 100 * i + 1 + #tostring(i))
+    assert(os.remove(names[i]))
+  end
+  local b = aio.backend()
+  assert(b == "io_uring" or b == "threads")
+  checkerror("already started", aio.backend, "threads")
+end
+
+do  -- tasks and plain coroutine yields
+  local t = {}
+  aio.run(function ()
+    aio.spawn(function ()
+      for i = 1, 3 do t[#t + 1] = "a" .. i; coroutine.yield() end
+    end)
+    aio.spawn(function ()
+      for i = 1, 3 do t[#t + 1] = "b" .. i; coroutine.yield() end
+    end)
+  end)
+  assert(table.concat(t, " ") == "a1 b1 a2 b2 a3 b3")
+  aio.run()   -- nothing to do
+end
+
+-- errors in several tasks resumed by completions of the same batch
+local function manyerrors (aio)
+  local n = 0
+  local function task ()
+    local f <close> = aio.open(file)
+    assert(f:read(5) == "Hello")
+    n = n + 1
+    error("task " .. n)
+  end
+  checkerror("task 1", aio.run, function ()
+    for i = 1, 8 do aio.spawn(task) end
+  end)
+  for i = 2, 8 do   -- each new run resumes the remaining tasks
+    checkerror("task " .. i, aio.run)
+  end
+  aio.run()   -- nothing left
+  assert(n == 8)
+end
+
+
+do  -- errors inside tasks
+  checkerror("boom", aio.run, function ()
+    local f <close> = aio.open(file)
+    assert(f:read(5) == "Hello")
+    error("boom")
+  end)
+  -- pending tasks continue in a new run
+  local done
+  checkerror("xuxu", aio.run, function ()
+    aio.spawn(function ()
+      local f <close> = aio.open(file)
+      assert(f:read(5) == "Hello")
+      done = true
+    end)
+    error("xuxu")
+  end)
+  assert(not done)
+  aio.run()
+  assert(done)
+  checkerror("already running", aio.run, function () aio.run() end)
+  aio.run()   -- previous error must not leave the library running
+  manyerrors(aio)
+end
+
+do  -- closing with pending operations
+  checkerror("pending", aio.run, function ()
+    local f = aio.open(file)
+    aio.spawn(function () f:read(10) end)
+    coroutine.yield()
+    f:close()
+  end)
+  aio.run()
+  -- closing a waiting task closes its variables, which cannot close
+  -- files with pending operations; the task is not resumed
+  local t, resumed
+  aio.run(function ()
+    aio.spawn(function ()
+      t = coroutine.running()
+      local f <close> = aio.open(file, "r+")
+      f:write(string.rep("x", 100), 1000)
+      resumed = true
+    end)
+    aio.spawn(function ()
+      local ok, msg = coroutine.close(t)
+      assert(not ok and string.find(msg, "pending"))
+      collectgarbage()
+    end)
+  end)
+  assert(coroutine.status(t) == "dead" and not resumed)
+  local f <close> = aio.open(file)
+  assert(f:read(100, 1000) == string.rep("x", 100))
+  -- a closed task does not keep its requests pending
+  local f = aio.open(file)
+  aio.run(function ()
+    aio.spawn(function () t = coroutine.running(); f:read(10) end)
+    aio.spawn(function () assert(coroutine.close(t)) end)
+  end)
+  assert(coroutine.status(t) == "dead")
+  assert(f:close())
+end
+
+assert(os.remove(file))
+
+do  -- a new instance of the library, using the thread backend
+  assert(require"aio" == aio)
+  package.loaded.aio = nil
+  local a = require"aio"
+  assert(a ~= aio and a.backend() == "none")
+  assert(a.backend("threads") == "threads")
+  local s = {}
+  a.run(function ()
+    for i = 1, 10 do
+      a.spawn(function ()
+        local name = os.tmpname()
+        local f <close> = a.open(name, "w+")
+        f:write(string.rep("x", i * 1000))
+        local r = f:read(i * 1000, 0)
+        s[i] = #r
+        os.remove(name)
+      end)
+    end
+  end)
+  for i = 1, 10 do assert(s[i] == i * 1000) end
+  local f <close> = a.open(file, "w")
+  f:write("Hello")
+  manyerrors(a)
+  assert(os.remove(file))
+  package.loaded.aio = aio
+end
+
+print'OK'
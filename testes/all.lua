@@ -203,6 +203,7 @@ dofile('sort.lua', true)
 dofile('bitwise.lua')
 assert(dofile('verybig.lua', true) == 10); collectgarbage()
 dofile('files.lua')
+dofile('aio.lua')
 
 if #msgs > 0 then
   local m = table.concat(msgs, "\n  ")
@@ -1065,6 +1065,170 @@ T.closestate(L1)
 
 L1 = nil
 
+
+-- testing state images
+do
+  local function newstate ()
+    local L = T.newstate()
+    T.loadlib(L)
+    T.doremote(L, [[
+      require"_G"
+      for _, m in ipairs{"string", "table", "io", "math", "coroutine"} do
+        _G[m] = require(m)
+      end
+    ]])
+    return L
+  end
+
+  local L1 = newstate()
+  assert(T.doremote(L1, [[
+    local count = 0
+    function inc (n) count = count + (n or 1); return count end
+    function get () return count end
+    local t = {10, 20, x = "a"}
+    t.self = t
+    data = setmetatable(t, {__index = function (_, k) return k .. "!" end})
+    string.twice = function (s) return s:rep(2) end
+    out = io.stdout
+    package.loaded.mymod = {f = function (x) return math.sin(x) end}
+    inc(10)
+    return "ok"
+  ]]) == "ok")
+  local img = assert(T.saveimage(L1))
+  local L2 = newstate()
+  assert(T.restoreimage(L2, img))
+  local function r (s)
+    return T.doremote(L2, "return tostring(" .. s .. ")")
+  end
+  assert(r"inc(5)" == "15" and r"get()" == "15")   -- shared upvalue
+  assert(r"data.self == data and data[2] + data[1]" == "30")
+  assert(r"data.foo" == "foo!")
+  assert(r"('ab'):twice()" == "abab")   -- same 'string' table
+  assert(r"out == io.stdout" == "true")
+  assert(r"require'mymod'.f(0)" == "0.0")
+  assert(r"package.loaded._G == _G" == "true")
+  assert(T.doremote(L1, "return get()") == "10")   -- original unchanged
+  T.closestate(L2)
+
+  -- functions with the same prototype still share it
+  assert(T.doremote(L1, [[
+    local function mk (x) return function () x = x + 1; return x end end
+    c1, c2 = mk(1), mk(10)
+    return "ok"
+  ]]) == "ok")
+  L2 = newstate()
+  assert(T.restoreimage(L2, assert(T.saveimage(L1))))
+  assert(r"c1()" == "2" and r"c2()" == "11" and r"c1()" == "3")
+  assert(T.testC(L2, [[getglobal "c1"; codeid -1; getglobal "c2";
+                       codeid -1; compare EQ -1 -3; return 1]]))
+  T.closestate(L2)
+
+  -- C functions and userdata must be reachable from modules
+  T.doremote(L1, "x = coroutine.wrap(print)")
+  L2 = newstate()
+  local st, msg = T.restoreimage(L2, assert(T.saveimage(L1)))
+  assert(not st and string.find(msg, "image needs '_G.x'"))
+  T.closestate(L2)
+  T.doremote(L1, "x = {{x}}")
+  local st, msg = T.saveimage(L1)
+  assert(not st and string.find(msg, "cannot save function"))
+  T.testC(L1, [[getglobal "_G"; topointer -1; setglobal "x"; pop 1]])
+  st, msg = T.saveimage(L1)   -- light userdata
+  assert(not st and string.find(msg, "cannot save userdata"))
+
+  -- truncated images
+  for i = 1, #img - 1, 37 do
+    L2 = newstate()
+    local st, msg = T.restoreimage(L2, string.sub(img, 1, i))
+    assert(not st and string.find(msg, "image"))
+    T.closestate(L2)
+  end
+  T.closestate(L1)
+end
+
+
+-- testing lazy opening of libraries
+do
+  local L1 = T.newstate()
+  T.openlazylibs(L1)
+  local function rem (code) return T.doremote(L1, code) end
+  assert(rem"return tostring(rawget(_G, 'math'))" == "nil")
+  assert(rem"return tostring(package.loaded.string)" == "nil")
+  assert(rem"return math.max(3, 4)" == "4")
+  assert(rem"return tostring(rawget(_G, 'math') == package.loaded.math)"
+         == "true")
+  assert(rem"return ('%d'):format(10)" == "10")   -- opens string library
+  assert(rem"return tostring(string.format == ('').format)" == "true")
+  assert(rem"return tostring(require'io' == io)" == "true")
+  assert(rem"return tostring(rawget(_G, 'os'))" == "nil")
+  assert(rem"utf8 = nil; return tostring(utf8)" == "nil")
+  assert(rem"table = 10; return table" == "10")
+  assert(rem"return tostring(x or _G[1] or package.loaded.table)" == "nil")
+  assert(rem"return tostring(next(package.loaded, nil) ~= nil)" == "true")
+  assert(rem"return coroutine.wrap(function () return 'co' end)()" == "co")
+  assert(string.find(rem"return debug.traceback('x')", "^x\nstack traceback"))
+  T.closestate(L1)
+  -- arithmetic with strings also opens the string library
+  for _, code in ipairs{"'10' + 1", "- '-11'"} do
+    L1 = T.newstate()
+    T.openlazylibs(L1)
+    assert(rem("return " .. code) == "11")
+    assert(rem"return tostring(package.loaded.string == string)" == "true")
+    T.closestate(L1)
+  end
+  L1 = T.newstate()
+  T.openlazylibs(L1)
+  assert(string.find(select(2, T.doremote(L1, "return 'a' + 1")),
+                     "attempt to add"))
+  assert(rem"return ('x').y" == nil)
+  T.closestate(L1)
+end
+
+
+-- testing parallel compilation
+do
+  local n = 20
+  local srcs, dsts = {}, {}
+  for i = 1, n do
+    srcs[i], dsts[i] = os.tmpname(), os.tmpname()
+    local f = assert(io.open(srcs[i], "w"))
+    f:write(string.format(
+      "local x = %d\nreturn function (y) return x + y, 'f%d' end", i, i))
+    f:close()
+  end
+  local function check (i, strip)
+    local f = assert(io.open(dsts[i], "rb"))
+    assert(f:read("a") == string.dump(loadfile(srcs[i]), strip))
+    f:close()
+  end
+  -- output does not depend on the number of threads
+  for _, nt in ipairs{1, 4, 0, 100} do
+    assert(T.compilefiles(srcs, dsts, false, nt) == 0)
+    for i = 1, n do check(i, false) end
+  end
+  assert(T.compilefiles(srcs, dsts, true, 3) == 0)
+  for i = 1, n do check(i, true) end
+  assert(T.compilefiles({}, {}) == 0)
+
+  -- errors come in the order of the files; other files are compiled
+  local f = assert(io.open(srcs[5], "w"))
+  f:write("return +")
+  f:close()
+  local bad = {table.unpack(srcs)}
+  bad[10] = srcs[10] .. "x"
+  local st, msg = T.compilefiles(bad, dsts, false, 4)
+  assert(st == 3)   -- LUA_ERRSYNTAX
+  local l1, l2 = string.match(msg, "^(.-)\n(.*)$")
+  assert(string.find(l1, srcs[5] .. ":1:", 1, true) == 1)
+  assert(string.find(l2, "cannot open " .. bad[10], 1, true) == 1)
+  for i = 1, n do
+    if i ~= 5 and i ~= 10 then check(i, false) end
+  end
+  for i = 1, n do
+    assert(os.remove(srcs[i]) and os.remove(dsts[i]))
+  end
+end
+
 print('+')
 -------------------------------------------------------------------------
 -- testing to-be-closed variables
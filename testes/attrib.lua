@@ -225,6 +225,155 @@ assert(require"P1" == m and m.AA == 10)
 removefiles(files)
 
 
+-- testing the cache of compiled chunks
+
+files = {["M2.lua"] = "local x = ...; return function () return x end\n"}
+createfiles(files, "", "")
+local cache = package.cache
+local olddir = cache.dir
+cache.dir = string.sub(DIR, 1, -2)
+local cfile = D(string.gsub(D"M2.lua", "%" .. dirsep, "_") .. ".luac")
+local hits, misses = cache.hits, cache.misses
+for i = 1, 2 do
+  assert(require"M2"() == "M2")
+  package.loaded.M2 = nil
+end
+assert(cache.hits == hits + 1 and cache.misses == misses + 1)
+local f = assert(io.open(cfile, "rb"))
+local s = f:read("a"); f:close()
+assert(string.find(s, D"M2.lua", 1, true) == 1)
+assert(loadfile(D"M2.lua")()() == nil)   -- 'loadfile' also uses it
+assert(cache.hits == hits + 2)
+-- changing the source invalidates its cached chunk
+files["M2.lua"] = "return function () return 'new' end\n"
+createfiles(files, "", "")
+assert(loadfile(D"M2.lua")()() == "new")
+assert(cache.hits == hits + 2 and cache.misses == misses + 2)
+assert(loadfile(D"M2.lua")()() == "new")
+assert(cache.hits == hits + 3)
+-- invalid cached chunks are ignored (and replaced)
+f = assert(io.open(cfile, "rb"))
+s = f:read("a"); f:close()
+f = assert(io.open(cfile, "wb"))
+f:write(string.sub(s, 1, -10)); f:close()
+assert(loadfile(D"M2.lua")()() == "new")
+assert(loadfile(D"M2.lua")()() == "new")
+assert(cache.hits == hits + 4 and cache.misses == misses + 3)
+-- binary-only loads do not use the cache
+assert(not loadfile(D"M2.lua", "b"))
+assert(cache.hits == hits + 4 and cache.misses == misses + 3)
+-- a cached chunk stands only for its exact source, and only when the
+-- mode allows binary chunks
+f = assert(io.open(cfile, "rb"))
+s = f:read("a"); f:close()
+local k = select(2, string.find(s, files["M2.lua"], 1, true))
+f = assert(io.open(cfile, "wb"))
+f:write(string.sub(s, 1, k),
+        string.dump(load"return function () return 'B' end"))
+f:close()
+assert(loadfile(D"M2.lua", "t")()() == "new")
+assert(loadfile(D"M2.lua")()() == "B")
+assert(cache.hits == hits + 5 and cache.misses == misses + 3)
+files["M2.lua"] = "return function () return 'NEW' end\n"   -- same size
+createfiles(files, "", "")
+assert(loadfile(D"M2.lua")()() == "NEW")
+assert(cache.hits == hits + 5 and cache.misses == misses + 4)
+cache.dir = olddir
+assert(os.remove(cfile))
+removefiles(files)
+
+
+-- testing the search cache
+
+files = {["M3.lua"] = "return 'M3'"}
+package.path = D"?.lua;" .. D"nodir/?.lua"
+assert(package.searchcache == nil)
+package.searchcache = {}
+local st, msg = pcall(require, "M3")
+assert(not st and string.find(msg, "nodir"))
+createfiles(files, "", "")
+-- cached listing of 'DIR' does not have the new file
+st, msg = pcall(require, "M3")
+assert(not st and string.find(msg, "no file '" .. D"M3.lua", 1, true))
+assert(type(package.searchcache[DIR]) == "table")
+package.searchcache[DIR] = nil   -- invalidate one directory
+assert(require"M3" == "M3")
+package.loaded.M3 = nil
+removefiles(files)
+-- listing still has the removed file, but it is not readable anymore
+st, msg = pcall(require, "M3")
+assert(not st)
+createfiles(files, "", "")
+package.searchcache = {}   -- invalidate everything
+assert(require"M3" == "M3")
+package.loaded.M3 = nil
+package.searchcache = nil
+removefiles(files)
+
+
+-- testing bundles
+
+files = {
+  ["M4.lua"] = [[#!comment
+    local n, f = ...
+    local getinfo = require"debug".getinfo   -- 'all.lua' erases 'debug'
+    return {n, f, getinfo(1, 'S').source, getinfo(1, 'l').currentline}]],
+  ["M5.lua"] = "return 'M5 in ' .. select(2, ...)",
+}
+createfiles(files, "", "")
+assert(package.bundlepath == "")
+local bundles = {}
+for _, mode in ipairs{"b", "s", "t"} do
+  local mods = {M4 = D"M4.lua"}
+  for i = 1, 30 do mods["a.x" .. i] = D"M5.lua" end
+  local bname = D("B" .. mode)
+  assert(package.makebundle(bname, mods, mode))
+  bundles[#bundles + 1] = bname
+  package.bundlepath = D"nobundle;" .. bname
+  local m = require"M4"
+  assert(m[1] == "M4" and m[2] == bname and m[4] == (mode ~= "s" and 4 or -1))
+  if mode == "s" then assert(m[3] == "=?")
+  elseif mode == "b" then assert(m[3] == "@" .. D"M4.lua")
+  else assert(m[3] == "@" .. bname .. ":M4")
+  end
+  for i = 1, 30 do
+    assert(require("a.x" .. i) == "M5 in " .. bname)
+    package.loaded["a.x" .. i] = nil
+  end
+  package.loaded.M4 = nil
+  local st, msg = pcall(require, "a.x")
+  assert(not st and string.find(msg, "no file '" .. D"nobundle" ..
+           "'\n\tno module 'a.x' in file '" .. bname .. "'", 1, true))
+end
+-- bundles come before paths
+package.path = D"?.lua"
+package.bundlepath = bundles[1]
+assert(require"M5" == "M5 in " .. D"M5.lua")   -- not in the bundle
+package.loaded.M5 = nil
+assert(package.makebundle(D"B2", {M5 = D"M4.lua"}))
+package.bundlepath = D"B2"
+assert(require"M5"[2] == D"B2")
+package.loaded.M5 = nil
+-- a new bundle does not change the old one, which may be in use
+assert(package.makebundle(D"B2", {}))
+assert(require"M5"[2] == D"B2")
+package.loaded.M5 = nil
+package.path = oldpath
+-- invalid bundle
+package.bundlepath = D"M5.lua"
+local st, msg = pcall(require, "M5")
+assert(not st and string.find(msg, "is not a valid bundle"))
+-- invalid module
+local st, msg = pcall(package.makebundle, D"B3", {M5 = D"nofile"})
+assert(not st and string.find(msg, "nofile"))
+assert(not pcall(package.makebundle, D"B3", {[1] = D"M5.lua"}))
+assert(not package.makebundle(D"nodir/B3", {}))
+package.bundlepath = ""
+for _, b in ipairs(bundles) do assert(os.remove(b)) end
+assert(os.remove(D"B2"))
+removefiles(files)
+
+
 package.path = ""
 assert(not pcall(require, "file_does_not_exist"))
 package.path = "??\0?"
@@ -439,7 +439,7 @@ do
   local header = string.pack("c4BBc6BBB",
     "\27Lua",                                  -- signature
     0x54,                                      -- version 5.4 (0x54)
-    0,                                         -- format
+    2,                                         -- format (string table)
     "\x19\x93\r\n\x1a\n",                      -- data
     4,                                         -- size of instruction
     string.packsize("j"),                      -- sizeof(lua integer)
@@ -475,6 +475,186 @@ do
     local st, msg = load(string.sub(c, 1, i))
     assert(not st and string.find(msg, "truncated"))
   end
+
+  -- strings are dumped only once per chunk
+  local long = string.rep("x", 100)
+  local function rep (n)
+    local t = {}
+    for i = 1, n do
+      t[i] = string.format("function f%d (x) return %q .. x, %d end",
+                           i, long, -i)
+    end
+    return string.dump(load(table.concat(t, "\n")), true)
+  end
+  local d1, d10 = rep(1), rep(10)
+  assert(#d10 - #d1 < 9 * #long)
+  load(d10)()
+  assert(f10("y") == long .. "y" and select(2, f10("")) == -10)
+  for i = 1, 10 do _ENV["f" .. i] = nil end
+
+  -- loading mapped files (mode 'm')
+  local file = os.tmpname()
+  local function write (...)
+    local f = assert(io.open(file, "wb")); f:write(...); f:close()
+  end
+  write(c)
+  assert(assert(loadfile(file, "bm"))() == 10)
+  collectgarbage()
+  local g = string.dump(function (x)
+    return function () return x + 1 end
+  end)
+  for _, prefix in ipairs{"", "#!lua\n", "#\n"} do
+    write(prefix, g)
+    local h = assert(loadfile(file, "bm"))(10)
+    collectgarbage()
+    assert(h() == 11)
+    local line = debug.getinfo(h, "S").linedefined
+    assert(debug.getinfo(h, "L").activelines[line])   -- uses line info
+    h = nil; collectgarbage()   -- release file before changing it
+  end
+  for i = 1, #c - 1 do
+    write(string.sub(c, 1, i))
+    local st, msg = loadfile(file, "bm")
+    assert(not st and string.find(msg, "truncated"))
+  end
+  write("return 20")
+  assert(loadfile(file, "tm")() == 20)
+  assert(not loadfile(file, "bm"))
+
+  -- lazy loading of nested functions (mode 'l')
+  local function mk ()
+    local a = 10
+    local function f1 (x) return x + a end
+    local function f2 (x)
+      local function f3 () return f1(x) * 2, "f3" end
+      return f3
+    end
+    return f1, f2
+  end
+  local d = string.dump(mk)
+  write(d)
+  for _, mode in ipairs{"bml", "bl"} do
+    local f1, f2 = assert(loadfile(file, mode))()
+    collectgarbage()
+    assert(f1(1) == 11)
+    local f3 = f2(5)
+    assert(select(2, f3()) == "f3" and f3() == 30)
+    assert(debug.getinfo(f3, "S").linedefined ==
+           debug.getinfo(select(2, mk())(5), "S").linedefined)
+    assert(string.dump(assert(loadfile(file, mode))) == d)
+    f1, f2, f3 = nil; collectgarbage()
+  end
+  for i = 1, #d - 1 do
+    write(string.sub(d, 1, i))
+    local st, msg = loadfile(file, "bml")
+    assert(not st and string.find(msg, "truncated"))
+  end
+
+  -- chunks in the older formats still load: format 0 (the official
+  -- one) has inline strings and no sizes for nested functions; format
+  -- 1 adds padding and sizes as lua_Integers. 'olddump' rewrites a
+  -- chunk in format 2 into one of them.
+  local function olddump (d, fmt)
+    local isz, nsz = string.byte(d, 14, 15)   -- integer and float sizes
+    local pos = 16 + isz + nsz + 1   -- skip header and 'sizeupvalues'
+    local out = {string.sub(d, 1, 5), string.char(fmt),
+                 string.sub(d, 7, pos - 1)}
+    local size = pos - 1   -- number of bytes in 'out'
+    local function put (s) out[#out + 1] = s; size = size + #s end
+    local function get (n)
+      pos = pos + n
+      return string.sub(d, pos - n, pos - 1)
+    end
+    local function varint ()
+      local x, b = 0
+      repeat b = string.byte(get(1)); x = (x << 7) | (b & 0x7f)
+      until b >= 0x80
+      return x
+    end
+    local function putvarint (x)
+      local s = string.char((x & 0x7f) | 0x80)
+      x = x >> 7
+      while x ~= 0 do s = string.char(x & 0x7f) .. s; x = x >> 7 end
+      put(s)
+    end
+    local function copy () local x = varint(); putvarint(x); return x end
+    local strings = {}
+    for i = 1, varint() do strings[i] = get(varint() - 1) end
+    local function str ()   -- string index -> inline string
+      local i = varint()
+      if i == 0 then putvarint(0)
+      else putvarint(#strings[i] + 1); put(strings[i])
+      end
+    end
+    local function func ()
+      str(); copy(); copy(); put(get(3))
+      local n = copy()   -- code
+      get(string.byte(get(1)))   -- skip padding
+      if fmt == 1 then
+        local pad = (4 - (size + 1) % 4) % 4
+        put(string.char(pad) .. string.rep("\0", pad))
+      end
+      put(get(4 * n))
+      for i = 1, copy() do   -- constants
+        local t = string.byte(get(1))
+        put(string.char(t))
+        if t == 0x03 then   -- integer: zigzag varint -> lua_Integer
+          local x = varint()
+          put(string.pack("j", (x >> 1) ~ -(x & 1)))
+        elseif t == 0x13 then put(get(nsz))   -- float
+        elseif t == 0x04 or t == 0x14 then str()   -- string
+        end
+      end
+      put(get(3 * copy()))   -- upvalues
+      for i = 1, copy() do   -- nested functions
+        get(4)   -- skip size
+        if fmt == 0 then func()
+        else
+          put(string.rep("\0", isz))
+          local k, start = #out, size
+          func()
+          out[k] = string.pack("j", size - start)
+        end
+      end
+      put(get(copy()))   -- line info
+      for i = 1, 2 * copy() do copy() end   -- absolute line info
+      for i = 1, copy() do str(); copy(); copy() end   -- local names
+      for i = 1, copy() do str() end   -- upvalue names
+    end
+    func()
+    assert(pos == #d + 1)
+    return table.concat(out)
+  end
+  for _, strip in ipairs{false, true} do
+    local d = string.dump(mk, strip)
+    for fmt = 0, 1 do
+      local o = olddump(d, fmt)
+      assert(string.byte(o, 6) == fmt and o ~= d)
+      write(o)
+      for _, mode in ipairs{"b", "bm", "bml"} do
+        local f1, f2 = assert(loadfile(file, mode))()
+        collectgarbage()
+        assert(f1(1) == 11 and f2(5)() == 30)
+        assert(string.dump(assert(loadfile(file, mode)), strip) == d)
+        f1, f2 = nil; collectgarbage()
+      end
+    end
+  end
+  -- a corrupt lazy body is a runtime error, raised when the function
+  -- is first needed
+  d = string.dump(load([[
+    local a = 10
+    local function f1 (x) return x + a end
+    return f1
+  ]], "=lazy"))
+  local i = string.find(d, "=lazy", 1, true) + 56   -- source of 'f1'
+  write(string.sub(d, 1, i - 1), "\xff", string.sub(d, i + 1))
+  local st, msg = xpcall(assert(loadfile(file, "bml")),
+                         function (m) return "handled: " .. m end)
+  assert(not st and
+         string.find(msg, "^handled: lazy:2: lazy: bad binary format"))
+  collectgarbage()
+  assert(os.remove(file))
 end
 
 print('OK')
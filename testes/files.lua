@@ -691,6 +691,112 @@ do
   assert(os.remove(file))
 end
 
+-- testing writes larger than buffers
+do
+  local big = string.rep("x", 100000)
+  local f = assert(io.open(file, "w"))
+  f:write("a", 1, 2.5, "\n")
+  f:write(big, "b", -3)
+  assert(f:seek() == 6 + 100000 + 3)
+  f:write("c")
+  assert(f:seek() == 6 + 100000 + 4)
+  assert(f:seek("cur", -4) == 6 + 100000)
+  f:write("b-3c")
+  f:seek("set", 2)
+  assert(f:write(big, 10) == f and f:seek() == 100004)
+  f:close()
+  local s = io.open(file):read("a")
+  assert(s == "a1" .. big .. "10xxb-3c")
+  -- many arguments, some of them numbers
+  local t = {}
+  for i = 1, 200 do t[i] = (i % 3 == 0) and i or string.rep("y", i * 10) end
+  f = assert(io.open(file, "w"))
+  assert(f:setvbuf("full", 1000))   -- small buffer
+  f:write(table.unpack(t))
+  f:close()
+  for i = 1, 200 do t[i] = tostring(t[i]) end
+  assert(io.open(file):read("a") == table.concat(t))
+  -- appending
+  f = assert(io.open(file, "a"))
+  f:write("z"):write(big):write("w")
+  f:close()
+  assert(io.open(file):read("a") == table.concat(t) .. "z" .. big .. "w")
+  -- large buffers, closed by the collector
+  f = assert(io.open(file, "w"))
+  assert(f:setvbuf("full", 2^20))
+  for i = 1, 1000 do f:write(i, "\n") end
+  f = nil; collectgarbage()
+  local n = 0
+  for l in io.lines(file) do n = n + 1; assert(math.tointeger(l) == n) end
+  assert(n == 1000)
+  -- replaced buffers are kept until the file is closed
+  f = assert(io.open(file, "w"))
+  assert(f:setvbuf("full", 100))
+  f:write("a")
+  assert(f:setvbuf("line", 200))
+  collectgarbage()
+  f:write("b\n")
+  assert(f:setvbuf("full"))
+  f:write("c")
+  f:close()
+  assert(io.open(file):read("a") == "ab\nc")
+  f = assert(io.open(file, "w"))
+  checkerr("invalid buffer size", f.setvbuf, f, "full", -1)
+  f:close()
+  if T then   -- buffers come from the state allocator
+    f = assert(io.open(file, "w"))
+    collectgarbage()
+    local m = T.totalmem()
+    assert(f:setvbuf("full", 10000))
+    assert(T.totalmem() >= m + 10000)
+    T.totalmem(T.totalmem() + 5000)   -- not enough for another buffer
+    local st, msg = pcall(f.setvbuf, f, "full", 10000)
+    T.totalmem(0)
+    assert(not st and msg == "not enough" .. " memory")
+    f:close()
+    assert(T.totalmem() < m + 10000)
+  end
+  assert(os.remove(file))
+end
+
+
+-- testing mapped files
+if pcall(io.mmap, file) then
+  local f = assert(io.open(file, "wb"))
+  f:write("first line\nsecond\0line\n", string.rep("x", 10000), "end")
+  f:close()
+  local m = assert(io.mmap(file))
+  assert(string.find(tostring(m), "^mapped file %(.*%)$"))
+  assert(#m == 23 + 10000 + 3)
+  assert(m:sub(1, 5) == "first" and m:sub(-3) == "end" and m:sub(5, 4) == "")
+  assert(m:sub() == io.open(file, "rb"):read("a"))
+  assert(m:sub(-100000, 3) == "fir" and m:sub(#m + 1) == "")
+  assert(m:byte() == string.byte("f") and m:byte(-1) == string.byte("d"))
+  assert(select("#", m:byte(1, 10)) == 10 and m:byte(#m + 1) == nil)
+  local i, j = m:find("second\0")
+  assert(i == 12 and j == 18)
+  assert(m:find("x", 100) == 100 and m:find("xend") == #m - 3)
+  assert(m:find("line", 3) == 7 and m:find("line", 8) == 19)
+  assert(not m:find("xendx"))
+  assert(m:find("", 4) == 4 and not m:find("end", -2))
+  assert(m:close())
+  assert(tostring(m) == "mapped file (closed)")
+  checkerr("closed mapped file", m.sub, m)
+  checkerr("closed mapped file", m.close, m)
+  m = nil   -- '__gc' ignores closed mappings
+  collectgarbage()
+
+  io.open(file, "w"):close()   -- empty file
+  do
+    local m <close> = assert(io.mmap(file))
+    assert(#m == 0 and m:sub() == "" and m:byte() == nil and m:find("") == 1)
+  end
+
+  local m, msg = io.mmap(file .. ".nonexistent")
+  assert(not m and string.find(msg, "nonexistent"))
+  assert(os.remove(file))
+end
+
 
 if not _soft then
   print("testing large files (> BUFSIZ)")
@@ -712,6 +818,95 @@ if not _soft then
   x = nil; y = nil
 end
 
+do  print("testing lines crossing buffer boundaries")
+  local t = {}
+  for i = 1, 400 do   -- lines with all lengths around common buffer sizes
+    t[i] = string.rep(string.char(65 + i % 26), (i * 37) % 5000)
+  end
+  t[#t + 1] = ""
+  t[#t + 1] = "last line without newline"
+  local data = table.concat(t, "\n")
+  local f = assert(io.open(file, "wb"))
+  f:write(data):close()
+  local i = 0
+  for l in io.lines(file) do i = i + 1; assert(l == t[i]) end
+  assert(i == #t)
+  -- mixing line reads with reads of single characters
+  f = assert(io.open(file, "rb"))
+  local pos = 1
+  while pos <= #data do
+    local c = f:read(1)
+    local l = (c == "\n") and "" or f:read("L") or ""
+    local e = string.find(data, "\n", pos, true) or #data
+    assert(c .. l == string.sub(data, pos, e))
+    pos = e + 1
+  end
+  assert(f:read("L") == nil)
+  f:close()
+
+  -- reading blocks of lines
+  f = assert(io.open(file, "rb"))
+  local b = {}
+  local n, b1 = f:readlines(7, b)
+  assert(n == 7 and b1 == b and #b == 7)
+  for i = 1, 7 do assert(b[i] == t[i]) end
+  local i = 7
+  repeat   -- reuse the table
+    n = f:readlines(100, b, "L")
+    for j = 1, n do
+      i = i + 1
+      assert(b[j] == t[i] .. (i < #t and "\n" or ""))
+    end
+  until n < 100
+  local b1 = b[1]
+  assert(i == #t and f:readlines(10, b) == 0 and b[1] == b1)
+  f:seek("set")
+  local n, b = f:readlines(#t + 10)
+  assert(n == #t and #b == #t and b[#t] == t[#t])
+  f:seek("set")
+  n, b = f:readlines(0)
+  assert(n == 0 and next(b) == nil and f:read("l") == t[1])
+  checkerr("negative", f.readlines, f, -1)
+  checkerr("table expected", f.readlines, f, 1, 10)
+  checkerr("invalid option", f.readlines, f, 1, nil, "a")
+  f:close()
+  io.input(file)
+  n, b = io.readlines(2)
+  assert(n == 2 and b[1] == t[1] and b[2] == t[2])
+  io.close(io.input())
+  checkerr("closed file", f.readlines, f, 1)
+  assert(os.remove(file))
+end
+
+do  -- reading numbers, many of them crossing buffer boundaries
+  local t = {}
+  for i = 1, 5000 do
+    t[i] = (i % 3 == 0) and tostring(i / 7) or (i % 3 == 1) and
+           tostring(-i * 1013) or string.format("0x%x", i)
+  end
+  local f = assert(io.open(file, "w"))
+  f:write(table.concat(t, (" "):rep(3)), "\n  0x1p4 .5e1 -0x.8\t12xuxu")
+  f:close()
+  local function check (i, v)
+    assert(v == tonumber(t[i]) and math.type(v) == math.type(tonumber(t[i])))
+  end
+  f = assert(io.open(file))
+  for i = 1, #t do check(i, f:read("n")) end
+  assert(f:read("n", "n", "n", "n") == 16)
+  f:seek("set")
+  local b = {}
+  local i, n = 0
+  repeat
+    n = f:readlines(777, b, "n")
+    for j = 1, n do i = i + 1; if i <= #t then check(i, b[j]) end end
+  until n < 777
+  assert(i == #t + 4 and b[n - 1] == -0.5 and b[n] == 12)
+  assert(f:read("a") == "xuxu")   -- stops at the first non numeral
+  assert(f:readlines(10, b, "n") == 0)
+  f:close()
+  assert(os.remove(file))
+end
+
 if not _port then
   local progname
   do  -- get name of running executable
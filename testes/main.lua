@@ -265,6 +265,51 @@ checkout("a\n")
 RUN([[lua "-eprint(1)" -ea=3 -e "print(a)" > %s]], out)
 checkout("1\n3\n")
 
+-- test option '-c'
+do
+  local src = os.tmpname()
+  local dst = os.tmpname()
+  local function readfile (name)
+    local f = assert(io.open(name, "rb"))
+    local s = f:read("a")
+    f:close()
+    return s
+  end
+  prepfile("print(select('#', ...))")
+  prepfile("local a = ...\nreturn a * 2", src)
+  RUN('lua -c %s %s=%s', prog, dst, src)
+  assert(readfile(prog .. ".luac") == string.dump(loadfile(prog)))
+  assert(readfile(dst) == string.dump(loadfile(src)))
+  RUN('lua %s.luac a b c > %s', prog, out)
+  checkout("3\n")
+  RUN('lua -s -c %s=%s', dst, src)   -- stripped
+  assert(readfile(dst) == string.dump(loadfile(src), true))
+  assert(loadfile(dst)(21) == 42)
+  -- errors are reported in the order of the files, after compiling all
+  assert(os.remove(prog .. ".luac"))
+  prepfile("x = = 1", src)
+  NoRun(src .. ":1: unexpected symbol near '='\ncannot open " .. src .. "x",
+        'lua -c %s=%s %s=%sx %s', dst, src, dst, src, prog)
+  assert(readfile(prog .. ".luac") == string.dump(loadfile(prog)))
+  assert(os.remove(prog .. ".luac"))
+  assert(os.remove(src))
+  assert(os.remove(dst))
+end
+
+-- test option '-b'
+do
+  local bname = os.tmpname()
+  prepfile("return require'debug'.getinfo(1, 'S').source")
+  for opt, source in pairs{[""] = "@" .. prog, ["-s"] = "=?",
+                           ["-t"] = "@" .. bname .. ":M"} do
+    RUN('lua -b %s %s M=%s', bname, opt, prog)
+    RUN('env LUA_BUNDLEPATH=%s lua -e "print((require[[M]]))" > %s',
+        bname, out)
+    checkout(source .. "\n")
+  end
+  assert(os.remove(bname))
+end
+
 -- test iteractive mode
 prepfile[[
 (6*2-6) -- ===
@@ -384,6 +429,8 @@ NoRun("unrecognized option '-iv'", "lua -iv")
 NoRun("'-e' needs argument", "lua -e")
 NoRun("syntax error", "lua -e a")
 NoRun("'-l' needs argument", "lua -l")
+NoRun("'-s' needs '-b' or '-c'", "lua -s -e 'x = 1'")
+NoRun("'-t' needs '-b'", "lua -t -c x")
 
 
 if T then   -- test library?
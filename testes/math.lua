@@ -435,6 +435,54 @@ if not _soft then
   assert(tonumber('0x.' .. string.rep('0', 1000) .. '74p4004') == 0x7.4)
 end
 
+if floatbits == 53 then
+  -- testing correct rounding of decimal numerals
+  local function eqF (s, x)
+    local y = tonumber(s)
+    return math.type(y) == "float" and string.format("%a", y) ==
+                                       string.format("%a", x)
+  end
+  assert(eqF("0.1", 0x1.999999999999ap-4))
+  assert(eqF("1e23", 0x1.52d02c7e14af6p+76))
+  assert(eqF("9007199254740993.0", 2^53))      -- half-way; round to even
+  assert(eqF("9007199254740995.0", 2^53 + 4))  -- half-way; round to even
+  assert(eqF("9007199254740993.0000000001", 2^53 + 2))
+  assert(eqF("9007199254740993" .. string.rep("0", 300) .. "1e-301",
+             2^53 + 2))
+  assert(eqF("0." .. string.rep("0", 399) .. "1e400", 1.0))
+  assert(eqF("1" .. string.rep("0", 400) .. "e-400", 1.0))
+  assert(eqF("-" .. string.rep("9", 40) .. "e-40", -1.0))
+  assert(eqF("1.7976931348623157e308", 0x1.fffffffffffffp+1023))
+  assert(eqF("1.7976931348623159e308", math.huge))
+  assert(eqF("2.2250738585072011e-308", 0x0.fffffffffffffp-1022))
+  assert(eqF("2.2250738585072012e-308", 0x1p-1022))
+  assert(eqF("4.9406564584124654e-324", 0x1p-1074))
+  assert(eqF("2.4703282292062327e-324", 0.0))
+  assert(eqF("2.4703282292062328e-324", 0x1p-1074))
+  assert(eqF("-0.0", -0.0) and eqF(" 0e999999 ", 0.0))
+  assert(eqF("1e-99999", 0.0) and eqF("1e99999", math.huge))
+  assert(eqF(" 12.5e-1\t", 1.25) and eqF("9223372036854775808", 2^63))
+  assert(eqF("-9223372036854775809", -2^63))
+  assert(eqF("1" .. string.rep("0", 19), 1e19))
+
+  -- numerals with enough digits must read back as the exact float
+  -- that C wrote
+  for i = 1, 2000 do
+    local x = math.random(minint, maxint)
+    x = string.unpack("d", string.pack("i8", x))   -- random bits
+    if x == x and math.abs(x) ~= math.huge then
+      for _, fmt in ipairs{"%.16e", "%.20e", "%.24e"} do
+        assert(eqF(string.format(fmt, x), x))
+      end
+      -- shorter numerals must not depend on how they are written
+      local s = string.format("%.12e", x)
+      local m, e = string.match(s, "^(.*)e(.*)$")
+      assert(eqF(s, tonumber(m .. "0000000e" .. e)))
+    end
+  end
+end
+
+
 -- testing 'tonumber' for invalid formats
 
 local function f (...)
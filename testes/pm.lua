@@ -388,6 +388,116 @@ assert(string.find("abc\0\0","\0.") == 4)
 assert(string.find("abcx\0\0abc\0abc","x\0\0abc\0a.") == 4)
 
 
+do   -- plain searches over long subjects
+  -- naive search, to check the results of 'string.find'
+  local function naive (s, p, init)
+    for i = init or 1, #s - #p + 1 do
+      if string.sub(s, i, i + #p - 1) == p then return i end
+    end
+    return nil
+  end
+  local subjects = {
+    string.rep(" ", 200) .. "end",
+    string.rep("a", 100) .. "ab" .. string.rep("a", 100),
+    string.rep("ab\0", 50) .. "abc" .. string.rep("ab\0", 50),
+    "2020-01-01 12:00:00  INFO   request    served      in  12ms\n",
+  }
+  local pats = {" ", "  ", " e", "end", "ab", "aab", "aaab", "abc",
+                "ab\0ab", "\0abc", "INFO", "12ms\n", "served      in", "x"}
+  for _, s in ipairs(subjects) do
+    for _, p in ipairs(pats) do
+      for init = 1, #s, 7 do
+        assert(string.find(s, p, init, true) == naive(s, p, init))
+      end
+    end
+    -- match at every position of the subject, including its end
+    for i = 1, #s do
+      local p = string.sub(s, i, i + 20)
+      assert(string.find(s, p, 1, true) == naive(s, p))
+      assert(string.find(s, p, i, true) == i)
+    end
+  end
+
+  -- gsub with plain patterns
+  local s = string.rep("a b  c   ", 30)
+  local r, n = string.gsub(s, "  ", "_")
+  assert(n == 60 and r == string.rep("a b_c_ ", 30))
+  assert(string.gsub(s, "c   a", "X", 2) ==
+         "a b  X b  X b  c   " .. string.rep("a b  c   ", 27))
+  r, n = string.gsub(s, "d", "X")
+  assert(n == 0 and r == s)
+  assert(string.gsub("abc\0abc\0", "c\0", "%%") == "ab%ab%")
+  assert(string.gsub("xxxxx", "xx", "%0y") == "xxyxxyx")
+end
+
+
+do   -- compiled patterns
+  -- many different patterns (more than the cache holds)
+  for i = 1, 300 do
+    local p = "(%d+)" .. string.rep("[x-z]", i % 7) .. "()" .. i
+    local s = "ab12" .. string.rep("y", i % 7) .. i
+    local d, pos = string.match(s, p)
+    assert(d == "12" and pos == 5 + i % 7)
+  end
+
+  -- a pattern evicted from the cache while 'gmatch' still uses it
+  local it = string.gmatch("k1=v1, k2=v2, k3=v3", "(%w+)=(%w+)")
+  local k, v = it()
+  assert(k == "k1" and v == "v1")
+  for i = 1, 300 do string.find("x", "[%a_]" .. i) end
+  k, v = it()
+  assert(k == "k2" and v == "v2")
+
+  -- same pattern used with and without anchor
+  assert(string.find("aab", "^a+b") == 1)
+  assert(not string.find("xaab", "^a+b"))
+  assert(string.find("xaab", "a+b") == 2)
+
+  -- errors in malformed patterns are raised only when reached
+  assert(not string.find("abc", "x%"))
+  assert(not string.find("abc", "x[a"))
+  checkerror("malformed", string.find, "xbc", "x[a")
+  checkerror("missing ']'", string.find, "x", "x[a")
+  checkerror("ends with '%%'", string.find, "x", "x%")
+
+  -- patterns too long to be compiled
+  local p = string.rep("%a", 200) .. "(%d)"
+  local s = string.rep("x", 200) .. "7"
+  assert(string.match(s, p) == "7")
+  assert(string.match(s .. s, p) == "7")
+end
+
+
+do   -- skipping positions where a match cannot start
+  -- reference: try an anchored match at each position
+  local function slowfind (s, p)
+    for i = 1, #s + 1 do
+      local r = {string.find(s, "^" .. p, i)}
+      if r[1] then return table.unpack(r) end
+    end
+    return nil
+  end
+  local s = string.rep("....  ", 50) .. "id=42 x=(a.b) end ab" ..
+            string.rep("~", 40) .. "zz9 "
+  local pats = {"id=(%d+)", "(x)=%((.-)%)", "z+%d", "()end", "[xyz]=",
+                "%d%d", "%s+e", "a%.b", "[%u]", "b$", "b %f[%p]", "%.+a",
+                "(i)(d)=", "%bab", "a?b", "~+z", "[^%.%s]+", "%%", "zz9 $"}
+  for _, p in ipairs(pats) do
+    local r1 = {string.find(s, p)}
+    local r2 = {slowfind(s, p)}
+    assert(#r1 == #r2)
+    for i = 1, #r1 do assert(r1[i] == r2[i]) end
+  end
+  assert(string.gsub(s, "id=(%d+)", "<%1>") ==
+         (string.gsub(s, "id=42", "<42>")))
+  local t = {}
+  for w in string.gmatch(s, "%a+") do t[#t + 1] = w end
+  assert(table.concat(t, ",") == "id,x,a,b,end,ab,zz")
+  assert(select(2, string.gsub(s, "%d", "")) == 3)
+  assert(string.gsub("abc abc", "c+", "C") == "abC abC")
+end
+
+
 do   -- test reuse of original string in gsub
   local s = string.rep("a", 100)
   local r = string.gsub(s, "b", "c")   -- no match
@@ -417,5 +527,25 @@ do   -- test reuse of original string in gsub
   assert(r == s and string.format("%p", s) ~= string.format("%p", r))
 end
 
+
+-- compiled patterns follow changes in the locale
+do
+  local function isalpha () return string.find("\xe1", "^%a$") ~= nil end
+  local function gmatchalpha ()
+    local n = 0
+    for _ in string.gmatch("\xe1a\xe1", "%a") do n = n + 1 end
+    return n
+  end
+  assert(os.setlocale("C", "ctype"))
+  assert(not isalpha() and gmatchalpha() == 1)
+  if os.setlocale("pt_BR.ISO-8859-1", "ctype") or
+     os.setlocale("pt_BR.iso88591", "ctype") or
+     os.setlocale("ptb", "ctype") then
+    assert(isalpha() and gmatchalpha() == 3)
+    assert(os.setlocale("C", "ctype"))
+    assert(not isalpha() and gmatchalpha() == 1)
+  end   -- (a missing pt_BR locale is already reported by 'literals.lua')
+end
+
 print('OK')
 
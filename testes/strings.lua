@@ -126,6 +126,32 @@ assert(string.reverse"\0001234" == "4321\0")
 
 for i=0,30 do assert(string.len(string.rep('a', i)) == i) end
 
+do  -- long strings (processed by blocks)
+  local all = {}
+  for c = 0, 255 do all[#all + 1] = string.char(c) end
+  all = table.concat(all)
+  for _, s in ipairs{all, string.rep("aZ\200", 100), string.rep("x", 1000)} do
+    for _, i in ipairs{1, 2, 17, 33, 100} do   -- various alignments
+      local s = string.sub(s, i)
+      local r = string.reverse(s)
+      assert(#r == #s)
+      for j = 1, #s, 7 do
+        assert(string.byte(r, #s - j + 1) == string.byte(s, j))
+      end
+      local lower = string.gsub(s, ".", string.lower)   -- one char at a time
+      local upper = string.gsub(s, ".", string.upper)
+      assert(string.lower(s) == lower and string.upper(s) == upper)
+    end
+  end
+  for n = 1, 40 do
+    local s = string.rep("abc", n, "--")
+    assert(#s == 3 * n + 2 * (n - 1))
+    assert(s == "abc" .. string.rep("--abc", n - 1))
+    assert(string.rep("xy", n) == string.gsub(string.rep("-", n), "-", "xy"))
+  end
+end
+
+
 assert(type(tostring(nil)) == 'string')
 assert(type(tostring(12)) == 'string')
 assert(string.find(tostring{}, 'table:'))
@@ -154,6 +180,41 @@ else   -- compatible coercion
   assert(tostring(-1203 + 0.0) == "-1203")
 end
 
+do   -- conversion of numbers to strings
+  local values = {0.1, 1/3, -2/3, 1e15, 1e14 + 0.5, 123456.789e-30, 2^53,
+    2^63, -2^-1074, 2^-1022, 1.7976931348623157e308, 1e-4, 1e-5, 0.5e-4,
+    5e-5 + 1e-20, 9.9999999999999e14, 0.30000000000000004, 100.25}
+  for i = 1, 200 do values[#values + 1] = i / 7 * 10.0^(i % 40 - 20) end
+  if tostring(1/3) == string.format("%.14g", 1/3) then   -- fixed digits
+    for _, x in ipairs(values) do
+      x = math.abs(x)
+      local s = string.format("%.14g", x)
+      if not string.find(s, "[^-0-9]") then s = s .. ".0" end
+      assert(tostring(x) == s and tostring(-x) == "-" .. s)
+    end
+  else   -- shortest numerals
+    for _, x in ipairs(values) do
+      assert(tonumber(tostring(x)) == x)
+      assert(#tostring(x) <= #string.format("%.17g", x) + 2)
+    end
+    assert(tostring(0.1) == "0.1" and tostring(-1e100) == "-1e+100")
+  end
+  assert(tostring(math.mininteger) == string.format("%d", math.mininteger))
+  assert(tostring(math.maxinteger) == string.format("%d", math.maxinteger))
+  for i = -1000, 1000, 7 do
+    assert(tostring(i) == string.format("%5d", i):gsub(" ", ""))
+  end
+
+  -- fast paths in 'format'
+  assert(string.format("%d|%s|%s", 3.0, 1.5, -7) == "3|1.5|-7")
+  assert(string.format("%i%s", -10, 2^63) == "-10" .. tostring(2^63))
+  assert(string.format("%3d|%-4s|", 3, 1) == "  3|1   |")
+  local debug = require"debug"
+  debug.setmetatable(0, {__tostring = function (x) return "N" .. x end})
+  assert(string.format("%s %d", 10, 10) == "N10 10")
+  debug.setmetatable(0, nil)
+end
+
 do  -- tests for '%p' format
   -- not much to test, as C does not specify what '%p' does.
   -- ("The value of the pointer is converted to a sequence of printing
@@ -260,6 +321,39 @@ assert(string.format("%+08d", 31501) == "+0031501")
 assert(string.format("%+08d", -30927) == "-0030927")
 
 
+do   -- compiled formats (each format runs several times, from the cache)
+  local function check (fmt, res, ...)
+    for i = 1, 3 do
+      assert(string.format(fmt, ...) == res)
+    end
+  end
+  check("%5d|%-5d|%05d|%-05d", "   42|42   |00042|42   ", 42, 42, 42, 42)
+  check("%05d|%5d|%2d", "-0042|  -42|-42", -42, -42, -42)
+  check("%x|%X|%04x|%-4X|", "ff|FF|00ff|FF  |", 255, 255, 255, 255)
+  check("%4x|%02x", "   a|0a", 10.0, 10.0)    -- floats go through C
+  check("%5s|%-5s|%s|%2s", "   ab|ab   |ab|abc", "ab", "ab", "ab", "abc")
+  check("%5s|%-4s", "   12|2.5 ", 12, 2.5)
+  check("%%d%%%d%%", "%d%7%", 7)
+  check("a\0%sb\0", "a\0\0x\0b\0", "\0x\0")
+  check("%q", [["a\"\\\
+\0\0011\31\127"]], 'a"\\\n\0\0011\31\127')
+  check("%q|%q", "10|-3", 10, -3)
+  for i = 1, 3 do
+    checkerror("no value", string.format, "%d %s", 1)
+    checkerror("number expected", string.format, "%d", "x")
+    checkerror("contains zeros", string.format, "%-3s", "\0")
+  end
+  local mt = getmetatable("")
+  mt.__tostring = function (s) return "<" .. s .. ">" end
+  check("%s|%3s|%s", "<a>|<b>|1", "a", "b", 1)
+  mt.__tostring = nil
+  check("%s|%3s", "a|  b", "a", "b")
+  local fmt = "%s" .. string.rep("-", 100)    -- a long format
+  check(fmt, "x" .. string.rep("-", 100), "x")
+  check(fmt .. "%d", "x" .. string.rep("-", 100) .. "1", "x", 1)
+end
+
+
 do    -- longest number that can be formatted
   local i = 1
   local j = 10000
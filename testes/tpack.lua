@@ -318,5 +318,62 @@ do    -- testing initial position
  
 end
 
+do
+  print("testing precompiled layouts")
+  local fmt = "<i4 !4 s2 x Xi8 d z >I2 c5"
+  local p = string.packer(fmt)
+  local u = string.unpacker(fmt)
+  local x = p(7, "hello", 3.5, "zz", 1000, "abc")
+  assert(x == pack(fmt, 7, "hello", 3.5, "zz", 1000, "abc"))
+  local a, b, c, d, e, f, pos = u(x)
+  assert(a == 7 and b == "hello" and c == 3.5 and d == "zz" and
+         e == 1000 and f == "abc\0\0" and pos == #x + 1)
+  assert(select("#", u(x)) == 7)
+  -- alignment depends on the initial position
+  local u = string.unpacker("!4 i4")
+  local y = pack("i4i4i4i4", 1, 2, 3, 4)
+  for pos = 0, 12 do
+    local i, p = u(y, pos + 1)
+    assert(i == (pos + 3)//4 + 1 and p == i*4 + 1)
+  end
+  checkerror("too short", u, y, 14)
+  checkerror("out of string", u, y, #y + 2)
+  checkerror("integer overflow", string.packer("i1"), 200)
+  checkerror("invalid format option 'r'", string.packer, "i4r")
+  checkerror("next option", string.unpacker, "Xz")
+  assert(string.packer("")() == "")
+  assert(select("#", string.unpacker("")("")) == 1)
+
+  -- many records
+  local rec = "<b i8 s1"
+  local u = string.unpacker(rec)
+  local x = {}
+  for i = 1, 100 do x[i] = pack(rec, i, -i, tostring(i)) end
+  local s = table.concat(x)
+  local t, pos = u(s, 1, 100)
+  assert(#t == 300 and pos == #s + 1)
+  for i = 1, 100 do
+    assert(t[3*i - 2] == i and t[3*i - 1] == -i and t[3*i] == tostring(i))
+  end
+  local t1 = {}
+  local t2, pos = u(s, #x[1] + 1, 2, t1)
+  assert(t2 == t1 and #t1 == 6 and t1[1] == 2 and t1[6] == "3" and
+         pos == #x[1] + #x[2] + #x[3] + 1)
+  local t, pos = u(s, 5, 0)
+  assert(next(t) == nil and pos == 5)
+  checkerror("too short", u, s, 1, 101)
+  checkerror("negative", u, s, 1, -1)
+  checkerror("table expected", u, s, 1, 1, 10)
+  -- records that read nothing cannot be counted
+  checkerror("no size", string.unpacker(""), "", 1, math.maxinteger, {})
+  checkerror("no size", string.unpacker("c0 Xi4"), "abc", 1, 1)
+  assert(next((string.unpacker("")("", 1, 0))) == nil)
+  checkerror("too short", u, s, 1, math.maxinteger, {})
+  checkerror("unfinished string", string.unpacker("z"), "a\0b\0", 1, 3)
+  checkerror("too short", string.unpacker("z"), "a\0b\0", 1, 5)
+  t = string.unpacker("z")("a\0b\0", 1, 2)
+  assert(#t == 2 and t[1] == "a" and t[2] == "b")
+end
+
 print "OK"
 
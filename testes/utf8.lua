@@ -165,6 +165,15 @@ checkerror("value out of range", utf8.char, -1)
 local function invalid (s)
   checkerror("invalid UTF%-8 code", utf8.codepoint, s)
   assert(not utf8.len(s))
+  assert(not utf8.valid(s) and utf8.valid(s, 2, 1))
+  -- inside long strings, where it crosses blocks of bytes
+  for i = 1, 40 do
+    local pre = string.rep("a", i)
+    local l = pre .. s .. string.rep("\u{7FF}", 40)
+    local n, p = utf8.len(l)
+    assert(not n and p == i + 1 and not utf8.valid(l))
+    assert(utf8.len(l, 1, i) == i)
+  end
 end
 
 -- UTF-8 representation for 0x11ffff (value out of valid range)
@@ -226,6 +235,26 @@ check("𨳊𩶘𦧺𨳒𥄫𤓓\xF4\x8F\xBF\xBF",
       {0x28CCA, 0x29D98, 0x269FA, 0x28CD2, 0x2512B, 0x244D3, 0x10ffff})
 
 
+do   -- long strings
+  local s = string.rep("abc\u{10FFFF}xy\u{7FF}zw\u{FFFF}", 100)
+  local n = utf8.len(s)
+  assert(n == 10 * 100 and utf8.valid(s) and utf8.valid(s, 1, -1, true))
+  for i = 1, n, 13 do
+    local p = utf8.offset(s, i)
+    assert(utf8.len(s, 1, p) == i and utf8.len(s, p) == n - i + 1)
+    assert(utf8.offset(s, i - n - 1) == p)
+    assert(utf8.offset(s, n - i + 1, p) == utf8.offset(s, n))
+    assert(utf8.offset(s, -i, utf8.offset(s, n)) == utf8.offset(s, n - i))
+  end
+  assert(not utf8.offset(s, n + 2) and utf8.offset(s, n + 1) == #s + 1)
+  assert(not utf8.offset(s, -n - 1) and utf8.offset(s, -n) == 1)
+  assert(utf8.valid(s .. "\xF4\x8F\xBF\xBF") and
+         not utf8.valid(s .. "\xF4\x8F\xBF"))
+  assert(select(2, utf8.len(s .. "\xF4\x8F\xBF")) == #s + 1)
+  assert(utf8.valid(s .. "\xF4\x90\x80\x80", 1, -1, true))
+end
+
+
 local i = 0
 for p, c in string.gmatch(x, "()(" .. utf8.charpattern .. ")") do
   i = i + 1